@@ -14,6 +14,10 @@
 
 #define PART_BITS 4
 
+static bool use_bio;
+module_param(use_bio, bool, S_IRUGO);
+MODULE_PARM_DESC(use_bio, "Map bios straight to the virtqueue, bypassing the elevator");
+
 static int major;
 static DEFINE_IDA(vd_index_ida);
 
@@ -32,6 +36,9 @@ struct virtio_blk
 	/* Request tracking. */
 	struct list_head reqs;
 
+	/* bio submitters waiting for room in the virtqueue */
+	wait_queue_head_t queue_wait;
+
 	mempool_t *pool;
 
 	/* Process context for config space updates */
@@ -46,6 +53,9 @@ struct virtio_blk
 	/* What host tells us, plus 2 for header & tailer. */
 	unsigned int sg_elems;
 
+	/* VIRTIO_BLK_T_DISCARD or _WRITE_ZEROES, what REQ_DISCARD becomes */
+	u32 discard_type;
+
 	/* Ida index - used to track minor number allocations. */
 	int index;
 
@@ -57,54 +67,93 @@ struct virtblk_req
 {
 	struct list_head list;
 	struct request *req;
+	struct bio *bio;
 	struct virtio_blk_outhdr out_hdr;
 	struct virtio_scsi_inhdr in_hdr;
+	struct virtio_blk_discard_write_zeroes range;
 	u8 status;
+	/* Only allocated with use_bio, requests share vblk->sg. */
+	struct scatterlist sg[];
 };
 
+static inline int virtblk_result(struct virtblk_req *vbr)
+{
+	switch (vbr->status) {
+	case VIRTIO_BLK_S_OK:
+		return 0;
+	case VIRTIO_BLK_S_UNSUPP:
+		return -ENOTTY;
+	default:
+		return -EIO;
+	}
+}
+
+static inline struct virtblk_req *virtblk_alloc_req(struct virtio_blk *vblk,
+						    gfp_t gfp_mask)
+{
+	struct virtblk_req *vbr;
+
+	vbr = mempool_alloc(vblk->pool, gfp_mask);
+	if (vbr && use_bio)
+		sg_init_table(vbr->sg, vblk->sg_elems);
+
+	return vbr;
+}
+
+static void virtblk_request_done(struct virtio_blk *vblk,
+				 struct virtblk_req *vbr)
+{
+	struct request *req = vbr->req;
+	int error = virtblk_result(vbr);
+
+	switch (req->cmd_type) {
+	case REQ_TYPE_BLOCK_PC:
+		req->resid_len = vbr->in_hdr.residual;
+		req->sense_len = vbr->in_hdr.sense_len;
+		req->errors = vbr->in_hdr.errors;
+		break;
+	case REQ_TYPE_SPECIAL:
+		req->errors = (error != 0);
+		break;
+	default:
+		break;
+	}
+
+	__blk_end_request_all(req, error);
+	mempool_free(vbr, vblk->pool);
+}
+
+static void virtblk_bio_done(struct virtio_blk *vblk,
+			     struct virtblk_req *vbr)
+{
+	bio_endio(vbr->bio, virtblk_result(vbr));
+	mempool_free(vbr, vblk->pool);
+}
+
 static void blk_done(struct virtqueue *vq)
 {
 	struct virtio_blk *vblk = vq->vdev->priv;
 	struct virtblk_req *vbr;
 	unsigned int len;
 	unsigned long flags;
+	bool done = false;
 
 	spin_lock_irqsave(&vblk->lock, flags);
 	while ((vbr = virtqueue_get_buf(vblk->vq, &len)) != NULL) {
-		int error;
-
-		switch (vbr->status) {
-		case VIRTIO_BLK_S_OK:
-			error = 0;
-			break;
-		case VIRTIO_BLK_S_UNSUPP:
-			error = -ENOTTY;
-			break;
-		default:
-			error = -EIO;
-			break;
-		}
-
-		switch (vbr->req->cmd_type) {
-		case REQ_TYPE_BLOCK_PC:
-			vbr->req->resid_len = vbr->in_hdr.residual;
-			vbr->req->sense_len = vbr->in_hdr.sense_len;
-			vbr->req->errors = vbr->in_hdr.errors;
-			break;
-		case REQ_TYPE_SPECIAL:
-			vbr->req->errors = (error != 0);
-			break;
-		default:
-			break;
-		}
-
-		__blk_end_request_all(vbr->req, error);
 		list_del(&vbr->list);
-		mempool_free(vbr, vblk->pool);
+		if (vbr->bio)
+			virtblk_bio_done(vblk, vbr);
+		else
+			virtblk_request_done(vblk, vbr);
+		done = true;
 	}
 	/* In case queue is stopped waiting for more buffers. */
 	blk_start_queue(vblk->disk->queue);
 	spin_unlock_irqrestore(&vblk->lock, flags);
+
+	/* Either path may have filled the ring a bio submitter waits on. */
+	if (done)
+		wake_up(&vblk->queue_wait);
 }
 
 static bool do_req(struct request_queue *q, struct virtio_blk *vblk,
@@ -113,17 +162,27 @@ static bool do_req(struct request_queue *q, struct virtio_blk *vblk,
 	unsigned long num, out = 0, in = 0;
 	struct virtblk_req *vbr;
 
-	vbr = mempool_alloc(vblk->pool, GFP_ATOMIC);
+	vbr = virtblk_alloc_req(vblk, GFP_ATOMIC);
 	if (!vbr)
 		/* When another request finishes we'll try again. */
 		return false;
 
 	vbr->req = req;
+	vbr->bio = NULL;
 
 	if (req->cmd_flags & REQ_FLUSH) {
 		vbr->out_hdr.type = VIRTIO_BLK_T_FLUSH;
 		vbr->out_hdr.sector = 0;
 		vbr->out_hdr.ioprio = req_get_ioprio(vbr->req);
+	} else if (req->cmd_flags & REQ_DISCARD) {
+		vbr->out_hdr.type = vblk->discard_type;
+		vbr->out_hdr.sector = 0;
+		vbr->out_hdr.ioprio = req_get_ioprio(vbr->req);
+		vbr->range.sector = blk_rq_pos(vbr->req);
+		vbr->range.num_sectors = blk_rq_sectors(vbr->req);
+		vbr->range.flags =
+			vblk->discard_type == VIRTIO_BLK_T_WRITE_ZEROES ?
+			VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP : 0;
 	} else {
 		switch (req->cmd_type) {
 		case REQ_TYPE_FS:
@@ -158,7 +217,12 @@ static bool do_req(struct request_queue *q, struct virtio_blk *vblk,
 	if (vbr->req->cmd_type == REQ_TYPE_BLOCK_PC)
 		sg_set_buf(&vblk->sg[out++], vbr->req->cmd, vbr->req->cmd_len);
 
-	num = blk_rq_map_sg(q, vbr->req, vblk->sg + out);
+	/* A discard carries its range instead of data pages. */
+	if (req->cmd_flags & REQ_DISCARD) {
+		sg_set_buf(&vblk->sg[out++], &vbr->range, sizeof(vbr->range));
+		num = 0;
+	} else
+		num = blk_rq_map_sg(q, vbr->req, vblk->sg + out);
 
 	if (vbr->req->cmd_type == REQ_TYPE_BLOCK_PC) {
 		sg_set_buf(&vblk->sg[num + out + in++], vbr->req->sense, SCSI_SENSE_BUFFERSIZE);
@@ -211,6 +275,92 @@ static void do_virtblk_request(struct request_queue *q)
 		virtqueue_kick(vblk->vq);
 }
 
+static void virtblk_add_buf_wait(struct virtio_blk *vblk,
+				 struct virtblk_req *vbr,
+				 unsigned long out, unsigned long in)
+{
+	DEFINE_WAIT(wait);
+
+	for (;;) {
+		prepare_to_wait_exclusive(&vblk->queue_wait, &wait,
+					  TASK_UNINTERRUPTIBLE);
+
+		spin_lock_irq(&vblk->lock);
+		if (virtqueue_add_buf(vblk->vq, vbr->sg, out, in, vbr,
+				      GFP_ATOMIC) >= 0) {
+			list_add_tail(&vbr->list, &vblk->reqs);
+			virtqueue_kick(vblk->vq);
+			spin_unlock_irq(&vblk->lock);
+			break;
+		}
+		spin_unlock_irq(&vblk->lock);
+		io_schedule();
+	}
+
+	finish_wait(&vblk->queue_wait, &wait);
+}
+
+/*
+ * With use_bio, plain reads and writes go straight from the bio to the
+ * ring: no request allocation, merging or elevator. Flushes and FUA
+ * writes still go through blk_queue_bio() so the flush machinery sees
+ * them, discards so that do_req() builds their range, and SCSI/GET_ID
+ * requests never come through here at all.
+ */
+static void virtblk_make_request(struct request_queue *q, struct bio *bio)
+{
+	struct virtio_blk *vblk = q->queuedata;
+	unsigned long num, out = 0, in = 0;
+	struct virtblk_req *vbr;
+
+	if (bio->bi_rw & (REQ_FLUSH | REQ_FUA | REQ_DISCARD)) {
+		blk_queue_bio(q, bio);
+		return;
+	}
+
+	BUG_ON(bio_phys_segments(q, bio) + 2 > vblk->sg_elems);
+
+	vbr = virtblk_alloc_req(vblk, GFP_NOIO);
+	if (!vbr) {
+		bio_endio(bio, -ENOMEM);
+		return;
+	}
+
+	vbr->req = NULL;
+	vbr->bio = bio;
+	vbr->out_hdr.type = 0;
+	vbr->out_hdr.sector = bio->bi_sector;
+	vbr->out_hdr.ioprio = bio_prio(bio);
+
+	sg_set_buf(&vbr->sg[out++], &vbr->out_hdr, sizeof(vbr->out_hdr));
+
+	num = blk_bio_map_sg(q, bio, vbr->sg + out);
+
+	sg_set_buf(&vbr->sg[num + out + in++], &vbr->status,
+		   sizeof(vbr->status));
+
+	if (num) {
+		if (bio->bi_rw & REQ_WRITE) {
+			vbr->out_hdr.type |= VIRTIO_BLK_T_OUT;
+			out += num;
+		} else {
+			vbr->out_hdr.type |= VIRTIO_BLK_T_IN;
+			in += num;
+		}
+	}
+
+	spin_lock_irq(&vblk->lock);
+	if (unlikely(virtqueue_add_buf(vblk->vq, vbr->sg, out, in, vbr,
+				       GFP_ATOMIC) < 0)) {
+		spin_unlock_irq(&vblk->lock);
+		virtblk_add_buf_wait(vblk, vbr, out, in);
+		return;
+	}
+	list_add_tail(&vbr->list, &vblk->reqs);
+	virtqueue_kick(vblk->vq);
+	spin_unlock_irq(&vblk->lock);
+}
+
 /* return id (s/n) string for *disk to *id_str
  */
 static int virtblk_get_id(struct gendisk *disk, char *id_str)
@@ -411,7 +561,9 @@ static int __devinit virtblk_probe(struct virtio_device *vdev)
 	u64 cap;
 	u32 v, blk_size, sg_elems, opt_io_size;
 	u16 min_io_size;
-	u8 physical_block_exp, alignment_offset;
+	u8 physical_block_exp, alignment_offset, may_unmap;
+	u32 max_discard, discard_align;
+	size_t pool_size;
 
 	err = ida_simple_get(&vd_index_ida, 0, minor_to_index(1 << MINORBITS),
 			     GFP_KERNEL);
@@ -438,6 +590,7 @@ static int __devinit virtblk_probe(struct virtio_device *vdev)
 	}
 
 	INIT_LIST_HEAD(&vblk->reqs);
+	init_waitqueue_head(&vblk->queue_wait);
 	spin_lock_init(&vblk->lock);
 	vblk->vdev = vdev;
 	vblk->sg_elems = sg_elems;
@@ -450,7 +603,10 @@ static int __devinit virtblk_probe(struct virtio_device *vdev)
 	if (err)
 		goto out_free_vblk;
 
-	vblk->pool = mempool_create_kmalloc_pool(1,sizeof(struct virtblk_req));
+	pool_size = sizeof(struct virtblk_req);
+	if (use_bio)
+		pool_size += sizeof(struct scatterlist) * sg_elems;
+	vblk->pool = mempool_create_kmalloc_pool(1, pool_size);
 	if (!vblk->pool) {
 		err = -ENOMEM;
 		goto out_free_vq;
@@ -471,6 +627,10 @@ static int __devinit virtblk_probe(struct virtio_device *vdev)
 
 	q->queuedata = vblk;
 
+	/* Before the limits below, blk_queue_make_request() resets them. */
+	if (use_bio)
+		blk_queue_make_request(q, virtblk_make_request);
+
 	virtblk_name_format("vd", index, vblk->disk->disk_name, DISK_NAME_LEN);
 
 	vblk->disk->major = major;
@@ -554,6 +714,46 @@ static int __devinit virtblk_probe(struct virtio_device *vdev)
 	if (!err && opt_io_size)
 		blk_queue_io_opt(q, blk_size * opt_io_size);
 
+	/*
+	 * There is no write-zeroes operation in this block layer, so an
+	 * unmapping write zeroes is what REQ_DISCARD becomes when the host
+	 * has one: the range is released and reads back as zeroes, which
+	 * lets mkfs skip zeroing it. Otherwise use a plain discard.
+	 */
+	err = virtio_config_val(vdev, VIRTIO_BLK_F_WRITE_ZEROES,
+			offsetof(struct virtio_blk_config, write_zeroes_may_unmap),
+			&may_unmap);
+	if (!err && may_unmap) {
+		vblk->discard_type = VIRTIO_BLK_T_WRITE_ZEROES;
+		err = virtio_config_val(vdev, VIRTIO_BLK_F_WRITE_ZEROES,
+			offsetof(struct virtio_blk_config, max_write_zeroes_sectors),
+			&max_discard);
+	} else if (virtio_has_feature(vdev, VIRTIO_BLK_F_DISCARD)) {
+		vblk->discard_type = VIRTIO_BLK_T_DISCARD;
+		err = virtio_config_val(vdev, VIRTIO_BLK_F_DISCARD,
+			offsetof(struct virtio_blk_config, max_discard_sectors),
+			&max_discard);
+	} else
+		vblk->discard_type = 0;
+
+	if (vblk->discard_type) {
+		/* One range per request, max_discard_seg does not matter. */
+		if (err || !max_discard)
+			max_discard = UINT_MAX >> 9;
+		blk_queue_max_discard_sectors(q, max_discard);
+
+		err = virtio_config_val(vdev, VIRTIO_BLK_F_DISCARD,
+			offsetof(struct virtio_blk_config, discard_sector_alignment),
+			&discard_align);
+		if (!err && discard_align)
+			q->limits.discard_granularity = discard_align << 9;
+		else
+			q->limits.discard_granularity = blk_size;
+
+		if (vblk->discard_type == VIRTIO_BLK_T_WRITE_ZEROES)
+			q->limits.discard_zeroes_data = 1;
+		queue_flag_set_unlocked(QUEUE_FLAG_DISCARD, q);
+	}
 
 	add_disk(vblk->disk);
 	err = device_create_file(disk_to_dev(vblk->disk), &dev_attr_serial);
@@ -654,7 +854,8 @@ static const struct virtio_device_id id_table[] = {
 static unsigned int features[] = {
 	VIRTIO_BLK_F_SEG_MAX, VIRTIO_BLK_F_SIZE_MAX, VIRTIO_BLK_F_GEOMETRY,
 	VIRTIO_BLK_F_RO, VIRTIO_BLK_F_BLK_SIZE, VIRTIO_BLK_F_SCSI,
-	VIRTIO_BLK_F_FLUSH, VIRTIO_BLK_F_TOPOLOGY
+	VIRTIO_BLK_F_FLUSH, VIRTIO_BLK_F_TOPOLOGY, VIRTIO_BLK_F_DISCARD,
+	VIRTIO_BLK_F_WRITE_ZEROES
 };
 
 /*
@@ -0,0 +1,601 @@
+/*
+ * Virtio GL passthrough transport for emulator
+ *
+ * Copyright (c) 2011 - 2012 Samsung Electronics Co., Ltd. All rights reserved.
+ *
+ * Contact:
+ * YeongKyoon Lee <yeongkyoon.lee@samsung.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Contributors:
+ * - S-Core Co., Ltd
+ */
+
+/*
+ * The GL library hands its command and vertex buffers to the host
+ * without copying them: VIRTIO_GL_IOC_SUBMIT pins the user pages and
+ * queues them as one scatter-gather request, the completion is read()
+ * back later. A process may keep up to VIRTIO_GL_MAX_INFLIGHT requests
+ * outstanding and wait for them with poll().
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/sched.h>
+#include <linux/poll.h>
+#include <linux/rwsem.h>
+#include <linux/uaccess.h>
+#include <linux/miscdevice.h>
+#include <linux/scatterlist.h>
+#include <linux/virtio.h>
+#include <linux/virtio_gl.h>
+
+#define DEVICE_NAME "glmem"
+
+struct virtio_gl {
+	struct virtio_device *vdev;
+	struct virtqueue *vq;
+
+	/* protects vq */
+	spinlock_t lock;
+	/* submitters waiting for free descriptors */
+	wait_queue_head_t space;
+	unsigned int reaped;
+	bool dead;			/* being removed, queue nothing */
+
+	/* sg entries a request may use, header and status included */
+	unsigned int max_sg;
+};
+
+/*
+ * The host offers a single GL device. Files outlive it, so submitters
+ * hold vgl_sem for reading while they use vgl and remove() clears it
+ * with the semaphore held for writing.
+ */
+static struct virtio_gl *vgl;
+static DECLARE_RWSEM(vgl_sem);
+
+struct virtio_gl_file {
+	spinlock_t lock;
+	wait_queue_head_t wait;
+	struct list_head done;		/* completed, not read yet */
+	unsigned int inflight;		/* submitted, not read yet */
+	unsigned int queued;		/* owned by the host */
+};
+
+struct virtio_gl_req {
+	struct list_head list;
+	struct virtio_gl_file *vf;
+
+	struct virtio_gl_hdr hdr;
+	struct virtio_gl_status status;
+
+	struct page **pages;
+	unsigned int nr_pages;
+	unsigned int nr_out_pages;	/* the rest is written by the host */
+
+	unsigned int out, in;
+	struct scatterlist sg[0];
+};
+
+static struct virtio_device_id id_table[] = {
+	{ VIRTIO_ID_GL, VIRTIO_DEV_ANY_ID },
+	{ 0 },
+};
+
+static unsigned int vgl_buf_pages(const struct virtio_gl_buf *buf)
+{
+	unsigned long first = buf->addr >> PAGE_SHIFT;
+	unsigned long last = (buf->addr + buf->len - 1) >> PAGE_SHIFT;
+
+	return buf->len ? last - first + 1 : 0;
+}
+
+static void vgl_unpin(struct virtio_gl_req *req)
+{
+	unsigned int i;
+
+	for (i = 0; i < req->nr_pages; i++) {
+		if (i >= req->nr_out_pages)
+			set_page_dirty_lock(req->pages[i]);
+		put_page(req->pages[i]);
+	}
+	req->nr_pages = 0;
+}
+
+static void vgl_free_req(struct virtio_gl_req *req)
+{
+	vgl_unpin(req);
+	kfree(req->pages);
+	kfree(req);
+}
+
+/* Pin one user buffer and append its pages to the request's sg list */
+static int vgl_pin_buf(struct virtio_gl_req *req, const struct virtio_gl_buf *buf,
+		int write)
+{
+	unsigned long addr = buf->addr;
+	unsigned int len = buf->len;
+	unsigned int nr = vgl_buf_pages(buf);
+	struct page **pages = req->pages + req->nr_pages;
+	struct scatterlist *sg = req->sg + req->out + req->in;
+	unsigned int i;
+	int pinned;
+
+	if (!nr)
+		return 0;
+
+	pinned = get_user_pages_fast(addr, nr, write, pages);
+	if (pinned < 0)
+		return pinned;
+	req->nr_pages += pinned;
+	if (pinned < nr)
+		return -EFAULT;
+
+	for (i = 0; i < nr; i++) {
+		unsigned int off = offset_in_page(addr);
+		unsigned int n = min_t(unsigned int, len, PAGE_SIZE - off);
+
+		sg_set_page(&sg[i], pages[i], n, off);
+		addr += n;
+		len -= n;
+	}
+
+	if (write) {
+		req->in += nr;
+		req->hdr.in_len += buf->len;
+	} else {
+		req->out += nr;
+		req->hdr.out_len += buf->len;
+	}
+	return 0;
+}
+
+static struct virtio_gl_req *vgl_build_req(struct virtio_gl_file *vf,
+		const struct virtio_gl_submit *submit, const struct virtio_gl_buf *bufs)
+{
+	struct virtio_gl_req *req;
+	unsigned int nr_pages = 0;
+	unsigned int i;
+	int err;
+
+	for (i = 0; i < submit->nr_bufs; i++) {
+		if (bufs[i].flags & ~VIRTIO_GL_BUF_IN)
+			return ERR_PTR(-EINVAL);
+		if (bufs[i].addr != (unsigned long)bufs[i].addr ||
+		    (unsigned long)bufs[i].addr + bufs[i].len < bufs[i].addr)
+			return ERR_PTR(-EFAULT);
+		nr_pages += vgl_buf_pages(&bufs[i]);
+	}
+	if (nr_pages + 2 > vgl->max_sg)
+		return ERR_PTR(-E2BIG);
+
+	req = kzalloc(sizeof(*req) + (nr_pages + 2) * sizeof(req->sg[0]),
+			GFP_KERNEL);
+	if (!req)
+		return ERR_PTR(-ENOMEM);
+	req->pages = kmalloc(max(nr_pages, 1U) * sizeof(req->pages[0]), GFP_KERNEL);
+	if (!req->pages) {
+		kfree(req);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	req->vf = vf;
+	req->hdr.pid = task_tgid_nr(current);
+	req->hdr.nr_bufs = submit->nr_bufs;
+	req->hdr.id = submit->id;
+	sg_init_table(req->sg, nr_pages + 2);
+	sg_set_buf(&req->sg[0], &req->hdr, sizeof(req->hdr));
+	req->out = 1;
+
+	/* everything the host reads has to precede what it writes */
+	for (i = 0; i < submit->nr_bufs; i++) {
+		if (bufs[i].flags & VIRTIO_GL_BUF_IN)
+			continue;
+		err = vgl_pin_buf(req, &bufs[i], 0);
+		if (err)
+			goto fail;
+	}
+	req->nr_out_pages = req->nr_pages;
+	for (i = 0; i < submit->nr_bufs; i++) {
+		if (!(bufs[i].flags & VIRTIO_GL_BUF_IN))
+			continue;
+		err = vgl_pin_buf(req, &bufs[i], 1);
+		if (err)
+			goto fail;
+	}
+
+	sg_set_buf(&req->sg[req->out + req->in], &req->status, sizeof(req->status));
+	req->in++;
+	return req;
+
+fail:
+	vgl_free_req(req);
+	return ERR_PTR(err);
+}
+
+static int vgl_queue_req(struct virtio_gl_req *req, bool nonblock)
+{
+	struct virtio_gl_file *vf = req->vf;
+	bool notify;
+	int err;
+
+	for (;;) {
+		unsigned int reaped;
+
+		spin_lock_irq(&vgl->lock);
+		if (vgl->dead) {
+			spin_unlock_irq(&vgl->lock);
+			return -ENODEV;
+		}
+		reaped = vgl->reaped;
+		err = virtqueue_add_buf(vgl->vq, req->sg, req->out, req->in, req,
+				GFP_ATOMIC);
+		if (err >= 0) {
+			spin_lock(&vf->lock);
+			vf->queued++;
+			spin_unlock(&vf->lock);
+			notify = virtqueue_kick_prepare(vgl->vq);
+			spin_unlock_irq(&vgl->lock);
+			if (notify)
+				virtqueue_notify(vgl->vq);
+			return 0;
+		}
+		spin_unlock_irq(&vgl->lock);
+
+		if (err != -ENOSPC)
+			return err;
+		if (nonblock)
+			return -EAGAIN;
+		/* the callback bumps reaped whenever descriptors come back */
+		err = wait_event_interruptible(vgl->space,
+				ACCESS_ONCE(vgl->reaped) != reaped ||
+				ACCESS_ONCE(vgl->dead));
+		if (err)
+			return err;
+	}
+}
+
+static long vgl_submit(struct virtio_gl_file *vf, struct file *filp,
+		void __user *argp)
+{
+	bool nonblock = filp->f_flags & O_NONBLOCK;
+	struct virtio_gl_buf bufs[VIRTIO_GL_MAX_BUFS];
+	struct virtio_gl_submit submit;
+	struct virtio_gl_req *req;
+	int err;
+
+	if (copy_from_user(&submit, argp, sizeof(submit)))
+		return -EFAULT;
+	if (!submit.nr_bufs || submit.nr_bufs > VIRTIO_GL_MAX_BUFS || submit.reserved)
+		return -EINVAL;
+	if (copy_from_user(bufs, (void __user *)(unsigned long)submit.bufs,
+				submit.nr_bufs * sizeof(bufs[0])))
+		return -EFAULT;
+
+	/* reserve a completion slot, this bounds the pages a process pins */
+	spin_lock_irq(&vf->lock);
+	while (vf->inflight >= VIRTIO_GL_MAX_INFLIGHT) {
+		spin_unlock_irq(&vf->lock);
+		if (nonblock)
+			return -EAGAIN;
+		err = wait_event_interruptible(vf->wait,
+				ACCESS_ONCE(vf->inflight) < VIRTIO_GL_MAX_INFLIGHT);
+		if (err)
+			return err;
+		spin_lock_irq(&vf->lock);
+	}
+	vf->inflight++;
+	spin_unlock_irq(&vf->lock);
+
+	down_read(&vgl_sem);
+	if (!vgl) {
+		err = -ENODEV;
+		goto out_unlock;
+	}
+
+	req = vgl_build_req(vf, &submit, bufs);
+	if (IS_ERR(req)) {
+		err = PTR_ERR(req);
+		goto out_unlock;
+	}
+
+	err = vgl_queue_req(req, nonblock);
+	if (err) {
+		vgl_free_req(req);
+		goto out_unlock;
+	}
+	up_read(&vgl_sem);
+	return 0;
+
+out_unlock:
+	up_read(&vgl_sem);
+	spin_lock_irq(&vf->lock);
+	vf->inflight--;
+	spin_unlock_irq(&vf->lock);
+	wake_up_interruptible(&vf->wait);
+	return err;
+}
+
+static void vgl_complete(struct virtio_gl_req *req, int status)
+{
+	struct virtio_gl_file *vf = req->vf;
+	unsigned long flags;
+
+	if (status)
+		req->status.status = status;
+
+	spin_lock_irqsave(&vf->lock, flags);
+	list_add_tail(&req->list, &vf->done);
+	vf->queued--;
+	spin_unlock_irqrestore(&vf->lock, flags);
+	wake_up_interruptible(&vf->wait);
+}
+
+static void vgl_done(struct virtqueue *vq)
+{
+	struct virtio_gl_req *req;
+	unsigned long flags;
+	unsigned int len;
+
+	spin_lock_irqsave(&vgl->lock, flags);
+	do {
+		virtqueue_disable_cb(vq);
+		while ((req = virtqueue_get_buf(vq, &len)) != NULL) {
+			vgl_complete(req, len < sizeof(req->status) ? -EIO : 0);
+			vgl->reaped++;
+		}
+	} while (!virtqueue_enable_cb(vq));
+	spin_unlock_irqrestore(&vgl->lock, flags);
+
+	wake_up_interruptible(&vgl->space);
+}
+
+static ssize_t vgl_read(struct file *filp, char __user *buf, size_t count,
+		loff_t *ppos)
+{
+	struct virtio_gl_file *vf = filp->private_data;
+	struct virtio_gl_completion c;
+	struct virtio_gl_req *req;
+	ssize_t ret = 0;
+	int err;
+
+	if (count < sizeof(c))
+		return -EINVAL;
+
+	spin_lock_irq(&vf->lock);
+	while (list_empty(&vf->done)) {
+		spin_unlock_irq(&vf->lock);
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		err = wait_event_interruptible(vf->wait, !list_empty(&vf->done));
+		if (err)
+			return err;
+		spin_lock_irq(&vf->lock);
+	}
+
+	while (count - ret >= sizeof(c) && !list_empty(&vf->done)) {
+		req = list_first_entry(&vf->done, struct virtio_gl_req, list);
+		list_del(&req->list);
+		spin_unlock_irq(&vf->lock);
+
+		c.id = req->hdr.id;
+		c.status = req->status.status;
+		c.len = req->status.len;
+		if (copy_to_user(buf + ret, &c, sizeof(c))) {
+			/* keep the completion for the next read() */
+			spin_lock_irq(&vf->lock);
+			list_add(&req->list, &vf->done);
+			if (!ret)
+				ret = -EFAULT;
+			break;
+		}
+		vgl_free_req(req);
+		ret += sizeof(c);
+
+		spin_lock_irq(&vf->lock);
+		vf->inflight--;
+	}
+	spin_unlock_irq(&vf->lock);
+
+	wake_up_interruptible(&vf->wait);
+	return ret;
+}
+
+static unsigned int vgl_poll(struct file *filp, poll_table *wait)
+{
+	struct virtio_gl_file *vf = filp->private_data;
+	unsigned int mask = 0;
+
+	poll_wait(filp, &vf->wait, wait);
+
+	spin_lock_irq(&vf->lock);
+	if (!list_empty(&vf->done))
+		mask |= POLLIN | POLLRDNORM;
+	if (vf->inflight < VIRTIO_GL_MAX_INFLIGHT)
+		mask |= POLLOUT | POLLWRNORM;
+	spin_unlock_irq(&vf->lock);
+
+	return mask;
+}
+
+static long vgl_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct virtio_gl_file *vf = filp->private_data;
+
+	switch (cmd) {
+	case VIRTIO_GL_IOC_SUBMIT:
+		return vgl_submit(vf, filp, (void __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+static int vgl_open(struct inode *inode, struct file *filp)
+{
+	struct virtio_gl_file *vf;
+
+	vf = kzalloc(sizeof(*vf), GFP_KERNEL);
+	if (!vf)
+		return -ENOMEM;
+
+	spin_lock_init(&vf->lock);
+	init_waitqueue_head(&vf->wait);
+	INIT_LIST_HEAD(&vf->done);
+	filp->private_data = vf;
+
+	return nonseekable_open(inode, filp);
+}
+
+static int vgl_release(struct inode *inode, struct file *filp)
+{
+	struct virtio_gl_file *vf = filp->private_data;
+	struct virtio_gl_req *req, *tmp;
+
+	/* the host may still be writing into pinned pages */
+	wait_event(vf->wait, ACCESS_ONCE(vf->queued) == 0);
+
+	list_for_each_entry_safe(req, tmp, &vf->done, list) {
+		list_del(&req->list);
+		vgl_free_req(req);
+	}
+	kfree(vf);
+
+	return 0;
+}
+
+static const struct file_operations vgl_fops = {
+	.owner = THIS_MODULE,
+	.open = vgl_open,
+	.release = vgl_release,
+	.read = vgl_read,
+	.poll = vgl_poll,
+	.unlocked_ioctl = vgl_ioctl,
+	.compat_ioctl = vgl_ioctl,
+	.llseek = no_llseek,
+};
+
+static struct miscdevice vgl_miscdev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = DEVICE_NAME,
+	.fops = &vgl_fops,
+};
+
+static int vgl_probe(struct virtio_device *vdev)
+{
+	int err;
+
+	if (vgl) {
+		printk(KERN_ERR "%s: only one device is supported\n", DEVICE_NAME);
+		return -EBUSY;
+	}
+
+	vgl = kzalloc(sizeof(*vgl), GFP_KERNEL);
+	if (!vgl)
+		return -ENOMEM;
+
+	vgl->vdev = vdev;
+	vdev->priv = vgl;
+	spin_lock_init(&vgl->lock);
+	init_waitqueue_head(&vgl->space);
+
+	vgl->vq = virtio_find_single_vq(vdev, vgl_done, "gl");
+	if (IS_ERR(vgl->vq)) {
+		err = PTR_ERR(vgl->vq);
+		goto out_free;
+	}
+
+	/*
+	 * An indirect table takes a single slot, but the ring falls back
+	 * to direct descriptors when the table cannot be allocated, so
+	 * never queue more than the ring holds.
+	 */
+	vgl->max_sg = virtqueue_get_vring_size(vgl->vq);
+
+	err = misc_register(&vgl_miscdev);
+	if (err)
+		goto out_del_vqs;
+
+	printk(KERN_INFO "%s: %u segments per request\n", DEVICE_NAME,
+			vgl->max_sg - 2);
+	return 0;
+
+out_del_vqs:
+	vdev->config->del_vqs(vdev);
+out_free:
+	kfree(vgl);
+	vgl = NULL;
+	return err;
+}
+
+static void __devexit vgl_remove(struct virtio_device *vdev)
+{
+	struct virtio_gl_req *req;
+	unsigned int len;
+
+	misc_deregister(&vgl_miscdev);
+
+	/* turn away new requests and the submitters waiting for room */
+	spin_lock_irq(&vgl->lock);
+	vgl->dead = true;
+	spin_unlock_irq(&vgl->lock);
+	wake_up_interruptible(&vgl->space);
+
+	vdev->config->reset(vdev);
+
+	/* fail whatever the host did not complete, so release() can go on */
+	spin_lock_irq(&vgl->lock);
+	while ((req = virtqueue_get_buf(vgl->vq, &len)) != NULL)
+		vgl_complete(req, len < sizeof(req->status) ? -EIO : 0);
+	while ((req = virtqueue_detach_unused_buf(vgl->vq)) != NULL)
+		vgl_complete(req, -ENODEV);
+	spin_unlock_irq(&vgl->lock);
+
+	/* open files fail their submits from now on */
+	down_write(&vgl_sem);
+	vdev->config->del_vqs(vdev);
+	kfree(vgl);
+	vgl = NULL;
+	up_write(&vgl_sem);
+}
+
+static struct virtio_driver virtio_gl_driver = {
+	.driver.name = KBUILD_MODNAME,
+	.driver.owner = THIS_MODULE,
+	.id_table = id_table,
+	.probe = vgl_probe,
+	.remove = __devexit_p(vgl_remove),
+};
+
+static int __init virtio_gl_init(void)
+{
+	return register_virtio_driver(&virtio_gl_driver);
+}
+
+static void __exit virtio_gl_exit(void)
+{
+	unregister_virtio_driver(&virtio_gl_driver);
+}
+
+module_init(virtio_gl_init);
+module_exit(virtio_gl_exit);
+
+MODULE_DEVICE_TABLE(virtio, id_table);
+MODULE_DESCRIPTION("Virtio GL passthrough transport");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,75 @@
+/*
+ * Asynchronous driver registration for the maru devices
+ *
+ * Copyright (C) 2012 Samsung Electronics Co., Ltd. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Contributors:
+ * - S-Core Co., Ltd
+ *
+ */
+
+#ifndef _MARU_ASYNC_H
+#define _MARU_ASYNC_H
+
+#include <linux/async.h>
+#include <linux/ktime.h>
+
+/*
+ * The maru drivers register (and so probe) their devices from
+ * async_schedule() instead of the initcall, so the probes run in
+ * parallel with each other and with the rest of the boot.
+ *
+ * Synchronization points:
+ *  - kernel_init() and module loading wait for all async work before
+ *    userspace runs or the module's init section is freed;
+ *  - module exit calls maru_async_unregister(), which waits for the
+ *    registration before undoing it, and skips the undo if it failed.
+ *
+ * Each registration reports how long it took, which is the probe cost
+ * of the devices found at that point.
+ */
+struct maru_async_driver {
+	const char *name;
+	int (*reg)(void);
+	void (*unreg)(void);
+	int err;
+};
+
+static void maru_async_register_fn(void *data, async_cookie_t cookie)
+{
+	struct maru_async_driver *drv = data;
+	ktime_t start = ktime_get();
+
+	drv->err = drv->reg();
+	printk(KERN_INFO "%s: probed in %lld us%s\n", drv->name,
+			(long long)ktime_us_delta(ktime_get(), start),
+			drv->err ? ", failed" : "");
+}
+
+static inline void maru_async_register(struct maru_async_driver *drv)
+{
+	async_schedule(maru_async_register_fn, drv);
+}
+
+static inline void maru_async_unregister(struct maru_async_driver *drv)
+{
+	async_synchronize_full();
+	if (!drv->err)
+		drv->unreg();
+}
+
+#endif /* _MARU_ASYNC_H */
@@ -37,6 +37,9 @@
 
 #include <asm/uaccess.h>
 
+#include "maru_display.h"
+#include "maru_async.h"
+
 #define MARUBL_DRIVER_NAME "svb"
 #define PCI_DEVICE_ID_VIRTUAL_BRIGHTNESS	0x1014
 
@@ -96,6 +99,9 @@ static int marubl_send_intensity(struct backlight_device *bd)
 	writel(off, marubl_device->marubl_mmreg + 0x04);
 	marubl_device->brightness = intensity;
 
+	/* nobody sees the screen, let the host and maru_fb rest */
+	marufb_set_display_power(MARU_DISPLAY_BL, !off);
+
 	return 0;
 }
 
@@ -187,6 +193,7 @@ static void __devexit marubl_exit(struct pci_dev *pcidev)
 	backlight_update_status(bd);
 
 	backlight_device_unregister(bd);
+	marufb_set_display_power(MARU_DISPLAY_BL, 1);
 
 	/*
 	 * Unregister pci device & delete device
@@ -210,16 +217,33 @@ static struct pci_driver marubl_pci_driver = {
 #endif
 };
 
-static int __init marubl_module_init(void)
+static int marubl_register(void)
 {
 	return pci_register_driver(&marubl_pci_driver);
 }
 
-static void __exit marubl_module_exit(void)
+static void marubl_unregister(void)
 {
 	pci_unregister_driver(&marubl_pci_driver);
 }
 
+static struct maru_async_driver marubl_async = {
+	.name = MARUBL_DRIVER_NAME,
+	.reg = marubl_register,
+	.unreg = marubl_unregister,
+};
+
+static int __init marubl_module_init(void)
+{
+	maru_async_register(&marubl_async);
+	return 0;
+}
+
+static void __exit marubl_module_exit(void)
+{
+	maru_async_unregister(&marubl_async);
+}
+
 /*
  * if this is compiled into the kernel, we need to ensure that the
  * class is registered before users of the class try to register lcd's
@@ -27,7 +27,7 @@
  */
 
 /*
- * Some code based on vivi driver or videobuf_vmalloc.
+ * Some code based on vivi driver or videobuf2_vmalloc.
  *
  */
 
@@ -46,11 +46,15 @@
 #include <asm/page.h>
 #include <asm/pgtable.h>
 #include <linux/interrupt.h>
+#include <linux/dma-mapping.h>
 #include <linux/videodev2.h>
-#include <media/videobuf-core.h>
+#include <media/videobuf2-core.h>
+#include <media/videobuf2-memops.h>
 #include <media/v4l2-device.h>
 #include <media/v4l2-ioctl.h>
 
+#include "maru_async.h"
+
 #define MARUCAM_DEBUG_LEVEL	0
 
 static unsigned debug;
@@ -112,6 +116,44 @@ MODULE_LICENSE("GPL");
 #define MARUCAM_DTC            0x50
 #define MARUCAM_REQFRAME       0x54
 
+/*
+ * Each capture buffer owns a slot of the device memory at
+ * index * PAGE_ALIGN(image size). Writing an index to MARUCAM_REQFRAME
+ * hands that slot to the host, which fills the requested slots in order.
+ * Each read of MARUCAM_ISR pops one filled slot, 0 when none is left.
+ *
+ * Only a host which reads MARUCAM_SLOT_ISR_ON back from MARUCAM_SLOT_ISR
+ * queues the requests and reports the slot. Older hosts fill the one
+ * slot requested last and raise a bare interrupt.
+ */
+#define MARUCAM_ISR_FRAME		0x1
+#define MARUCAM_ISR_INDEX(isr)		(((isr) >> 8) & 0xFF)
+
+#define MARUCAM_MIN_BUFFERS		2
+#define MARUCAM_DFL_BUFFERS		4
+#define MARUCAM_MAX_BUFFERS		BITS_PER_LONG
+
+/*
+ * Parameter page: the guest physical address of a struct marucam_param
+ * written to MARUCAM_PARAM_ADDR. A host which reads the same address back
+ * takes the arguments of MARUCAM_S_PARAM ... MARUCAM_ENUM_FINTV from in[]
+ * and stores the results to out[] and ret, in the order of the
+ * MARUCAM_S_DATA and MARUCAM_G_DATA accesses they replace.
+ */
+#define MARUCAM_PARAM_ADDR     0x58
+#define MARUCAM_SLOT_ISR       0x5C
+
+#define MARUCAM_SLOT_ISR_ON		0x1
+
+#define MARUCAM_PARAM_IN	8
+#define MARUCAM_PARAM_OUT	16
+
+struct marucam_param {
+	uint32_t	ret;
+	uint32_t	in[MARUCAM_PARAM_IN];
+	uint32_t	out[MARUCAM_PARAM_OUT];
+};
+
 enum marucam_opstate {
 	S_IDLE = 0,
 	S_RUNNING = 1
@@ -139,9 +181,26 @@ struct marucam_device {
 	unsigned int			width;
 	unsigned int			height;
 	unsigned int			pixelformat;
-	struct videobuf_queue		vb_vidq;
+	enum v4l2_field			field;
+	struct vb2_queue		vb_vidq;
+	unsigned int			sequence;
+
+	/* slots of the device memory in use by a buffer */
+	unsigned long			slots;
 
 	struct list_head		active;
+
+	/* the host queues REQFRAME and reports the slot in MARUCAM_ISR */
+	bool				slot_isr;
+
+	/* NULL if the host only knows the S_DATA/G_DATA registers */
+	struct marucam_param		*param;
+	dma_addr_t			param_dma;
+};
+
+struct marucam_buffer {
+	struct vb2_buffer		vb;
+	struct list_head		list;
 };
 
 /*
@@ -150,189 +209,121 @@ struct marucam_device {
 static struct marucam_device *marucam_instance;
 
 /*
- * The code below has been modified from 'videobuf_vmalloc.c'.
+ * The code below is a videobuf2 allocator whose buffers are slots
+ * of the device memory, see MARUCAM_REQFRAME.
  */
 
-#define MAGIC_MARUCAM_MEM 0x18221223
-
-#define MAGIC_CHECK(is, should)	\
-	do { \
-		if (unlikely((is) != (should))) { \
-			marucam_err("magic mismatch: %x (expected %x)\n", \
-								is, should); \
-			BUG(); \
-		} \
-	} while (0)
-
-struct videobuf_marucam_memory {
-	u32	magic;
-	u32	mapped;
+struct marucam_mem {
+	struct marucam_device		*dev;
+	unsigned int			slot;
+	unsigned long			size;
+	atomic_t			refcount;
+	struct vb2_vmarea_handler	handler;
 };
 
-static void
-videobuf_vm_open(struct vm_area_struct *vma)
+static void marucam_mem_put(void *buf_priv)
 {
-	struct videobuf_mapping *map = vma->vm_private_data;
+	struct marucam_mem *mem = buf_priv;
 
-	map->count++;
+	if (atomic_dec_and_test(&mem->refcount)) {
+		clear_bit(mem->slot, &mem->dev->slots);
+		kfree(mem);
+	}
 }
 
-static void videobuf_vm_close(struct vm_area_struct *vma)
+static void *marucam_mem_alloc(void *alloc_ctx, unsigned long size)
 {
-	struct videobuf_mapping *map = vma->vm_private_data;
-	struct videobuf_queue *q = map->q;
-	int i;
-
-	map->count--;
-	if (0 == map->count) {
-		struct videobuf_marucam_memory *mem;
-
-		mutex_lock(&q->vb_lock);
-
-		if (q->streaming)
-			videobuf_queue_cancel(q);
-
-		for (i = 0; i < VIDEO_MAX_FRAME; i++) {
-			if (NULL == q->bufs[i])
-				continue;
-
-			if (q->bufs[i]->map != map)
-				continue;
-
-			mem = q->bufs[i]->priv;
-			if (mem) {
-				MAGIC_CHECK(mem->magic, MAGIC_MARUCAM_MEM);
-				mem->mapped = 0;
-			}
-
-			q->bufs[i]->map   = NULL;
-			q->bufs[i]->baddr = 0;
+	struct marucam_device *dev = alloc_ctx;
+	struct marucam_mem *mem;
+	unsigned int slot;
+
+	size = PAGE_ALIGN(size);
+
+	mem = kzalloc(sizeof(struct marucam_mem), GFP_KERNEL);
+	if (!mem)
+		return NULL;
+
+	do {
+		slot = find_first_zero_bit(&dev->slots, MARUCAM_MAX_BUFFERS);
+		if ((slot + 1) * size > dev->mem_size) {
+			marucam_err("no slot left in the device memory\n");
+			kfree(mem);
+			return NULL;
 		}
+	} while (test_and_set_bit(slot, &dev->slots));
 
-		kfree(map);
-
-		mutex_unlock(&q->vb_lock);
-	}
+	mem->dev = dev;
+	mem->slot = slot;
+	mem->size = size;
+	mem->handler.refcount = &mem->refcount;
+	mem->handler.put = marucam_mem_put;
+	mem->handler.arg = mem;
+	atomic_set(&mem->refcount, 1);
 
-	return;
+	return mem;
 }
 
-static const struct vm_operations_struct videobuf_vm_ops = {
-	.open	= videobuf_vm_open,
-	.close	= videobuf_vm_close,
-};
-
-static struct videobuf_buffer *__videobuf_alloc_vb(size_t size)
+static void *marucam_mem_vaddr(void *buf_priv)
 {
-	struct videobuf_marucam_memory *mem;
-	struct videobuf_buffer *vb;
-
-	vb = kzalloc(size + sizeof(*mem), GFP_KERNEL);
-	if (vb == NULL) {
-		marucam_err("failed to memalloc\n");
-		return vb;
-	}
-
-	mem = vb->priv = ((char *)vb) + size;
-	mem->magic = MAGIC_MARUCAM_MEM;
-
-	return vb;
+	/* the slots are only mapped to userspace */
+	return NULL;
 }
 
-static int __videobuf_iolock(struct videobuf_queue *q,
-				struct videobuf_buffer *vb,
-				struct v4l2_framebuffer *fbuf)
+static void *marucam_mem_cookie(void *buf_priv)
 {
-	struct videobuf_marucam_memory *mem = vb->priv;
-
-	BUG_ON(!mem);
-
-	MAGIC_CHECK(mem->magic, MAGIC_MARUCAM_MEM);
+	return buf_priv;
+}
 
-	switch (vb->memory) {
-	case V4L2_MEMORY_MMAP:
-		if (!mem->mapped) {
-			marucam_err("memory is not mmapped.\n");
-			return -EINVAL;
-		}
-		break;
-	default:
-		marucam_err("Memory method currently unsupported.\n");
-		return -EINVAL;
-	}
+static unsigned int marucam_mem_num_users(void *buf_priv)
+{
+	struct marucam_mem *mem = buf_priv;
 
-	return 0;
+	return atomic_read(&mem->refcount);
 }
 
-static int __videobuf_mmap_mapper(struct videobuf_queue *q,
-			struct videobuf_buffer *buf, struct vm_area_struct *vma)
+static int marucam_mem_mmap(void *buf_priv, struct vm_area_struct *vma)
 {
-	struct videobuf_marucam_memory *mem;
-	struct videobuf_mapping *map;
-	int retval, pages;
+	struct marucam_mem *mem = buf_priv;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	int ret;
 
-	map = kzalloc(sizeof(struct videobuf_mapping), GFP_KERNEL);
-	if (NULL == map) {
-		marucam_err("failed to memalloc\n");
-		return -ENOMEM;
+	if (size > mem->size) {
+		marucam_err("buffer is out of its slot\n");
+		return -EINVAL;
 	}
 
-	buf->map = map;
-	map->q = q;
-
-	buf->baddr = vma->vm_start;
-
-	mem = buf->priv;
-	BUG_ON(!mem);
-	mem->mapped = 1;
-	MAGIC_CHECK(mem->magic, MAGIC_MARUCAM_MEM);
-
-	pages = PAGE_ALIGN(vma->vm_end - vma->vm_start);
-
 	vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
-	retval = remap_pfn_range(vma, vma->vm_start,
-			(((struct marucam_device *)q->priv_data)->mem_base
-			+ vma->vm_pgoff) >> PAGE_SHIFT,
-			pages, vma->vm_page_prot);
-	if (retval < 0) {
-		marucam_err("remap failed with error %d.", retval);
-		mem->mapped = 0;
-		goto error;
+	ret = remap_pfn_range(vma, vma->vm_start,
+			(mem->dev->mem_base + mem->slot * mem->size)
+			>> PAGE_SHIFT, size, vma->vm_page_prot);
+	if (ret < 0) {
+		marucam_err("remap failed with error %d.", ret);
+		return ret;
 	}
 
-	vma->vm_ops		= &videobuf_vm_ops;
 	vma->vm_flags		|= VM_DONTEXPAND | VM_RESERVED;
-	vma->vm_private_data	= map;
+	vma->vm_private_data	= &mem->handler;
+	vma->vm_ops		= &vb2_common_vm_ops;
 
-	videobuf_vm_open(vma);
+	vma->vm_ops->open(vma);
 
 	return 0;
-
-error:
-	mem = NULL;
-	kfree(map);
-	return -ENOMEM;
 }
 
-static struct videobuf_qtype_ops qops = {
-	.magic		= MAGIC_QTYPE_OPS,
-	.alloc_vb	= __videobuf_alloc_vb,
-	.iolock		= __videobuf_iolock,
-	.mmap_mapper	= __videobuf_mmap_mapper,
+static const struct vb2_mem_ops marucam_memops = {
+	.alloc		= marucam_mem_alloc,
+	.put		= marucam_mem_put,
+	.vaddr		= marucam_mem_vaddr,
+	.cookie		= marucam_mem_cookie,
+	.num_users	= marucam_mem_num_users,
+	.mmap		= marucam_mem_mmap,
 };
 
-void videobuf_queue_marucam_init(struct videobuf_queue *q,
-			 struct videobuf_queue_ops *ops,
-			 void *dev,
-			 spinlock_t *irqlock,
-			 enum v4l2_buf_type type,
-			 enum v4l2_field field,
-			 unsigned int msize,
-			 void *priv,
-			 struct mutex *ext_lock)
+static unsigned int marucam_buffer_slot(struct vb2_buffer *vb)
 {
-	videobuf_queue_core_init(q, ops, dev, irqlock, type, field, msize,
-				 priv, &qops, ext_lock);
+	struct marucam_mem *mem = vb2_plane_cookie(vb, 0);
+
+	return mem->slot;
 }
 
 
@@ -363,43 +354,103 @@ static int get_image_size(struct marucam_device *dev)
 	return size;
 }
 
-static void marucam_fillbuf(struct marucam_device *dev)
+/* Called with slock held. */
+static void marucam_buffer_done(struct marucam_device *dev,
+				struct marucam_buffer *buf)
 {
-	struct videobuf_queue *q = &dev->vb_vidq;
-	struct videobuf_buffer *buf = NULL;
+	do_gettimeofday(&buf->vb.v4l2_buf.timestamp);
+	buf->vb.v4l2_buf.sequence = dev->sequence++;
+	buf->vb.v4l2_buf.field = dev->field;
+	vb2_buffer_done(&buf->vb, VB2_BUF_STATE_DONE);
+}
+
+/*
+ * Complete the buffer whose slot the host has just filled.
+ * The buffer stays DONE until it is dequeued, even if nobody waits yet.
+ */
+static void marucam_fillbuf(struct marucam_device *dev, unsigned int index)
+{
+	struct marucam_buffer *buf;
 	unsigned long flags = 0;
 
-	spin_lock_irqsave(q->irqlock, flags);
+	spin_lock_irqsave(&dev->slock, flags);
 	if (dev->opstate != S_RUNNING) {
 		marucam_err("state is not S_RUNNING\n");
 		goto done;
 	}
-	if (list_empty(&dev->active)) {
-		marucam_err("list_empty failed\n");
+
+	list_for_each_entry(buf, &dev->active, list) {
+		if (marucam_buffer_slot(&buf->vb) != index)
+			continue;
+
+		list_del(&buf->list);
+		marucam_buffer_done(dev, buf);
 		goto done;
 	}
 
-	buf = list_entry(dev->active.next, struct videobuf_buffer, queue);
-	if (!waitqueue_active(&buf->done)) {
-		marucam_err("waitqueue_active failed\n");
+	marucam_err("buffer of slot %u is not queued\n", index);
+
+done:
+	spin_unlock_irqrestore(&dev->slock, flags);
+}
+
+/*
+ * Without MARUCAM_SLOT_ISR the host has filled the slot requested last,
+ * the one of the oldest buffer, and waits for the next request.
+ */
+static void marucam_fillbuf_legacy(struct marucam_device *dev)
+{
+	struct marucam_buffer *buf;
+	unsigned long flags = 0;
+
+	spin_lock_irqsave(&dev->slock, flags);
+	if (dev->opstate != S_RUNNING) {
+		marucam_err("state is not S_RUNNING\n");
+		goto done;
+	}
+	if (list_empty(&dev->active)) {
+		marucam_err("no buffer is queued\n");
 		goto done;
 	}
 
-	list_del(&buf->queue);
+	buf = list_first_entry(&dev->active, struct marucam_buffer, list);
+	list_del(&buf->list);
+	marucam_buffer_done(dev, buf);
 
-	buf->state = VIDEOBUF_DONE;
-	do_gettimeofday(&buf->ts);
-	buf->field_count++;
-	wake_up_interruptible(&buf->done);
+	if (!list_empty(&dev->active)) {
+		buf = list_first_entry(&dev->active, struct marucam_buffer,
+					list);
+		iowrite32(marucam_buffer_slot(&buf->vb),
+			dev->mmregs + MARUCAM_REQFRAME);
+	}
 
 done:
-	spin_unlock_irqrestore(q->irqlock, flags);
+	spin_unlock_irqrestore(&dev->slock, flags);
+}
+
+/*
+ * opstate is read by marucam_fillbuf() from the interrupt handler,
+ * which may run on another CPU, so it changes under slock only.
+ */
+static void marucam_set_opstate(struct marucam_device *dev,
+				enum marucam_opstate opstate)
+{
+	unsigned long flags = 0;
+
+	spin_lock_irqsave(&dev->slock, flags);
+	if (opstate == S_RUNNING) {
+		INIT_LIST_HEAD(&dev->active);
+		dev->sequence = 0;
+	}
+	dev->opstate = opstate;
+	spin_unlock_irqrestore(&dev->slock, flags);
 }
 
 static irqreturn_t marucam_irq_handler(int irq, void *dev_id)
 {
 	struct marucam_device *dev = dev_id;
 	uint32_t isr = 0;
+	unsigned int n = 0;
 
 	isr = ioread32(dev->mmregs + MARUCAM_ISR);
 	if (!isr) {
@@ -407,10 +458,76 @@ static irqreturn_t marucam_irq_handler(int irq, void *dev_id)
 		return IRQ_NONE;
 	}
 
-	marucam_fillbuf(dev);
+	if (!dev->slot_isr) {
+		marucam_fillbuf_legacy(dev);
+		return IRQ_HANDLED;
+	}
+
+	/*
+	 * Several frames may have been captured before we got here,
+	 * but no more than there are slots.
+	 */
+	while (isr & MARUCAM_ISR_FRAME) {
+		marucam_fillbuf(dev, MARUCAM_ISR_INDEX(isr));
+		if (++n == MARUCAM_MAX_BUFFERS)
+			break;
+		isr = ioread32(dev->mmregs + MARUCAM_ISR);
+	}
+
 	return IRQ_HANDLED;
 }
 
+/*
+ * Run one parameter command on the host, called with mlock held.
+ * Returns the positive error code of the host, 0 on success.
+ */
+static uint32_t marucam_exec(struct marucam_device *dev, unsigned int cmd,
+			const uint32_t *in, unsigned int nr_in,
+			uint32_t *out, unsigned int nr_out)
+{
+	struct marucam_param *param = dev->param;
+	uint32_t ret;
+	unsigned int i;
+
+	if (param) {
+		memcpy(param->in, in, nr_in * sizeof(uint32_t));
+		wmb();
+		iowrite32(0, dev->mmregs + cmd);
+		rmb();
+		ret = param->ret;
+		if (!ret)
+			memcpy(out, param->out, nr_out * sizeof(uint32_t));
+		return ret;
+	}
+
+	iowrite32(0, dev->mmregs + MARUCAM_DTC);
+	for (i = 0; i < nr_in; i++)
+		iowrite32(in[i], dev->mmregs + MARUCAM_S_DATA);
+
+	iowrite32(0, dev->mmregs + cmd);
+	ret = ioread32(dev->mmregs + cmd);
+	if (ret > 0)
+		return ret;
+
+	for (i = 0; i < nr_out; i++)
+		out[i] = ioread32(dev->mmregs + MARUCAM_G_DATA);
+
+	return 0;
+}
+
+static void marucam_pix_from_param(struct v4l2_pix_format *pix,
+				const uint32_t *out)
+{
+	pix->width		= out[0];
+	pix->height		= out[1];
+	pix->field		= out[2];
+	pix->pixelformat	= out[3];
+	pix->bytesperline	= out[4];
+	pix->sizeimage		= out[5];
+	pix->colorspace		= out[6];
+	pix->priv		= out[7];
+}
+
 /*
  * IOCTL vidioc handling
  */
@@ -432,28 +549,23 @@ static int vidioc_enum_fmt_vid_cap(struct file *file, void  *priv,
 					struct v4l2_fmtdesc *f)
 {
 	struct marucam_device *dev = priv;
+	uint32_t in[1], out[11];
 	uint32_t ret;
 
 	if (f->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
 		return -EINVAL;
 
-	mutex_lock(&dev->mlock);
-	iowrite32(0, dev->mmregs + MARUCAM_DTC);
-	iowrite32(f->index, dev->mmregs + MARUCAM_S_DATA);
+	in[0] = f->index;
 
-	iowrite32(0, dev->mmregs + MARUCAM_ENUM_FMT);
-	ret = ioread32(dev->mmregs + MARUCAM_ENUM_FMT);
-	if (ret > 0) {
-		mutex_unlock(&dev->mlock);
+	ret = marucam_exec(dev, MARUCAM_ENUM_FMT, in, 1, out, 11);
+	if (ret > 0)
 		return (int)(-ret);
-	}
 
-	f->index	= ioread32(dev->mmregs + MARUCAM_G_DATA);
-	f->flags	= ioread32(dev->mmregs + MARUCAM_G_DATA);
-	f->pixelformat	= ioread32(dev->mmregs + MARUCAM_G_DATA);
-	ioread32_rep(dev->mmregs + MARUCAM_G_DATA, f->description, 8);
+	f->index	= out[0];
+	f->flags	= out[1];
+	f->pixelformat	= out[2];
+	memcpy(f->description, &out[3], sizeof(f->description));
 
-	mutex_unlock(&dev->mlock);
 	return 0;
 }
 
@@ -461,34 +573,23 @@ static int vidioc_g_fmt_vid_cap(struct file *file, void *priv,
 					struct v4l2_format *f)
 {
 	struct marucam_device *dev = priv;
+	uint32_t out[8];
 	uint32_t ret;
 
-	mutex_lock(&dev->mlock);
-	iowrite32(0, dev->mmregs + MARUCAM_DTC);
-	iowrite32(0, dev->mmregs + MARUCAM_G_FMT);
-	ret = ioread32(dev->mmregs + MARUCAM_G_FMT);
-        if (ret > 0) {
-                marucam_err("MARUCAM_G_FMT failed with error %d.", -ret);
-                mutex_unlock(&dev->mlock);
-                return (int)(-ret);
-        }
-
-	f->fmt.pix.width	= ioread32(dev->mmregs + MARUCAM_G_DATA);
-	f->fmt.pix.height	= ioread32(dev->mmregs + MARUCAM_G_DATA);
-	f->fmt.pix.field	= ioread32(dev->mmregs + MARUCAM_G_DATA);
-	f->fmt.pix.pixelformat	= ioread32(dev->mmregs + MARUCAM_G_DATA);
-	f->fmt.pix.bytesperline	= ioread32(dev->mmregs + MARUCAM_G_DATA);
-	f->fmt.pix.sizeimage	= ioread32(dev->mmregs + MARUCAM_G_DATA);
-	f->fmt.pix.colorspace	= ioread32(dev->mmregs + MARUCAM_G_DATA);
-	f->fmt.pix.priv		= ioread32(dev->mmregs + MARUCAM_G_DATA);
+	ret = marucam_exec(dev, MARUCAM_G_FMT, NULL, 0, out, 8);
+	if (ret > 0) {
+		marucam_err("MARUCAM_G_FMT failed with error %d.", -ret);
+		return (int)(-ret);
+	}
+
+	marucam_pix_from_param(&f->fmt.pix, out);
 
 	dev->pixelformat	= f->fmt.pix.pixelformat;
 	dev->width		= f->fmt.pix.width;
 	dev->height		= f->fmt.pix.height;
-	dev->vb_vidq.field	= f->fmt.pix.field;
+	dev->field		= f->fmt.pix.field;
 	dev->type		= f->type;
 
-	mutex_unlock(&dev->mlock);
 	return 0;
 }
 
@@ -496,33 +597,22 @@ static int vidioc_try_fmt_vid_cap(struct file *file, void *priv,
 			struct v4l2_format *f)
 {
 	struct marucam_device *dev = priv;
+	uint32_t in[4], out[8];
 	uint32_t ret;
 
-	mutex_lock(&dev->mlock);
-	iowrite32(0, dev->mmregs + MARUCAM_DTC);
-	iowrite32(f->fmt.pix.width, dev->mmregs + MARUCAM_S_DATA);
-	iowrite32(f->fmt.pix.height, dev->mmregs + MARUCAM_S_DATA);
-	iowrite32(f->fmt.pix.pixelformat, dev->mmregs + MARUCAM_S_DATA);
-	iowrite32(f->fmt.pix.field, dev->mmregs + MARUCAM_S_DATA);
-
-	iowrite32(0, dev->mmregs + MARUCAM_TRY_FMT);
-	ret = ioread32(dev->mmregs + MARUCAM_TRY_FMT);
-        if (ret > 0) {
-                marucam_err("MARUCAM_TRY_FMT failed with error %d.", -ret);
-                mutex_unlock(&dev->mlock);
-                return (int)(-ret);
-        }
-
-	f->fmt.pix.width	= ioread32(dev->mmregs + MARUCAM_G_DATA);
-	f->fmt.pix.height	= ioread32(dev->mmregs + MARUCAM_G_DATA);
-	f->fmt.pix.field	= ioread32(dev->mmregs + MARUCAM_G_DATA);
-	f->fmt.pix.pixelformat	= ioread32(dev->mmregs + MARUCAM_G_DATA);
-	f->fmt.pix.bytesperline	= ioread32(dev->mmregs + MARUCAM_G_DATA);
-	f->fmt.pix.sizeimage	= ioread32(dev->mmregs + MARUCAM_G_DATA);
-	f->fmt.pix.colorspace	= ioread32(dev->mmregs + MARUCAM_G_DATA);
-	f->fmt.pix.priv		= ioread32(dev->mmregs + MARUCAM_G_DATA);
+	in[0] = f->fmt.pix.width;
+	in[1] = f->fmt.pix.height;
+	in[2] = f->fmt.pix.pixelformat;
+	in[3] = f->fmt.pix.field;
+
+	ret = marucam_exec(dev, MARUCAM_TRY_FMT, in, 4, out, 8);
+	if (ret > 0) {
+		marucam_err("MARUCAM_TRY_FMT failed with error %d.", -ret);
+		return (int)(-ret);
+	}
+
+	marucam_pix_from_param(&f->fmt.pix, out);
 
-	mutex_unlock(&dev->mlock);
 	return 0;
 }
 
@@ -530,54 +620,37 @@ static int vidioc_s_fmt_vid_cap(struct file *file, void *priv,
 					struct v4l2_format *f)
 {
 	struct marucam_device *dev = priv;
-	struct videobuf_queue *q = &dev->vb_vidq;
+	uint32_t in[4], out[8];
 	uint32_t ret;
 
-	mutex_lock(&dev->mlock);
 	if (dev->opstate != S_IDLE) {
 		marucam_err("device state is not S_IDLE\n");
-		mutex_unlock(&dev->mlock);
 		return -EBUSY;
 	}
-	mutex_lock(&q->vb_lock);
-	if (videobuf_queue_is_busy(&dev->vb_vidq)) {
+	if (vb2_is_busy(&dev->vb_vidq)) {
 		marucam_err("videobuf queue is busy\n");
-		mutex_unlock(&q->vb_lock);
-		mutex_unlock(&dev->mlock);
 		return -EBUSY;
 	}
-	mutex_unlock(&q->vb_lock);
 
-	iowrite32(0, dev->mmregs + MARUCAM_DTC);
-	iowrite32(f->fmt.pix.width, dev->mmregs + MARUCAM_S_DATA);
-	iowrite32(f->fmt.pix.height, dev->mmregs + MARUCAM_S_DATA);
-	iowrite32(f->fmt.pix.pixelformat, dev->mmregs + MARUCAM_S_DATA);
-	iowrite32(f->fmt.pix.field, dev->mmregs + MARUCAM_S_DATA);
+	in[0] = f->fmt.pix.width;
+	in[1] = f->fmt.pix.height;
+	in[2] = f->fmt.pix.pixelformat;
+	in[3] = f->fmt.pix.field;
 
-	iowrite32(0, dev->mmregs + MARUCAM_S_FMT);
-	ret = ioread32(dev->mmregs + MARUCAM_S_FMT);
+	ret = marucam_exec(dev, MARUCAM_S_FMT, in, 4, out, 8);
 	if (ret > 0) {
 		marucam_err("MARUCAM_S_FMT failed with error %d.", -ret);
-		mutex_unlock(&dev->mlock);
 		return (int)(-ret);
 	}
 
-	f->fmt.pix.width	= ioread32(dev->mmregs + MARUCAM_G_DATA);
-	f->fmt.pix.height	= ioread32(dev->mmregs + MARUCAM_G_DATA);
-	f->fmt.pix.field	= ioread32(dev->mmregs + MARUCAM_G_DATA);
-	f->fmt.pix.pixelformat	= ioread32(dev->mmregs + MARUCAM_G_DATA);
-	f->fmt.pix.bytesperline	= ioread32(dev->mmregs + MARUCAM_G_DATA);
-	f->fmt.pix.sizeimage	= ioread32(dev->mmregs + MARUCAM_G_DATA);
-	f->fmt.pix.colorspace	= ioread32(dev->mmregs + MARUCAM_G_DATA);
-	f->fmt.pix.priv		= ioread32(dev->mmregs + MARUCAM_G_DATA);
+	marucam_pix_from_param(&f->fmt.pix, out);
 
 	dev->pixelformat	= f->fmt.pix.pixelformat;
 	dev->width		= f->fmt.pix.width;
 	dev->height		= f->fmt.pix.height;
-	dev->vb_vidq.field	= f->fmt.pix.field;
+	dev->field		= f->fmt.pix.field;
 	dev->type		= f->type;
 
-	mutex_unlock(&dev->mlock);
 	return 0;
 }
 
@@ -589,9 +662,9 @@ static int vidioc_reqbufs(struct file *file, void *priv,
 
 	dev->type = p->type;
 
-	ret = videobuf_reqbufs(&dev->vb_vidq, p);
+	ret = vb2_reqbufs(&dev->vb_vidq, p);
 	if (ret < 0)
-		marucam_err("failed to videobuf_reqbufs\n");
+		marucam_err("failed to vb2_reqbufs\n");
 
 	return ret;
 }
@@ -601,9 +674,9 @@ static int vidioc_querybuf(struct file *file, void *priv, struct v4l2_buffer *p)
 	int ret;
 	struct marucam_device *dev = priv;
 
-	ret = videobuf_querybuf(&dev->vb_vidq, p);
+	ret = vb2_querybuf(&dev->vb_vidq, p);
 	if (ret < 0)
-		marucam_err("failed to videobuf_querybuf\n");
+		marucam_err("failed to vb2_querybuf\n");
 
 	return ret;
 }
@@ -613,9 +686,9 @@ static int vidioc_qbuf(struct file *file, void *priv, struct v4l2_buffer *p)
 	int ret;
 	struct marucam_device *dev = priv;
 
-	ret = videobuf_qbuf(&dev->vb_vidq, p);
+	ret = vb2_qbuf(&dev->vb_vidq, p);
 	if (ret < 0)
-		marucam_err("failed to videobuf_qbuf\n");
+		marucam_err("failed to vb2_qbuf\n");
 
 	return ret;
 }
@@ -625,9 +698,9 @@ static int vidioc_dqbuf(struct file *file, void *priv, struct v4l2_buffer *p)
 	int ret;
 	struct marucam_device *dev = priv;
 
-	ret = videobuf_dqbuf(&dev->vb_vidq, p, file->f_flags & O_NONBLOCK);
+	ret = vb2_dqbuf(&dev->vb_vidq, p, file->f_flags & O_NONBLOCK);
 	if (ret < 0)
-		marucam_err("failed to videobuf_dqbuf\n");
+		marucam_err("failed to vb2_dqbuf\n");
 
 	return ret;
 }
@@ -642,10 +715,8 @@ static int vidioc_streamon(struct file *file, void *priv, enum v4l2_buf_type i)
 	if (i != dev->type)
 		return -EINVAL;
 
-	mutex_lock(&dev->mlock);
 	if (dev->opstate != S_IDLE) {
 		marucam_err("device state is not S_IDLE.\n");
-		mutex_unlock(&dev->mlock);
 		return -EBUSY;
 	}
 
@@ -653,20 +724,20 @@ static int vidioc_streamon(struct file *file, void *priv, enum v4l2_buf_type i)
 	ret = (int)ioread32(dev->mmregs + MARUCAM_START_PREVIEW);
 	if (ret) {
 		marucam_err("MARUCAM_START_PREVIEW failed!\n");
-		mutex_unlock(&dev->mlock);
 		return -ret;
 	}
 
-	INIT_LIST_HEAD(&dev->active);
-	ret = videobuf_streamon(&dev->vb_vidq);
+	/* the buffers queued before are handed to the host right away */
+	marucam_set_opstate(dev, S_RUNNING);
+	ret = vb2_streamon(&dev->vb_vidq, i);
 	if (ret) {
-		marucam_err("videobuf_streamon failed, reti(%d)\n", ret);
-		mutex_unlock(&dev->mlock);
+		marucam_err("vb2_streamon failed, reti(%d)\n", ret);
+		marucam_set_opstate(dev, S_IDLE);
+		iowrite32(1, dev->mmregs + MARUCAM_STOP_PREVIEW);
+		ioread32(dev->mmregs + MARUCAM_STOP_PREVIEW);
 		return ret;
 	}
 
-	dev->opstate = S_RUNNING;
-	mutex_unlock(&dev->mlock);
 	return ret;
 }
 
@@ -680,10 +751,8 @@ static int vidioc_streamoff(struct file *file, void *priv, enum v4l2_buf_type i)
 	if (i != dev->type)
 		return -EINVAL;
 
-	mutex_lock(&dev->mlock);
 	if (dev->opstate != S_RUNNING) {
 		marucam_err("Device state is not S_RUNNING. Do nothing!\n");
-		mutex_unlock(&dev->mlock);
 		return 0;
 	}
 
@@ -691,18 +760,15 @@ static int vidioc_streamoff(struct file *file, void *priv, enum v4l2_buf_type i)
 	ret = (int)ioread32(dev->mmregs + MARUCAM_STOP_PREVIEW);
 	if (ret) {
 		marucam_err("MARUCAM_STOP_PREVIEW failed!\n");
-		mutex_unlock(&dev->mlock);
 		return -ret;
 	}
 
-	dev->opstate = S_IDLE;
-	ret = videobuf_streamoff(&dev->vb_vidq);
+	marucam_set_opstate(dev, S_IDLE);
+	ret = vb2_streamoff(&dev->vb_vidq, i);
 	if (ret) {
-		marucam_err("videobuf_streamoff failed, ret(%d)\n", ret);
+		marucam_err("vb2_streamoff failed, ret(%d)\n", ret);
 	}
 
-	INIT_LIST_HEAD(&dev->active);
-	mutex_unlock(&dev->mlock);
 	return ret;
 }
 
@@ -741,28 +807,23 @@ static int vidioc_queryctrl(struct file *file, void *priv,
 			    struct v4l2_queryctrl *qc)
 {
 	struct marucam_device *dev = priv;
+	uint32_t in[1], out[14];
 	uint32_t ret;
 
-	mutex_lock(&dev->mlock);
-	iowrite32(0, dev->mmregs + MARUCAM_DTC);
-	iowrite32(qc->id, dev->mmregs + MARUCAM_S_DATA);
+	in[0] = qc->id;
 
-	iowrite32(0, dev->mmregs + MARUCAM_QCTRL);
-	ret = ioread32(dev->mmregs + MARUCAM_QCTRL);
-	if (ret > 0) {
-		mutex_unlock(&dev->mlock);
+	ret = marucam_exec(dev, MARUCAM_QCTRL, in, 1, out, 14);
+	if (ret > 0)
 		return -(ret);
-	}
 
-	qc->id			= ioread32(dev->mmregs + MARUCAM_G_DATA);
-	qc->minimum		= ioread32(dev->mmregs + MARUCAM_G_DATA);
-	qc->maximum		= ioread32(dev->mmregs + MARUCAM_G_DATA);
-	qc->step		= ioread32(dev->mmregs + MARUCAM_G_DATA);
-	qc->default_value	= ioread32(dev->mmregs + MARUCAM_G_DATA);
-	qc->flags		= ioread32(dev->mmregs + MARUCAM_G_DATA);
-	ioread32_rep(dev->mmregs + MARUCAM_G_DATA, qc->name, 8);
+	qc->id			= out[0];
+	qc->minimum		= out[1];
+	qc->maximum		= out[2];
+	qc->step		= out[3];
+	qc->default_value	= out[4];
+	qc->flags		= out[5];
+	memcpy(qc->name, &out[6], sizeof(qc->name));
 
-	mutex_unlock(&dev->mlock);
 	return 0;
 }
 
@@ -770,24 +831,19 @@ static int vidioc_g_ctrl(struct file *file, void *priv,
 			 struct v4l2_control *ctrl)
 {
 	struct marucam_device *dev = priv;
+	uint32_t in[1], out[1];
 	uint32_t ret;
 
-	mutex_lock(&dev->mlock);
-	iowrite32(0, dev->mmregs + MARUCAM_DTC);
-	iowrite32(ctrl->id, dev->mmregs + MARUCAM_S_DATA);
-
-	iowrite32(0, dev->mmregs + MARUCAM_G_CTRL);
-	ret = ioread32(dev->mmregs + MARUCAM_G_CTRL);
+	in[0] = ctrl->id;
 
+	ret = marucam_exec(dev, MARUCAM_G_CTRL, in, 1, out, 1);
 	if (ret > 0) {
 		marucam_err("MARUCAM_G_CTRL failed!\n");
-		mutex_unlock(&dev->mlock);
 		return -(ret);
 	}
 
-	ctrl->value = ioread32(dev->mmregs + MARUCAM_G_DATA);
+	ctrl->value = out[0];
 
-	mutex_unlock(&dev->mlock);
 	return 0;
 }
 
@@ -795,22 +851,18 @@ static int vidioc_s_ctrl(struct file *file, void *priv,
 				struct v4l2_control *ctrl)
 {
 	struct marucam_device *dev = priv;
+	uint32_t in[2];
 	uint32_t ret;
 
-	mutex_lock(&dev->mlock);
-	iowrite32(0, dev->mmregs + MARUCAM_DTC);
-	iowrite32(ctrl->id, dev->mmregs + MARUCAM_S_DATA);
-	iowrite32(ctrl->value, dev->mmregs + MARUCAM_S_DATA);
+	in[0] = ctrl->id;
+	in[1] = ctrl->value;
 
-	iowrite32(0, dev->mmregs + MARUCAM_S_CTRL);
-	ret = ioread32(dev->mmregs + MARUCAM_S_CTRL);
-        if (ret > 0) {
-                marucam_err("MARUCAM_S_CTRL failed!\n");
-                mutex_unlock(&dev->mlock);
-                return -(ret);
-        }
+	ret = marucam_exec(dev, MARUCAM_S_CTRL, in, 2, NULL, 0);
+	if (ret > 0) {
+		marucam_err("MARUCAM_S_CTRL failed!\n");
+		return -(ret);
+	}
 
-	mutex_unlock(&dev->mlock);
 	return 0;
 }
 
@@ -819,25 +871,21 @@ static int vidioc_s_parm(struct file *file, void *priv,
 {
 	struct marucam_device *dev = priv;
 	struct v4l2_captureparm *cp = &parm->parm.capture;
+	uint32_t in[2];
 	uint32_t ret;
 
 	if (parm->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
 		return -EINVAL;
 
-	mutex_lock(&dev->mlock);
-	iowrite32(0, dev->mmregs + MARUCAM_DTC);
-	iowrite32(cp->timeperframe.numerator, dev->mmregs + MARUCAM_S_DATA);
-	iowrite32(cp->timeperframe.denominator, dev->mmregs + MARUCAM_S_DATA);
+	in[0] = cp->timeperframe.numerator;
+	in[1] = cp->timeperframe.denominator;
 
-	iowrite32(0, dev->mmregs + MARUCAM_S_PARAM);
-	ret = ioread32(dev->mmregs + MARUCAM_S_PARAM);
-        if (ret > 0) {
-                marucam_err("MARUCAM_S_PARAM failed!\n");
-                mutex_unlock(&dev->mlock);
-                return -(ret);
-        }
+	ret = marucam_exec(dev, MARUCAM_S_PARAM, in, 2, NULL, 0);
+	if (ret > 0) {
+		marucam_err("MARUCAM_S_PARAM failed!\n");
+		return -(ret);
+	}
 
-	mutex_unlock(&dev->mlock);
 	return 0;
 }
 
@@ -846,26 +894,22 @@ static int vidioc_g_parm(struct file *file, void *priv,
 {
 	struct marucam_device *dev = priv;
 	struct v4l2_captureparm *cp = &parm->parm.capture;
+	uint32_t out[3];
 	uint32_t ret;
 
 	if (parm->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
 		return -EINVAL;
 
-	mutex_lock(&dev->mlock);
-	iowrite32(0, dev->mmregs + MARUCAM_DTC);
-	iowrite32(0, dev->mmregs + MARUCAM_G_PARAM);
-	ret = ioread32(dev->mmregs + MARUCAM_G_PARAM);
-        if (ret > 0) {
-                marucam_err("MARUCAM_G_PARAM failed!\n");
-                mutex_unlock(&dev->mlock);
-                return -(ret);
-        }
-
-	cp->capability = ioread32(dev->mmregs + MARUCAM_G_DATA);
-	cp->timeperframe.numerator = ioread32(dev->mmregs + MARUCAM_G_DATA);
-	cp->timeperframe.denominator = ioread32(dev->mmregs + MARUCAM_G_DATA);
+	ret = marucam_exec(dev, MARUCAM_G_PARAM, NULL, 0, out, 3);
+	if (ret > 0) {
+		marucam_err("MARUCAM_G_PARAM failed!\n");
+		return -(ret);
+	}
+
+	cp->capability = out[0];
+	cp->timeperframe.numerator = out[1];
+	cp->timeperframe.denominator = out[2];
 
-	mutex_unlock(&dev->mlock);
 	return 0;
 }
 
@@ -873,25 +917,20 @@ static int vidioc_enum_framesizes(struct file *file, void *priv,
 				struct v4l2_frmsizeenum *fsize)
 {
 	struct marucam_device *dev = priv;
+	uint32_t in[2], out[2];
 	uint32_t ret;
 
-	mutex_lock(&dev->mlock);
-	iowrite32(0, dev->mmregs + MARUCAM_DTC);
-	iowrite32(fsize->index, dev->mmregs + MARUCAM_S_DATA);
-	iowrite32(fsize->pixel_format, dev->mmregs + MARUCAM_S_DATA);
+	in[0] = fsize->index;
+	in[1] = fsize->pixel_format;
 
-	iowrite32(0, dev->mmregs + MARUCAM_ENUM_FSIZES);
-	ret = ioread32(dev->mmregs + MARUCAM_ENUM_FSIZES);
-        if (ret > 0) {
-                mutex_unlock(&dev->mlock);
-                return -(ret);
-        }
+	ret = marucam_exec(dev, MARUCAM_ENUM_FSIZES, in, 2, out, 2);
+	if (ret > 0)
+		return -(ret);
 
 	fsize->type = V4L2_FRMSIZE_TYPE_DISCRETE;
-	fsize->discrete.width = ioread32(dev->mmregs + MARUCAM_G_DATA);
-	fsize->discrete.height = ioread32(dev->mmregs + MARUCAM_G_DATA);
+	fsize->discrete.width = out[0];
+	fsize->discrete.height = out[1];
 
-	mutex_unlock(&dev->mlock);
 	return 0;
 }
 
@@ -899,109 +938,146 @@ static int vidioc_enum_frameintervals(struct file *file, void *priv,
 				struct v4l2_frmivalenum *fival)
 {
 	struct marucam_device *dev = priv;
+	uint32_t in[4], out[2];
 	uint32_t ret;
 
-	mutex_lock(&dev->mlock);
-	iowrite32(0, dev->mmregs + MARUCAM_DTC);
-	iowrite32(fival->index, dev->mmregs + MARUCAM_S_DATA);
-	iowrite32(fival->pixel_format, dev->mmregs + MARUCAM_S_DATA);
-	iowrite32(fival->width, dev->mmregs + MARUCAM_S_DATA);
-	iowrite32(fival->height, dev->mmregs + MARUCAM_S_DATA);
-
-	iowrite32(0, dev->mmregs + MARUCAM_ENUM_FINTV);
-	ret = ioread32(dev->mmregs + MARUCAM_ENUM_FINTV);
-        if (ret > 0) {
-                mutex_unlock(&dev->mlock);
-                return -(ret);
-        }
+	in[0] = fival->index;
+	in[1] = fival->pixel_format;
+	in[2] = fival->width;
+	in[3] = fival->height;
+
+	ret = marucam_exec(dev, MARUCAM_ENUM_FINTV, in, 4, out, 2);
+	if (ret > 0)
+		return -(ret);
 
 	fival->type = V4L2_FRMIVAL_TYPE_DISCRETE;
-	fival->discrete.numerator = ioread32(dev->mmregs + MARUCAM_G_DATA);
-	fival->discrete.denominator = ioread32(dev->mmregs + MARUCAM_G_DATA);
+	fival->discrete.numerator = out[0];
+	fival->discrete.denominator = out[1];
 
-	mutex_unlock(&dev->mlock);
 	return 0;
 }
 
 /* ------------------------------------------------------------------
 	Videobuf operations
    ------------------------------------------------------------------*/
-static int
-buffer_setup(struct videobuf_queue *vq, unsigned int *count, unsigned int *size)
+static int queue_setup(struct vb2_queue *vq, const struct v4l2_format *fmt,
+			unsigned int *nbuffers, unsigned int *nplanes,
+			unsigned int sizes[], void *alloc_ctxs[])
 {
-	struct marucam_device *dev = vq->priv_data;
+	struct marucam_device *dev = vb2_get_drv_priv(vq);
+	unsigned int size, max;
+
+	size = get_image_size(dev);
+
+	/* every buffer is a slot of the device memory */
+	max = dev->mem_size / PAGE_ALIGN(size);
+	if (max > MARUCAM_MAX_BUFFERS)
+		max = MARUCAM_MAX_BUFFERS;
+	if (max > VIDEO_MAX_FRAME)
+		max = VIDEO_MAX_FRAME;
+	if (max < MARUCAM_MIN_BUFFERS) {
+		marucam_err("device memory is too small for %u bytes\n", size);
+		return -ENOMEM;
+	}
 
-	*size = get_image_size(dev);
+	if (0 == *nbuffers)
+		*nbuffers = MARUCAM_DFL_BUFFERS;
+	if (*nbuffers < MARUCAM_MIN_BUFFERS)
+		*nbuffers = MARUCAM_MIN_BUFFERS;
+	if (*nbuffers > max)
+		*nbuffers = max;
 
-	if (*count > 2)
-		*count = 2;
-	if (0 == *count)
-		*count = 2;
+	*nplanes = 1;
+	sizes[0] = size;
+	alloc_ctxs[0] = dev;
 
-	marucam_dbg(1, "count=%d, size=%d\n", *count, *size);
+	marucam_dbg(1, "count=%d, size=%d\n", *nbuffers, size);
 
 	return 0;
 }
 
-static int
-buffer_prepare(struct videobuf_queue *vq, struct videobuf_buffer *vb,
-						enum v4l2_field field)
+static int buffer_prepare(struct vb2_buffer *vb)
 {
-	int rc;
-	struct marucam_device *dev = vq->priv_data;
-
-	marucam_dbg(1, "field=%d\n", field);
+	struct marucam_device *dev = vb2_get_drv_priv(vb->vb2_queue);
+	unsigned long size = get_image_size(dev);
 
-	vb->size = get_image_size(dev);
-
-	if (0 != vb->baddr  &&  vb->bsize < vb->size) {
+	if (vb2_plane_size(vb, 0) < size) {
 		marucam_err("video buffer size is invalid\n");
 		return -EINVAL;
 	}
 
-	if (vb->state == VIDEOBUF_NEEDS_INIT) {
-		rc = videobuf_iolock(vq, vb, NULL);
-		if (rc < 0) {
-			marucam_err("faile dto videobuf_iolock\n");
-			goto fail;
-		}
-	}
-
-	vb->width	= dev->width;
-	vb->height	= dev->height;
-	vb->field	= field;
-	vb->state	= VIDEOBUF_PREPARED;
+	vb2_set_plane_payload(vb, 0, size);
 
 	return 0;
-
-fail:
-	vb->state = VIDEOBUF_NEEDS_INIT;
-	return rc;
 }
 
-static void
-buffer_queue(struct videobuf_queue *vq, struct videobuf_buffer *vb)
+static void buffer_queue(struct vb2_buffer *vb)
 {
-	struct marucam_device *dev = vq->priv_data;
+	struct marucam_device *dev = vb2_get_drv_priv(vb->vb2_queue);
+	struct marucam_buffer *buf = container_of(vb, struct marucam_buffer, vb);
+	unsigned long flags = 0;
 
 	marucam_dbg(1, "\n");
 
-	vb->state = VIDEOBUF_QUEUED;
-	list_add_tail(&vb->queue, &dev->active);
+	spin_lock_irqsave(&dev->slock, flags);
+	list_add_tail(&buf->list, &dev->active);
+
+	/*
+	 * Let the host capture the next frames into this buffer. An
+	 * older host takes one request at a time, the next one is sent
+	 * when the frame arrives.
+	 */
+	if (dev->slot_isr || list_is_singular(&dev->active))
+		iowrite32(marucam_buffer_slot(vb),
+			dev->mmregs + MARUCAM_REQFRAME);
+	spin_unlock_irqrestore(&dev->slock, flags);
+}
+
+static int start_streaming(struct vb2_queue *vq, unsigned int count)
+{
+	return 0;
 }
 
-static void buffer_release(struct videobuf_queue *vq,
-			   struct videobuf_buffer *vb)
+/* give back the buffers the host has not filled */
+static int stop_streaming(struct vb2_queue *vq)
 {
-	marucam_dbg(1, "buffer freed\n");
-	vb->state = VIDEOBUF_NEEDS_INIT;
+	struct marucam_device *dev = vb2_get_drv_priv(vq);
+	struct marucam_buffer *buf, *tmp;
+	unsigned long flags = 0;
+
+	spin_lock_irqsave(&dev->slock, flags);
+	list_for_each_entry_safe(buf, tmp, &dev->active, list) {
+		list_del(&buf->list);
+		vb2_buffer_done(&buf->vb, VB2_BUF_STATE_ERROR);
+	}
+	spin_unlock_irqrestore(&dev->slock, flags);
+
+	return 0;
 }
 
-static struct videobuf_queue_ops marucam_video_qops = {
-	.buf_setup      = buffer_setup,
-	.buf_prepare    = buffer_prepare,
-	.buf_queue      = buffer_queue,
-	.buf_release    = buffer_release,
+/* mlock is the video_device lock, dropped while VIDIOC_DQBUF blocks */
+static void marucam_wait_prepare(struct vb2_queue *vq)
+{
+	struct marucam_device *dev = vb2_get_drv_priv(vq);
+
+	mutex_unlock(&dev->mlock);
+}
+
+static void marucam_wait_finish(struct vb2_queue *vq)
+{
+	struct marucam_device *dev = vb2_get_drv_priv(vq);
+
+	mutex_lock(&dev->mlock);
+}
+
+static struct vb2_ops marucam_video_qops = {
+	.queue_setup		= queue_setup,
+	.buf_prepare		= buffer_prepare,
+	.buf_queue		= buffer_queue,
+	.start_streaming	= start_streaming,
+	.stop_streaming		= stop_streaming,
+	.wait_prepare		= marucam_wait_prepare,
+	.wait_finish		= marucam_wait_finish,
 };
 
 /* ------------------------------------------------------------------
@@ -1015,10 +1091,8 @@ static int marucam_open(struct file *file)
 
 	file->private_data	= dev;
 
-	mutex_lock(&dev->mlock);
 	if (dev->in_use) {
 		marucam_err("device already opend!!!!\n");
-		mutex_unlock(&dev->mlock);
 		return -EBUSY;
 	}
 
@@ -1031,26 +1105,34 @@ static int marucam_open(struct file *file)
 				IRQF_SHARED, MARUCAM_MODULE_NAME, dev);
 	if (ret) {
 		marucam_err("request_irq failed!!! irq#(%d)\n",	dev->pdev->irq);
-		mutex_unlock(&dev->mlock);
 		return ret;
 	}
 
-	videobuf_queue_marucam_init(&dev->vb_vidq, &marucam_video_qops,
-				&dev->pdev->dev, &dev->slock, dev->type,
-				V4L2_FIELD_NONE, sizeof(struct videobuf_buffer),
-				dev, NULL);
+	dev->field		= V4L2_FIELD_NONE;
+
+	memset(&dev->vb_vidq, 0, sizeof(dev->vb_vidq));
+	dev->vb_vidq.type		= dev->type;
+	dev->vb_vidq.io_modes		= VB2_MMAP;
+	dev->vb_vidq.drv_priv		= dev;
+	dev->vb_vidq.buf_struct_size	= sizeof(struct marucam_buffer);
+	dev->vb_vidq.ops		= &marucam_video_qops;
+	dev->vb_vidq.mem_ops		= &marucam_memops;
+	ret = vb2_queue_init(&dev->vb_vidq);
+	if (ret) {
+		marucam_err("vb2_queue_init failed\n");
+		free_irq(dev->pdev->irq, dev);
+		return ret;
+	}
 
 	iowrite32(0, dev->mmregs + MARUCAM_OPEN);
 	ret = (int)ioread32(dev->mmregs + MARUCAM_OPEN);
 	if (ret > 0) {
 		marucam_err("MARUCAM_OPEN failed\n");
 		free_irq(dev->pdev->irq, dev);
-		mutex_unlock(&dev->mlock);
 		return -ret;
 	}
 
 	dev->in_use = 1;
-	mutex_unlock(&dev->mlock);
 	return 0;
 }
 
@@ -1061,30 +1143,20 @@ static int marucam_close(struct file *file)
 
 	int minor = video_devdata(file)->minor;
 
-	mutex_lock(&dev->mlock);
 	if (dev->opstate == S_RUNNING) {
 		marucam_err("The device has been terminated unexpectedly.\n");
 		iowrite32(1, dev->mmregs + MARUCAM_STOP_PREVIEW);
 		ret = (int)ioread32(dev->mmregs + MARUCAM_STOP_PREVIEW);
 		if (ret > 0) {
 			marucam_err("MARUCAM_STOP_PREVIEW failed!\n");
-			mutex_unlock(&dev->mlock);
 			return -(ret);
 		}
 
-		dev->opstate = S_IDLE;
-		ret = videobuf_streamoff(&dev->vb_vidq);
-		if (ret < 0) {
-			marucam_err("videobuf_streamoff failed! ret(%d)\n",
-					 ret);
-			mutex_unlock(&dev->mlock);
-			return -(ret);
-		}
-		INIT_LIST_HEAD(&dev->active);
+		marucam_set_opstate(dev, S_IDLE);
 	}
 
-	videobuf_stop(&dev->vb_vidq);
-	videobuf_mmap_free(&dev->vb_vidq);
+	/* stops streaming and frees the buffers not mapped anymore */
+	vb2_queue_release(&dev->vb_vidq);
 
 	free_irq(dev->pdev->irq, dev);
 
@@ -1092,14 +1164,12 @@ static int marucam_close(struct file *file)
 	ret = ioread32(dev->mmregs + MARUCAM_CLOSE);
 	if (ret > 0) {
 		marucam_err("device close failed\n");
-		mutex_unlock(&dev->mlock);
 		return -(ret);
 	}
 
 	marucam_dbg(1, "close called (minor=%d)\n", minor);
 
 	dev->in_use = 0;
-	mutex_unlock(&dev->mlock);
 	return 0;
 }
 
@@ -1107,33 +1177,8 @@ static unsigned int
 marucam_poll(struct file *file, struct poll_table_struct *wait)
 {
 	struct marucam_device *dev = file->private_data;
-	struct videobuf_queue *q = &dev->vb_vidq;
-	unsigned int ret = 0;
-	struct videobuf_buffer *buf = NULL;
-
-	if (q->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
-		return POLLERR;
-
-	mutex_lock(&q->vb_lock);
-	if (q->streaming) {
-		if (!list_empty(&q->stream))
-			buf = list_entry(q->stream.next,
-						struct videobuf_buffer, stream);
-	}
-	if (!buf) {
-		marucam_err("video buffer list is empty\n");
-		ret = POLLERR;
-	}
 
-	if (ret == 0) {
-		poll_wait(file, &buf->done, wait);
-		if (buf->state == VIDEOBUF_DONE || buf->state == VIDEOBUF_ERROR)
-			ret = POLLIN | POLLRDNORM;
-		else
-			iowrite32(buf->i, dev->mmregs + MARUCAM_REQFRAME);
-	}
-	mutex_unlock(&q->vb_lock);
-	return ret;
+	return vb2_poll(&dev->vb_vidq, file, wait);
 }
 
 static int marucam_mmap(struct file *file, struct vm_area_struct *vma)
@@ -1143,7 +1188,7 @@ static int marucam_mmap(struct file *file, struct vm_area_struct *vma)
 
 	marucam_dbg(1, "mmap called, vma=0x%08lx\n", (unsigned long)vma);
 
-	ret = videobuf_mmap_mapper(&dev->vb_vidq, vma);
+	ret = vb2_mmap(&dev->vb_vidq, vma);
 
 	marucam_dbg(1, "vma start=0x%08lx, size=%ld, ret=%d\n",
 		(unsigned long)vma->vm_start,
@@ -1184,7 +1229,7 @@ static const struct v4l2_file_operations marucam_fops = {
 	.release	= marucam_close,
 	.poll		= marucam_poll,
 	.mmap		= marucam_mmap,
-	.ioctl		= video_ioctl2,
+	.unlocked_ioctl	= video_ioctl2,
 };
 
 static struct video_device marucam_video_dev = {
@@ -1247,6 +1292,8 @@ static int marucam_pci_initdev(struct pci_dev *pdev,
 
 	dev->vfd->parent = &dev->pdev->dev;
 	dev->vfd->v4l2_dev = &dev->v4l2_dev;
+	/* the v4l2 core serializes all file operations with mlock */
+	dev->vfd->lock = &dev->mlock;
 
 	ret = pci_enable_device(dev->pdev);
 	if (ret) {
@@ -1290,10 +1337,31 @@ static int marucam_pci_initdev(struct pci_dev *pdev,
 		goto out_rel_io_region;
 	}
 
+	dev->param = dma_alloc_coherent(&pdev->dev,
+				sizeof(struct marucam_param),
+				&dev->param_dma, GFP_KERNEL);
+	if (dev->param) {
+		iowrite32((uint32_t)dev->param_dma,
+				dev->mmregs + MARUCAM_PARAM_ADDR);
+		if (ioread32(dev->mmregs + MARUCAM_PARAM_ADDR) !=
+				(uint32_t)dev->param_dma) {
+			dma_free_coherent(&pdev->dev,
+				sizeof(struct marucam_param),
+				dev->param, dev->param_dma);
+			dev->param = NULL;
+		}
+	}
+
+	iowrite32(MARUCAM_SLOT_ISR_ON, dev->mmregs + MARUCAM_SLOT_ISR);
+	dev->slot_isr = ioread32(dev->mmregs + MARUCAM_SLOT_ISR) ==
+				MARUCAM_SLOT_ISR_ON;
+	if (!dev->slot_isr)
+		marucam_info("host fills one requested frame at a time\n");
+
 	ret = video_register_device(dev->vfd, VFL_TYPE_GRABBER, 0);
 	if (ret < 0) {
 		marucam_err("video_register_device failed!!\n");
-		goto out_iounmap;
+		goto out_free_param;
 	}
 	video_set_drvdata(dev->vfd, dev);
 	pci_set_drvdata(pdev, dev);
@@ -1305,7 +1373,12 @@ static int marucam_pci_initdev(struct pci_dev *pdev,
 
 	return 0;
 
-out_iounmap:
+out_free_param:
+	if (dev->param) {
+		iowrite32(0, dev->mmregs + MARUCAM_PARAM_ADDR);
+		dma_free_coherent(&pdev->dev, sizeof(struct marucam_param),
+				dev->param, dev->param_dma);
+	}
 	iounmap(dev->mmregs);
 out_rel_io_region:
 	release_mem_region(dev->io_base, dev->io_size);
@@ -1336,6 +1409,13 @@ static void marucam_pci_removedev(struct pci_dev *pdev)
 
 	video_unregister_device(dev->vfd);
 
+	if (dev->param) {
+		iowrite32(0, dev->mmregs + MARUCAM_PARAM_ADDR);
+		dma_free_coherent(&pdev->dev, sizeof(struct marucam_param),
+				dev->param, dev->param_dma);
+		dev->param = NULL;
+	}
+
 	if (dev->mmregs) {
 		iounmap(dev->mmregs);
 		dev->mmregs = 0;
@@ -1363,7 +1443,7 @@ static struct pci_driver marucam_pci_driver = {
 	.remove		= marucam_pci_removedev,
 };
 
-static int __init marucam_init(void)
+static int marucam_register(void)
 {
 	int ret = 0;
 
@@ -1380,10 +1460,27 @@ static int __init marucam_init(void)
 	return ret;
 }
 
-static void __exit marucam_exit(void)
+static void marucam_unregister(void)
 {
 	pci_unregister_driver(&marucam_pci_driver);
 }
 
+static struct maru_async_driver marucam_async = {
+	.name = MARUCAM_MODULE_NAME,
+	.reg = marucam_register,
+	.unreg = marucam_unregister,
+};
+
+static int __init marucam_init(void)
+{
+	maru_async_register(&marucam_async);
+	return 0;
+}
+
+static void __exit marucam_exit(void)
+{
+	maru_async_unregister(&marucam_async);
+}
+
 module_init(marucam_init);
 module_exit(marucam_exit);
@@ -28,23 +28,39 @@
  * - S-Core Co., Ltd
  *
  */
+#include <linux/debugfs.h>
 #include <linux/device.h>
+#include <linux/dma-mapping.h>
 #include <linux/err.h>
 #include <linux/fs.h>
+#include <linux/genalloc.h>
 #include <linux/init.h>
 #include <linux/interrupt.h>
 #include <linux/io.h>
 #include <linux/ioport.h>
 #include <linux/kernel.h>
+#include <linux/kfifo.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/math64.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/pci.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
 #include <linux/types.h>
 #include <linux/sched.h>
 #include <linux/semaphore.h>
+#include <linux/seq_file.h>
 #include <linux/uaccess.h>
 #include <linux/workqueue.h>
 #include <linux/wait.h>
 
+#include "maru_async.h"
+
+#define CREATE_TRACE_POINTS
+#include "maru_codec_trace.h"
+
 #define DRIVER_NAME	 "codec"
 #define CODEC_MAJOR	 240
 
@@ -57,6 +73,22 @@ MODULE_LICENSE("GPL2");
 
 #define CODEC_IRQ 0x7f
 
+/* set in the value of CODEC_DONE_CONTEXT while a finished job is pending */
+#define CODEC_DONE_VALID	0x80000000
+
+/* bits of CODEC_FEATURES */
+#define CODEC_FEATURE_RING	0x00000001
+#define CODEC_FEATURE_DONE_CONTEXT	0x00000002
+
+#define CODEC_RING_ENTRIES	64
+#define CODEC_MAX_BATCH		16
+
+/* how long close waits for the jobs of the file */
+#define CODEC_CLOSE_TIMEOUT	(5 * HZ)
+
+/* set in the cookie of a job whose completion is reported by read() */
+#define CODEC_JOB_ASYNC		0x80000000
+
 /* Clean up source. : _param, svcodec_param_offset, paramindex */
 struct codec_param {
 	uint32_t api_index;
@@ -72,6 +104,43 @@ enum codec_io_cmd {
 	CODEC_MMAP_OFFSET,
 	CODEC_FILE_INDEX,
 	CODEC_CLOSED,
+	CODEC_DONE_CONTEXT,
+	CODEC_FEATURES,
+	CODEC_RING_BASE,
+	CODEC_RING_DOORBELL,
+};
+
+/*
+ * Command ring shared with the host when CODEC_FEATURE_RING is offered.
+ *
+ * The driver fills desc[] and publishes avail_idx, then writes the new
+ * index to CODEC_RING_DOORBELL once per batch. The host consumes the
+ * descriptors in order and posts one used[] entry per descriptor, in any
+ * order, bumping used_idx and raising the interrupt.
+ */
+struct codec_ring_desc {
+	uint32_t api_index;
+	uint32_t ctx_index;
+	uint32_t mmap_offset;
+	uint32_t file_index;
+	uint32_t cookie;
+	uint32_t reserved[3];
+};
+
+struct codec_ring_used {
+	uint32_t file_index;
+	uint32_t cookie;
+	uint32_t ret;
+	uint32_t len;
+};
+
+struct codec_ring {
+	uint32_t avail_idx;
+	uint32_t pad0[15];
+	struct codec_ring_desc desc[CODEC_RING_ENTRIES];
+	uint32_t used_idx;
+	uint32_t pad1[15];
+	struct codec_ring_used used[CODEC_RING_ENTRIES];
 };
 
 enum codec_api_index {
@@ -92,6 +161,74 @@ enum codec_api_index {
 	EMUL_GET_CODEC_VER = 50,
 	EMUL_LOCK_MEM_REGION,
 	EMUL_UNLOCK_MEM_REGION,
+	EMUL_ALLOC_MEM_REGION,
+	EMUL_FREE_MEM_REGION,
+};
+
+/*
+ * Statistics of the jobs between submission and completion, one slot per
+ * codec API up to EMUL_AV_PARSER_CLOSE and slot 0 for anything else.
+ * Bucket i of the latency histogram counts jobs of [2^i, 2^(i+1)) usec.
+ */
+#define CODEC_STAT_APIS		(EMUL_AV_PARSER_CLOSE + 1)
+#define CODEC_LAT_BUCKETS	24
+
+struct codec_api_stat {
+	u64 count;
+	u64 bytes;
+	u64 total_us;
+	u32 hist[CODEC_LAT_BUCKETS];
+};
+
+static const char * const codec_api_name[CODEC_STAT_APIS] = {
+	[0]				= "OTHERS",
+	[EMUL_AV_REGISTER_ALL]		= "AV_REGISTER_ALL",
+	[EMUL_AVCODEC_ALLOC_CONTEXT]	= "AVCODEC_ALLOC_CONTEXT",
+	[EMUL_AVCODEC_OPEN]		= "AVCODEC_OPEN",
+	[EMUL_AVCODEC_CLOSE]		= "AVCODEC_CLOSE",
+	[EMUL_AV_FREE]			= "AV_FREE",
+	[EMUL_AVCODEC_FLUSH_BUFFERS]	= "AVCODEC_FLUSH_BUFFERS",
+	[EMUL_AVCODEC_DECODE_VIDEO]	= "AVCODEC_DECODE_VIDEO",
+	[EMUL_AVCODEC_ENCODE_VIDEO]	= "AVCODEC_ENCODE_VIDEO",
+	[EMUL_AVCODEC_DECODE_AUDIO]	= "AVCODEC_DECODE_AUDIO",
+	[EMUL_AVCODEC_ENCODE_AUDIO]	= "AVCODEC_ENCODE_AUDIO",
+	[EMUL_AV_PICTURE_COPY]		= "AV_PICTURE_COPY",
+	[EMUL_AV_PARSER_INIT]		= "AV_PARSER_INIT",
+	[EMUL_AV_PARSER_PARSE]		= "AV_PARSER_PARSE",
+	[EMUL_AV_PARSER_CLOSE]		= "AV_PARSER_CLOSE",
+};
+
+/* submission time of a job in flight */
+struct codec_job_stat {
+	uint32_t api_index;
+	ktime_t start;
+};
+
+/*
+ * Argument of EMUL_ALLOC_MEM_REGION and EMUL_FREE_MEM_REGION.
+ * offset is relative to the start of the device memory, as used by mmap()
+ * and by codec_param.mmap_offset.
+ */
+struct codec_mem_region {
+	uint32_t size;
+	uint32_t offset;
+};
+
+/*
+ * Record returned by read() for each job submitted with O_NONBLOCK.
+ * job_id is the value write() returned for the job, ret is the return
+ * value of the codec API on the host.
+ */
+struct codec_job_done {
+	uint32_t job_id;
+	uint32_t ret;
+};
+
+/* a block of device memory owned by one file */
+struct codec_mem_block {
+	struct list_head node;
+	unsigned long addr;
+	size_t size;
 };
 
 struct svcodec_device {
@@ -106,90 +243,566 @@ struct svcodec_device {
 	resource_size_t mem_start;
 	resource_size_t mem_size;
 
-	/* irq handler */
-	wait_queue_head_t codec_wq;
+	/* serializes the register sequence of one submission */
+	spinlock_t io_lock;
+
+	/* CODEC_FEATURE_* offered by the host */
+	uint32_t features;
+
+	/*
+	 * Without CODEC_FEATURE_DONE_CONTEXT the interrupt does not say
+	 * which context finished, so only one job may be in flight. Set
+	 * under lock from submission until the interrupt, even if the
+	 * submitter stopped waiting.
+	 */
+	int legacy_busy;
+	wait_queue_head_t legacy_wq;
+
+	/* protects the client list, the job counters and the ring */
 	spinlock_t lock;
-	int sleep_flag;
+	struct list_head clients;
+
+	/* command ring, NULL if the host only knows the register interface */
+	struct codec_ring *ring;
+	dma_addr_t ring_dma;
+	uint32_t avail_idx;
+	uint32_t last_used;
+	unsigned int ring_inflight;
+	wait_queue_head_t ring_wq;
+
+	/* page granular allocator over mem_start/mem_size */
+	struct gen_pool *mem_pool;
+	unsigned int mem_blocks;
+
+	/* blocks of closed files whose jobs never completed */
+	struct list_head orphan_blocks;
 
 	int availableMem;
+	struct codec_client *mem_owner;
+
+	/* protected by lock */
+	struct codec_api_stat stats[CODEC_STAT_APIS];
+	struct dentry *debugfs;
+};
+
+/*
+ * Per-file state. Each opened file drives its own codec context, so a job
+ * in flight on one context must not hold back the others.
+ */
+struct codec_client {
+	struct list_head node;
+	struct file *file;
+
+	/* serializes the submissions issued through this file */
+	struct mutex lock;
+
+	/* context index of the latest submission */
+	uint32_t ctx_index;
+
+	/* jobs submitted through this file and not completed yet */
+	unsigned int inflight;
+	wait_queue_head_t wq;
+
+	/* id of the last job and completions of O_NONBLOCK jobs */
+	uint32_t job_id;
+	DECLARE_KFIFO(done, struct codec_job_done, CODEC_RING_ENTRIES);
+
+	/* indexed by job id modulo CODEC_RING_ENTRIES */
+	struct codec_job_stat jobs[CODEC_RING_ENTRIES];
+
+	/* device memory allocated through EMUL_ALLOC_MEM_REGION */
+	struct list_head mem_blocks;
+
+	struct codec_param params[CODEC_MAX_BATCH];
 };
 
 static struct svcodec_device *svcodec;
 DEFINE_MUTEX(codec_mutex);
 
+static inline int codec_api_need_wait(uint32_t api_index)
+{
+	return api_index >= EMUL_AVCODEC_DECODE_VIDEO &&
+		api_index <= EMUL_AVCODEC_ENCODE_AUDIO;
+}
+
+static int codec_alloc_mem(struct codec_client *client,
+			struct codec_mem_region *region)
+{
+	struct codec_mem_block *block;
+
+	if (!region->size)
+		return -EINVAL;
+
+	/* the whole region is handed out by EMUL_LOCK_MEM_REGION */
+	if (svcodec->availableMem)
+		return -EBUSY;
+
+	block = kmalloc(sizeof(struct codec_mem_block), GFP_KERNEL);
+	if (!block)
+		return -ENOMEM;
+
+	block->size = PAGE_ALIGN(region->size);
+	block->addr = gen_pool_alloc(svcodec->mem_pool, block->size);
+	if (!block->addr) {
+		kfree(block);
+		return -ENOMEM;
+	}
+
+	list_add(&block->node, &client->mem_blocks);
+	svcodec->mem_blocks++;
+
+	region->size = block->size;
+	region->offset = block->addr - svcodec->mem_start;
+
+	return 0;
+}
+
+static void codec_release_block(struct codec_mem_block *block)
+{
+	gen_pool_free(svcodec->mem_pool, block->addr, block->size);
+	list_del(&block->node);
+	svcodec->mem_blocks--;
+	kfree(block);
+}
+
+static int codec_free_mem(struct codec_client *client,
+			struct codec_mem_region *region)
+{
+	struct codec_mem_block *block;
+	unsigned long addr = svcodec->mem_start + region->offset;
+
+	list_for_each_entry(block, &client->mem_blocks, node) {
+		if (block->addr == addr) {
+			codec_release_block(block);
+			return 0;
+		}
+	}
+
+	return -EINVAL;
+}
+
 static long svcodec_ioctl(struct file *file,
 			unsigned int cmd,
 			unsigned long arg)
 {
+	struct codec_client *client = file->private_data;
+	struct codec_mem_region region;
+	int state;
+	long ret = 0;
+
 	mutex_lock(&codec_mutex);
 
-	if (cmd == EMUL_LOCK_MEM_REGION) {
-		if (svcodec->availableMem == 0)
+	state = svcodec->availableMem;
+
+	switch (cmd) {
+	case EMUL_LOCK_MEM_REGION:
+		if (svcodec->availableMem == 0 && !svcodec->mem_blocks) {
 			svcodec->availableMem = 1;
+			svcodec->mem_owner = client;
+			state = 1;
+		} else {
+			/* refused, the region stays with its holder */
+			state = -1;
+		}
+		break;
+	case EMUL_UNLOCK_MEM_REGION:
+		if (svcodec->mem_owner == client) {
+			svcodec->availableMem = 0;
+			svcodec->mem_owner = NULL;
+			state = 0;
+		} else {
+			state = -1;
+		}
+		break;
+	case EMUL_ALLOC_MEM_REGION:
+	case EMUL_FREE_MEM_REGION:
+		if (copy_from_user(&region, (void __user *)arg,
+				sizeof(region))) {
+			ret = -EFAULT;
+			goto out;
+		}
+
+		if (cmd == EMUL_ALLOC_MEM_REGION)
+			ret = codec_alloc_mem(client, &region);
 		else
-			svcodec->availableMem = -1;
+			ret = codec_free_mem(client, &region);
 
-	} else if (cmd == EMUL_UNLOCK_MEM_REGION) {
-		svcodec->availableMem = 0;
-	} else {
+		if (!ret && copy_to_user((void __user *)arg, &region,
+				sizeof(region)))
+			ret = -EFAULT;
+		goto out;
+	default:
 		CODEC_LOG(KERN_ERR, "there is no command.\n");
+		break;
 	}
 
-	if (copy_to_user((void *)arg,
-			&svcodec->availableMem,
-			sizeof(int)))
+	if (copy_to_user((void *)arg, &state, sizeof(int)))
 		CODEC_LOG(KERN_ERR, "failed to copy data to user\n");
 
+out:
 	mutex_unlock(&codec_mutex);
 
-	return 0;
+	return ret;
+}
+
+/* Called with svcodec->lock held. */
+static void codec_stat_submit(struct codec_client *client,
+			struct codec_param *param, uint32_t job_id)
+{
+	struct codec_job_stat *job = &client->jobs[job_id % CODEC_RING_ENTRIES];
+
+	job->api_index = param->api_index;
+	job->start = ktime_get();
+
+	trace_maru_codec_submit((uint32_t)client->file, param->ctx_index,
+				param->api_index, job_id);
+}
+
+/* Called with svcodec->lock held. */
+static void codec_stat_complete(struct codec_client *client,
+				uint32_t job_id, uint32_t ret, uint32_t len)
+{
+	struct codec_job_stat *job = &client->jobs[job_id % CODEC_RING_ENTRIES];
+	struct codec_api_stat *stat;
+	s64 latency;
+	int bucket;
+
+	latency = ktime_us_delta(ktime_get(), job->start);
+
+	if (job->api_index < CODEC_STAT_APIS)
+		stat = &svcodec->stats[job->api_index];
+	else
+		stat = &svcodec->stats[0];
+
+	bucket = latency > 0 ? ilog2((u32)min_t(s64, latency, UINT_MAX)) : 0;
+	if (bucket >= CODEC_LAT_BUCKETS)
+		bucket = CODEC_LAT_BUCKETS - 1;
+
+	stat->count++;
+	stat->bytes += len;
+	stat->total_us += latency;
+	stat->hist[bucket]++;
+
+	trace_maru_codec_complete((uint32_t)client->file, job->api_index,
+				job_id, ret, len, latency);
+}
+
+/* Called with svcodec->lock held. */
+static uint32_t codec_next_job_id(struct codec_client *client)
+{
+	client->job_id = (client->job_id + 1) & ~CODEC_JOB_ASYNC;
+	if (!client->job_id)
+		client->job_id = 1;
+
+	return client->job_id;
+}
+
+/* Called with svcodec->lock held. */
+static void codec_post_done(struct codec_client *client,
+			uint32_t job_id, uint32_t ret)
+{
+	struct codec_job_done done = {
+		.job_id = job_id,
+		.ret = ret,
+	};
+
+	if (!kfifo_put(&client->done, &done))
+		CODEC_LOG(KERN_ERR, "completion of job %u is lost\n", job_id);
 }
 
+/*
+ * Return the completions of the jobs submitted with O_NONBLOCK
+ * as an array of struct codec_job_done.
+ */
 static ssize_t svcodec_read(struct file *file, char __user *buf,
 			size_t count, loff_t *fops)
 {
-	CODEC_LOG(KERN_INFO, "do nothing in the read operation.\n");
+	struct codec_client *client = file->private_data;
+	struct codec_job_done done[CODEC_MAX_BATCH];
+	unsigned long flags;
+	unsigned int max, nr, inflight;
+	int ret;
+
+	max = min_t(size_t, count / sizeof(struct codec_job_done),
+		CODEC_MAX_BATCH);
+	if (!max)
+		return -EINVAL;
+
+	for (;;) {
+		spin_lock_irqsave(&svcodec->lock, flags);
+		nr = kfifo_out(&client->done, done, max);
+		inflight = client->inflight;
+		spin_unlock_irqrestore(&svcodec->lock, flags);
+
+		if (nr)
+			break;
+
+		/* nothing is going to complete */
+		if (!inflight)
+			return 0;
+
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		ret = wait_event_interruptible(client->wq,
+				!kfifo_is_empty(&client->done) ||
+				!client->inflight);
+		if (ret)
+			return ret;
+	}
+
+	if (copy_to_user(buf, done, nr * sizeof(struct codec_job_done)))
+		return -EFAULT;
+
+	return nr * sizeof(struct codec_job_done);
+}
+
+static unsigned int svcodec_poll(struct file *file, poll_table *wait)
+{
+	struct codec_client *client = file->private_data;
+	unsigned int mask = 0;
+	unsigned long flags;
+
+	poll_wait(file, &client->wq, wait);
+	if (svcodec->ring)
+		poll_wait(file, &svcodec->ring_wq, wait);
+
+	spin_lock_irqsave(&svcodec->lock, flags);
+	if (!kfifo_is_empty(&client->done))
+		mask |= POLLIN | POLLRDNORM;
+	if (client->inflight + kfifo_len(&client->done) < CODEC_RING_ENTRIES &&
+		(!svcodec->ring || svcodec->ring_inflight < CODEC_RING_ENTRIES))
+		mask |= POLLOUT | POLLWRNORM;
+	spin_unlock_irqrestore(&svcodec->lock, flags);
+
+	return mask;
+}
+
+/*
+ * Issue one job through the register interface of the device.
+ * The register interface has one job per context in flight at most,
+ * so even O_NONBLOCK jobs are completed before returning. A signal
+ * ends the wait but not the job, so the next job of the client, and
+ * without CODEC_FEATURE_DONE_CONTEXT of any client, waits for it first.
+ */
+static int codec_legacy_submit(struct codec_client *client,
+				struct codec_param *param, int async)
+{
+	unsigned long flags;
+	int need_wait = codec_api_need_wait(param->api_index);
+	int serialize = !(svcodec->features & CODEC_FEATURE_DONE_CONTEXT);
+	uint32_t job_id;
+	int ret;
+
+	ret = wait_event_interruptible(client->wq,
+			ACCESS_ONCE(client->inflight) == 0);
+	if (ret)
+		return ret;
+
+	for (;;) {
+		if (serialize) {
+			ret = wait_event_interruptible(svcodec->legacy_wq,
+					!ACCESS_ONCE(svcodec->legacy_busy));
+			if (ret)
+				return ret;
+		}
+
+		spin_lock_irqsave(&svcodec->lock, flags);
+		if (!serialize || !svcodec->legacy_busy)
+			break;
+		spin_unlock_irqrestore(&svcodec->lock, flags);
+	}
+
+	if (serialize)
+		svcodec->legacy_busy = 1;
+	client->ctx_index = param->ctx_index;
+	if (need_wait)
+		client->inflight++;
+	job_id = codec_next_job_id(client);
+	codec_stat_submit(client, param, job_id);
+	spin_unlock_irqrestore(&svcodec->lock, flags);
+
+	spin_lock(&svcodec->io_lock);
+	if (param->api_index == EMUL_AVCODEC_ALLOC_CONTEXT)
+		writel((uint32_t)client->file,
+			svcodec->ioaddr + CODEC_FILE_INDEX);
+
+	writel((uint32_t)param->ctx_index,
+		svcodec->ioaddr + CODEC_CONTEXT_INDEX);
+	writel((uint32_t)param->mmap_offset,
+		svcodec->ioaddr + CODEC_MMAP_OFFSET);
+	writel((uint32_t)param->api_index,
+		svcodec->ioaddr + CODEC_API_INDEX);
+	spin_unlock(&svcodec->io_lock);
+
+	/* wait decoding or encoding job of this context only */
+	if (need_wait) {
+		ret = wait_event_interruptible(client->wq,
+				ACCESS_ONCE(client->inflight) == 0);
+		if (ret)
+			return ret;
+	} else {
+		/* the host ran the job while handling CODEC_API_INDEX */
+		spin_lock_irqsave(&svcodec->lock, flags);
+		codec_stat_complete(client, job_id, 0, 0);
+		if (serialize)
+			svcodec->legacy_busy = 0;
+		spin_unlock_irqrestore(&svcodec->lock, flags);
+		if (serialize)
+			wake_up(&svcodec->legacy_wq);
+	}
+
+	if (async) {
+		spin_lock_irqsave(&svcodec->lock, flags);
+		codec_post_done(client, job_id, 0);
+		spin_unlock_irqrestore(&svcodec->lock, flags);
+		wake_up(&client->wq);
+	}
+
 	return 0;
 }
 
-/* Copy data between guest and host using mmap operation. */
+/* Called with svcodec->lock held. */
+static int codec_async_room(struct codec_client *client, int nr)
+{
+	return client->inflight + kfifo_len(&client->done) + nr
+		<= CODEC_RING_ENTRIES;
+}
+
+/*
+ * Queue a batch of jobs on the command ring and ring the doorbell once.
+ * The host runs ring jobs asynchronously, so wait for all of them unless
+ * the file is in O_NONBLOCK mode; read() reports those instead. Jobs left
+ * behind by an interrupted wait are finished first, so that the wait only
+ * covers the new batch.
+ */
+static int codec_ring_submit(struct codec_client *client,
+			struct codec_param *param, int nr, int async)
+{
+	struct codec_ring *ring = svcodec->ring;
+	struct codec_ring_desc *desc;
+	unsigned long flags;
+	uint32_t avail_idx;
+	int i, ret;
+
+	if (!async) {
+		ret = wait_event_interruptible(client->wq,
+				ACCESS_ONCE(client->inflight) == 0);
+		if (ret)
+			return ret;
+	}
+
+	for (;;) {
+		if (!async) {
+			ret = wait_event_interruptible(svcodec->ring_wq,
+				svcodec->ring_inflight + nr
+					<= CODEC_RING_ENTRIES);
+			if (ret)
+				return ret;
+		}
+
+		spin_lock_irqsave(&svcodec->lock, flags);
+		if (svcodec->ring_inflight + nr <= CODEC_RING_ENTRIES &&
+			(!async || codec_async_room(client, nr)))
+			break;
+		spin_unlock_irqrestore(&svcodec->lock, flags);
+
+		if (async)
+			return -EAGAIN;
+	}
+
+	for (i = 0; i < nr; i++) {
+		desc = &ring->desc[svcodec->avail_idx % CODEC_RING_ENTRIES];
+		desc->api_index = param[i].api_index;
+		desc->ctx_index = param[i].ctx_index;
+		desc->mmap_offset = param[i].mmap_offset;
+		desc->file_index = (uint32_t)client->file;
+		desc->cookie = codec_next_job_id(client);
+		codec_stat_submit(client, &param[i], desc->cookie);
+		if (async)
+			desc->cookie |= CODEC_JOB_ASYNC;
+		svcodec->avail_idx++;
+	}
+
+	client->ctx_index = param[nr - 1].ctx_index;
+	client->inflight += nr;
+	svcodec->ring_inflight += nr;
+
+	/* the host must see the descriptors before the new index */
+	wmb();
+	ring->avail_idx = avail_idx = svcodec->avail_idx;
+	spin_unlock_irqrestore(&svcodec->lock, flags);
+
+	writel(avail_idx, svcodec->ioaddr + CODEC_RING_DOORBELL);
+
+	if (!async)
+		return wait_event_interruptible(client->wq,
+				ACCESS_ONCE(client->inflight) == 0);
+
+	return 0;
+}
+
+/*
+ * Copy data between guest and host using mmap operation.
+ * Several codec_param may be written at once, up to CODEC_MAX_BATCH.
+ *
+ * If the file is in O_NONBLOCK mode, the jobs are only queued and the id
+ * of the last one is returned. The ids of a batch are consecutive, and
+ * their completions are collected with read() once poll() reports POLLIN.
+ */
 static ssize_t svcodec_write(struct file *file, const char __user *buf,
 			size_t count, loff_t *fops)
 {
-	struct codec_param paramInfo;
-
-	mutex_lock(&codec_mutex);
+	struct codec_client *client = file->private_data;
+	int async = file->f_flags & O_NONBLOCK;
+	unsigned long flags;
+	int i, nr, ret = 0;
 
-	if (!svcodec) {
+	if (!svcodec || !client) {
 		CODEC_LOG(KERN_ERR, "failed to get codec device info\n");
 		return -EINVAL;
 	}
 
-	if (copy_from_user(&paramInfo, buf, sizeof(struct codec_param)))
+	nr = count / sizeof(struct codec_param);
+	if (!nr)
+		nr = 1;
+	if (nr > CODEC_MAX_BATCH)
+		return -EINVAL;
+
+	mutex_lock(&client->lock);
+
+	if (copy_from_user(client->params, buf,
+			nr * sizeof(struct codec_param))) {
 		CODEC_LOG(KERN_ERR,
 			"failed to get codec parameter info from user\n");
+		ret = -EFAULT;
+		goto out;
+	}
 
-	if (paramInfo.api_index == EMUL_AVCODEC_ALLOC_CONTEXT)
-		writel((uint32_t)file, svcodec->ioaddr + CODEC_FILE_INDEX);
-
-	writel((uint32_t)paramInfo.ctx_index,
-		svcodec->ioaddr + CODEC_CONTEXT_INDEX);
-	writel((uint32_t)paramInfo.mmap_offset,
-		svcodec->ioaddr + CODEC_MMAP_OFFSET);
-	writel((uint32_t)paramInfo.api_index,
-		svcodec->ioaddr + CODEC_API_INDEX);
+	if (svcodec->ring) {
+		ret = codec_ring_submit(client, client->params, nr, async);
+	} else {
+		if (async) {
+			spin_lock_irqsave(&svcodec->lock, flags);
+			if (kfifo_avail(&client->done) < nr)
+				ret = -EAGAIN;
+			spin_unlock_irqrestore(&svcodec->lock, flags);
+			if (ret)
+				goto out;
+		}
 
-	/* wait decoding or encoding job */
-	if (paramInfo.api_index >= EMUL_AVCODEC_DECODE_VIDEO &&
-		paramInfo.api_index <= EMUL_AVCODEC_ENCODE_AUDIO) {
-		wait_event_interruptible(svcodec->codec_wq,
-					svcodec->sleep_flag != 0);
-		svcodec->sleep_flag = 0;
+		for (i = 0; i < nr && !ret; i++)
+			ret = codec_legacy_submit(client, &client->params[i],
+						async);
 	}
 
-	mutex_unlock(&codec_mutex);
+	if (!ret && async)
+		ret = client->job_id;
 
-	return 0;
+out:
+	mutex_unlock(&client->lock);
+
+	return ret;
 }
 
 static int svcodec_mmap(struct file *file, struct vm_area_struct *vm)
@@ -203,7 +816,7 @@ static int svcodec_mmap(struct file *file, struct vm_area_struct *vm)
 	phys_addr = (PAGE_ALIGN(svcodec->mem_start) + off) >> PAGE_SHIFT;
 	size = vm->vm_end - vm->vm_start;
 
-	if (size > svcodec->mem_size) {
+	if (off > svcodec->mem_size || size > svcodec->mem_size - off) {
 		CODEC_LOG(KERN_ERR, "over mapping size\n");
 		return -EINVAL;
 	}
@@ -221,24 +834,118 @@ static int svcodec_mmap(struct file *file, struct vm_area_struct *vm)
 	return 0;
 }
 
+/* Wake up the client whose context has finished its job. */
+static void svcodec_complete_context(struct svcodec_device *dev,
+				uint32_t ctx_index)
+{
+	struct codec_client *client;
+
+	list_for_each_entry(client, &dev->clients, node) {
+		if (client->ctx_index == ctx_index && client->inflight) {
+			/* only the last job of a client can be in flight */
+			codec_stat_complete(client, client->job_id, 0, 0);
+			client->inflight = 0;
+			wake_up(&client->wq);
+			return;
+		}
+	}
+
+	CODEC_LOG(KERN_DEBUG, "no waiter for context %u\n", ctx_index);
+}
+
+/*
+ * Without CODEC_DONE_CONTEXT, wake the only client that has a job.
+ * The device is idle afterwards even if that client has been closed.
+ */
+static void svcodec_complete_any(struct svcodec_device *dev)
+{
+	struct codec_client *client;
+
+	list_for_each_entry(client, &dev->clients, node) {
+		if (client->inflight) {
+			codec_stat_complete(client, client->job_id, 0, 0);
+			client->inflight = 0;
+			wake_up(&client->wq);
+		}
+	}
+
+	dev->legacy_busy = 0;
+	wake_up(&dev->legacy_wq);
+}
+
+static struct codec_client *svcodec_find_client(struct svcodec_device *dev,
+						uint32_t file_index)
+{
+	struct codec_client *client;
+
+	list_for_each_entry(client, &dev->clients, node) {
+		if ((uint32_t)client->file == file_index)
+			return client;
+	}
+
+	return NULL;
+}
+
+/* Retire the used entries the host has posted since the last interrupt. */
+static void svcodec_drain_ring(struct svcodec_device *dev)
+{
+	struct codec_ring *ring = dev->ring;
+	struct codec_ring_used *used;
+	struct codec_client *client;
+
+	while (dev->last_used != ACCESS_ONCE(ring->used_idx)) {
+		/* read the entry only after its index */
+		rmb();
+		used = &ring->used[dev->last_used % CODEC_RING_ENTRIES];
+
+		client = svcodec_find_client(dev, used->file_index);
+		if (client && client->inflight) {
+			codec_stat_complete(client,
+				used->cookie & ~CODEC_JOB_ASYNC,
+				used->ret, used->len);
+			client->inflight--;
+			if (used->cookie & CODEC_JOB_ASYNC) {
+				codec_post_done(client,
+					used->cookie & ~CODEC_JOB_ASYNC,
+					used->ret);
+				wake_up(&client->wq);
+			} else if (!client->inflight) {
+				wake_up(&client->wq);
+			}
+		} else {
+			CODEC_LOG(KERN_DEBUG, "no waiter for job %u\n",
+				used->cookie);
+		}
+
+		dev->ring_inflight--;
+		dev->last_used++;
+	}
+
+	wake_up_interruptible(&dev->ring_wq);
+}
+
 static irqreturn_t svcodec_irq_handler (int irq, void *dev_id)
 {
 	struct svcodec_device *dev = (struct svcodec_device *)dev_id;
-	int val = 0;
+	uint32_t val = 0;
 	unsigned long flags;
 
-/*	spin_lock_irqsave(&dev->lock, flags); */
-
 	val = readl(dev->ioaddr + CODEC_QUERY_STATE);
-	if (!(val & CODEC_IRQ)) {
-/*		spin_unlock_irqrestore(&dev->lock, flags); */
+	if (!(val & CODEC_IRQ))
 		return IRQ_NONE;
-	}
 
 	spin_lock_irqsave(&dev->lock, flags);
 
-	dev->sleep_flag = 1;
-	wake_up_interruptible(&dev->codec_wq);
+	if (dev->ring) {
+		svcodec_drain_ring(dev);
+	} else if (!(dev->features & CODEC_FEATURE_DONE_CONTEXT)) {
+		svcodec_complete_any(dev);
+	} else {
+		/* several contexts may have finished before we got here. */
+		while ((val = readl(dev->ioaddr + CODEC_DONE_CONTEXT))
+				& CODEC_DONE_VALID)
+			svcodec_complete_context(dev, val & ~CODEC_DONE_VALID);
+	}
 
 	spin_unlock_irqrestore(&dev->lock, flags);
 
@@ -247,18 +954,29 @@ static irqreturn_t svcodec_irq_handler (int irq, void *dev_id)
 
 static int svcodec_open(struct inode *inode, struct file *file)
 {
-	mutex_lock(&codec_mutex);
-	CODEC_LOG(KERN_DEBUG, "open! struct file:%p\n", file);
+	struct codec_client *client;
+	unsigned long flags;
 
-	svcodec->sleep_flag = 0;
+	CODEC_LOG(KERN_DEBUG, "open! struct file:%p\n", file);
 
-	/* register interrupt handler */
-	if (request_irq(svcodec->dev->irq, svcodec_irq_handler,
-		IRQF_SHARED, DRIVER_NAME, svcodec)) {
-		CODEC_LOG(KERN_ERR, "failed to register irq handle\n");
-		return -EBUSY;
+	client = kzalloc(sizeof(struct codec_client), GFP_KERNEL);
+	if (!client) {
+		CODEC_LOG(KERN_ERR, "failed to allocate codec client\n");
+		return -ENOMEM;
 	}
 
+	client->file = file;
+	mutex_init(&client->lock);
+	init_waitqueue_head(&client->wq);
+	INIT_KFIFO(client->done);
+	INIT_LIST_HEAD(&client->mem_blocks);
+	file->private_data = client;
+
+	mutex_lock(&codec_mutex);
+	spin_lock_irqsave(&svcodec->lock, flags);
+	list_add_tail(&client->node, &svcodec->clients);
+	spin_unlock_irqrestore(&svcodec->lock, flags);
+
 	try_module_get(THIS_MODULE);
 	mutex_unlock(&codec_mutex);
 
@@ -267,14 +985,45 @@ static int svcodec_open(struct inode *inode, struct file *file)
 
 static int svcodec_release(struct inode *inode, struct file *file)
 {
+	struct codec_client *client = file->private_data;
+	struct codec_mem_block *block, *tmp;
+	unsigned long flags;
+	unsigned int inflight;
+
+	/*
+	 * The host may still write into the memory of a job in flight,
+	 * so give it some time to finish. A host that does not is left
+	 * with the blocks: the client is unlinked, which drops its late
+	 * completions, and the blocks stay out of the pool until remove.
+	 */
+	if (client &&
+		!wait_event_timeout(client->wq,
+			ACCESS_ONCE(client->inflight) == 0, CODEC_CLOSE_TIMEOUT))
+		CODEC_LOG(KERN_WARNING, "closing with %u jobs in flight\n",
+			client->inflight);
+
 	mutex_lock(&codec_mutex);
 
-	/* free irq */
-	if (svcodec->dev->irq) {
-		CODEC_LOG(KERN_DEBUG, "free registered irq\n");
-		free_irq(svcodec->dev->irq, svcodec);
+	if (client) {
+		spin_lock_irqsave(&svcodec->lock, flags);
+		list_del(&client->node);
+		inflight = client->inflight;
+		spin_unlock_irqrestore(&svcodec->lock, flags);
+
+		if (inflight)
+			list_splice_init(&client->mem_blocks,
+					&svcodec->orphan_blocks);
+		list_for_each_entry_safe(block, tmp, &client->mem_blocks, node)
+			codec_release_block(block);
+
+		if (svcodec->mem_owner == client) {
+			svcodec->availableMem = 0;
+			svcodec->mem_owner = NULL;
+		}
+
+		kfree(client);
+		file->private_data = NULL;
 	}
-	svcodec->availableMem = 0;
 
 	/* notify closing codec device of qemu. */
 	if (file)
@@ -286,11 +1035,67 @@ static int svcodec_release(struct inode *inode, struct file *file)
 	return 0;
 }
 
+static int codec_stats_show(struct seq_file *m, void *v)
+{
+	struct codec_api_stat stat;
+	unsigned long flags;
+	int i, j;
+
+	seq_printf(m, "%-24s %10s %12s %12s  %s\n", "api", "count",
+		"bytes", "avg(us)", "latency log2(us) histogram");
+
+	for (i = 0; i < CODEC_STAT_APIS; i++) {
+		spin_lock_irqsave(&svcodec->lock, flags);
+		stat = svcodec->stats[i];
+		spin_unlock_irqrestore(&svcodec->lock, flags);
+
+		if (!stat.count)
+			continue;
+
+		seq_printf(m, "%-24s %10llu %12llu %12llu ",
+			codec_api_name[i], stat.count, stat.bytes,
+			div64_u64(stat.total_us, stat.count));
+		for (j = 0; j < CODEC_LAT_BUCKETS; j++)
+			seq_printf(m, " %u", stat.hist[j]);
+		seq_putc(m, '\n');
+	}
+
+	return 0;
+}
+
+static int codec_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, codec_stats_show, NULL);
+}
+
+/* writing anything to the stats file clears the statistics */
+static ssize_t codec_stats_write(struct file *file, const char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&svcodec->lock, flags);
+	memset(svcodec->stats, 0, sizeof(svcodec->stats));
+	spin_unlock_irqrestore(&svcodec->lock, flags);
+
+	return count;
+}
+
+static const struct file_operations codec_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= codec_stats_open,
+	.read		= seq_read,
+	.write		= codec_stats_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 /* define file opertion for CODEC */
 const struct file_operations svcodec_fops = {
 	.owner			 = THIS_MODULE,
 	.read			 = svcodec_read,
 	.write			 = svcodec_write,
+	.poll			 = svcodec_poll,
 	.unlocked_ioctl	 = svcodec_ioctl,
 	.open			 = svcodec_open,
 	.mmap			 = svcodec_mmap,
@@ -303,8 +1108,12 @@ static int __devinit svcodec_probe(struct pci_dev *pci_dev,
 	svcodec = kmalloc(sizeof(struct svcodec_device), GFP_KERNEL);
 	memset(svcodec, 0x00, sizeof(struct svcodec_device));
 
-	init_waitqueue_head(&svcodec->codec_wq);
+	spin_lock_init(&svcodec->io_lock);
+	init_waitqueue_head(&svcodec->legacy_wq);
 	spin_lock_init(&svcodec->lock);
+	INIT_LIST_HEAD(&svcodec->clients);
+	INIT_LIST_HEAD(&svcodec->orphan_blocks);
+	init_waitqueue_head(&svcodec->ring_wq);
 
 	svcodec->dev = pci_dev;
 
@@ -330,19 +1139,31 @@ static int __devinit svcodec_probe(struct pci_dev *pci_dev,
 		goto err_out;
 	}
 
+	svcodec->mem_pool = gen_pool_create(PAGE_SHIFT, -1);
+	if (!svcodec->mem_pool) {
+		CODEC_LOG(KERN_ERR, "gen_pool_create failed\n");
+		goto err_mem_region;
+	}
+
+	if (gen_pool_add(svcodec->mem_pool, svcodec->mem_start,
+			svcodec->mem_size, -1)) {
+		CODEC_LOG(KERN_ERR, "gen_pool_add failed\n");
+		goto err_mem_pool;
+	}
+
 	svcodec->io_start = pci_resource_start(pci_dev, 1);
 	svcodec->io_size = pci_resource_len(pci_dev, 1);
 
 	if (!svcodec->io_start) {
 		CODEC_LOG(KERN_ERR, "pci_resource_start failed\n");
-		goto err_mem_region;
+		goto err_mem_pool;
 	}
 
 	if (!request_mem_region(svcodec->io_start,
 				svcodec->io_size,
 				DRIVER_NAME)) {
 		CODEC_LOG(KERN_ERR, "request_io_region failed\n");
-		goto err_mem_region;
+		goto err_mem_pool;
 	}
 
 #if 0
@@ -359,15 +1180,50 @@ static int __devinit svcodec_probe(struct pci_dev *pci_dev,
 		goto err_io_region;
 	}
 
+	svcodec->features = readl(svcodec->ioaddr + CODEC_FEATURES);
+	if (svcodec->features & CODEC_FEATURE_RING) {
+		svcodec->ring = dma_alloc_coherent(&pci_dev->dev,
+					sizeof(struct codec_ring),
+					&svcodec->ring_dma, GFP_KERNEL);
+		if (svcodec->ring) {
+			memset(svcodec->ring, 0, sizeof(struct codec_ring));
+			writel((uint32_t)svcodec->ring_dma,
+				svcodec->ioaddr + CODEC_RING_BASE);
+			CODEC_LOG(KERN_INFO, "using command ring\n");
+		} else {
+			CODEC_LOG(KERN_WARNING,
+				"failed to allocate command ring\n");
+		}
+	}
+
+	/* register interrupt handler */
+	if (request_irq(svcodec->dev->irq, svcodec_irq_handler,
+		IRQF_SHARED, DRIVER_NAME, svcodec)) {
+		CODEC_LOG(KERN_ERR, "failed to register irq handle\n");
+		goto err_ring;
+	}
+
 	/* register chrdev */
 	if (register_chrdev(CODEC_MAJOR, DRIVER_NAME, &svcodec_fops)) {
 		CODEC_LOG(KERN_ERR, "register_chrdev failed\n");
-		goto err_io_unmap;
+		goto err_irq;
 	}
 
+	svcodec->debugfs = debugfs_create_dir("maru_codec", NULL);
+	if (!IS_ERR_OR_NULL(svcodec->debugfs))
+		debugfs_create_file("stats", S_IRUGO | S_IWUSR,
+				svcodec->debugfs, NULL, &codec_stats_fops);
+
 	return 0;
 
-err_io_unmap:
+err_irq:
+	free_irq(svcodec->dev->irq, svcodec);
+err_ring:
+	if (svcodec->ring) {
+		writel(0, svcodec->ioaddr + CODEC_RING_BASE);
+		dma_free_coherent(&pci_dev->dev, sizeof(struct codec_ring),
+				svcodec->ring, svcodec->ring_dma);
+	}
 	iounmap(svcodec->ioaddr);
 #if 0
 err_mem_unmap:
@@ -375,6 +1231,8 @@ err_mem_unmap:
 #endif
 err_io_region:
 	release_mem_region(svcodec->io_start, svcodec->io_size);
+err_mem_pool:
+	gen_pool_destroy(svcodec->mem_pool);
 err_mem_region:
 	release_mem_region(svcodec->mem_start, svcodec->mem_size);
 err_out:
@@ -385,7 +1243,24 @@ err_rel:
 
 static void __devinit svcodec_remove(struct pci_dev *pci_dev)
 {
+	struct codec_mem_block *block, *tmp;
+
 	if (svcodec) {
+		debugfs_remove_recursive(svcodec->debugfs);
+
+		if (svcodec->dev->irq) {
+			CODEC_LOG(KERN_DEBUG, "free registered irq\n");
+			free_irq(svcodec->dev->irq, svcodec);
+		}
+
+		if (svcodec->ring) {
+			writel(0, svcodec->ioaddr + CODEC_RING_BASE);
+			dma_free_coherent(&pci_dev->dev,
+					sizeof(struct codec_ring),
+					svcodec->ring, svcodec->ring_dma);
+			svcodec->ring = NULL;
+		}
+
 		if (svcodec->ioaddr) {
 			iounmap(svcodec->ioaddr);
 			svcodec->ioaddr = 0;
@@ -404,6 +1279,14 @@ static void __devinit svcodec_remove(struct pci_dev *pci_dev)
 			svcodec->io_start = 0;
 		}
 
+		if (svcodec->mem_pool) {
+			list_for_each_entry_safe(block, tmp,
+					&svcodec->orphan_blocks, node)
+				codec_release_block(block);
+			gen_pool_destroy(svcodec->mem_pool);
+			svcodec->mem_pool = NULL;
+		}
+
 		if (svcodec->mem_start) {
 			release_mem_region(svcodec->mem_start,
 					svcodec->mem_size);
@@ -433,15 +1316,32 @@ static struct pci_driver driver = {
 	.remove = svcodec_remove,
 };
 
+static int svcodec_register(void)
+{
+	return pci_register_driver(&driver);
+}
+
+static void svcodec_unregister(void)
+{
+	pci_unregister_driver(&driver);
+}
+
+static struct maru_async_driver svcodec_async = {
+	.name = DRIVER_NAME,
+	.reg = svcodec_register,
+	.unreg = svcodec_unregister,
+};
+
 static int __init svcodec_init(void)
 {
 	CODEC_LOG(KERN_INFO, "device is initialized.\n");
-	return pci_register_driver(&driver);
+	maru_async_register(&svcodec_async);
+	return 0;
 }
 
 static void __exit svcodec_exit(void)
 {
-	pci_unregister_driver(&driver);
+	maru_async_unregister(&svcodec_async);
 }
 module_init(svcodec_init);
 module_exit(svcodec_exit);
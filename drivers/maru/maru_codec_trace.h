@@ -0,0 +1,67 @@
+#if !defined(_MARU_CODEC_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _MARU_CODEC_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM maru_codec
+#define TRACE_INCLUDE_FILE maru_codec_trace
+
+TRACE_EVENT(maru_codec_submit,
+	TP_PROTO(uint32_t file_index, uint32_t ctx_index,
+		uint32_t api_index, uint32_t job_id),
+	TP_ARGS(file_index, ctx_index, api_index, job_id),
+
+	TP_STRUCT__entry(
+		__field(uint32_t, file_index)
+		__field(uint32_t, ctx_index)
+		__field(uint32_t, api_index)
+		__field(uint32_t, job_id)
+	),
+
+	TP_fast_assign(
+		__entry->file_index = file_index;
+		__entry->ctx_index = ctx_index;
+		__entry->api_index = api_index;
+		__entry->job_id = job_id;
+	),
+
+	TP_printk("file=%x ctx=%u api=%u job=%u",
+		__entry->file_index, __entry->ctx_index,
+		__entry->api_index, __entry->job_id)
+);
+
+TRACE_EVENT(maru_codec_complete,
+	TP_PROTO(uint32_t file_index, uint32_t api_index, uint32_t job_id,
+		uint32_t ret, uint32_t len, s64 latency_us),
+	TP_ARGS(file_index, api_index, job_id, ret, len, latency_us),
+
+	TP_STRUCT__entry(
+		__field(uint32_t, file_index)
+		__field(uint32_t, api_index)
+		__field(uint32_t, job_id)
+		__field(uint32_t, ret)
+		__field(uint32_t, len)
+		__field(s64, latency_us)
+	),
+
+	TP_fast_assign(
+		__entry->file_index = file_index;
+		__entry->api_index = api_index;
+		__entry->job_id = job_id;
+		__entry->ret = ret;
+		__entry->len = len;
+		__entry->latency_us = latency_us;
+	),
+
+	TP_printk("file=%x api=%u job=%u ret=%u len=%u latency=%lldus",
+		__entry->file_index, __entry->api_index, __entry->job_id,
+		__entry->ret, __entry->len, __entry->latency_us)
+);
+
+#endif /* _MARU_CODEC_TRACE_H_ */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#include <trace/define_trace.h>
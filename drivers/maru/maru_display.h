@@ -0,0 +1,44 @@
+/*
+ * Display power state shared by the maru display drivers
+ *
+ * Copyright (C) 2012 Samsung Electronics Co., Ltd. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Contributors:
+ * - S-Core Co., Ltd
+ *
+ */
+
+#ifndef _MARU_DISPLAY_H
+#define _MARU_DISPLAY_H
+
+/*
+ * Each source reports whether it lets the panel be lit. maru_fb keeps
+ * the host refreshing only while none of them is dark.
+ */
+#define MARU_DISPLAY_FB		0x01	/* fb_blank() */
+#define MARU_DISPLAY_BL		0x02	/* backlight */
+#define MARU_DISPLAY_LCD	0x04	/* lcd_power */
+
+#if defined(CONFIG_MARU_FB) || (defined(CONFIG_MARU_FB_MODULE) && defined(MODULE))
+extern void marufb_set_display_power(unsigned int source, int on);
+#else
+static inline void marufb_set_display_power(unsigned int source, int on)
+{
+}
+#endif
+
+#endif /* _MARU_DISPLAY_H */
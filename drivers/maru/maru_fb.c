@@ -37,11 +37,17 @@
 #include <linux/connector.h>
 #include <linux/random.h>
 #include <linux/platform_device.h>
+#include <linux/pci.h>
 #include <linux/limits.h>
 #include <linux/fb.h>
 #include <linux/io.h>
 #include <linux/mutex.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/uaccess.h>
+#include <linux/interrupt.h>
+#include <linux/wait.h>
 #include <video/edid.h>
 #ifdef CONFIG_X86
 #include <video/vga.h>
@@ -51,6 +57,8 @@
 #endif
 #include "../video/edid.h"
 #include "maru_fb.h"
+#include "maru_display.h"
+#include "maru_async.h"
 
 static struct cb_id uvesafb_cn_id = {
 	.idx = CN_IDX_V86D,
@@ -294,6 +302,417 @@ static struct uvesafb_ktask *uvesafb_prep(void)
 	return task;
 }
 
+static DEFINE_SPINLOCK(dispi_lock);
+
+static u16 uvesafb_dispi_read(u16 index)
+{
+	unsigned long flags;
+	u16 val;
+
+	spin_lock_irqsave(&dispi_lock, flags);
+	outw(index, VBE_DISPI_IOPORT_INDEX);
+	val = inw(VBE_DISPI_IOPORT_DATA);
+	spin_unlock_irqrestore(&dispi_lock, flags);
+
+	return val;
+}
+
+static void uvesafb_dispi_write(u16 index, u16 val)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&dispi_lock, flags);
+	outw(index, VBE_DISPI_IOPORT_INDEX);
+	outw(val, VBE_DISPI_IOPORT_DATA);
+	spin_unlock_irqrestore(&dispi_lock, flags);
+}
+
+/*
+ * Find out which paravirtual extensions the emulated VGA offers.
+ * Only the DISPI index/data ports are used, so hosts without the
+ * extensions (or without a Bochs-compatible VGA) just report none.
+ */
+static void __devinit uvesafb_dispi_init(struct uvesafb_par *par)
+{
+	par->features = 0;
+
+	if (!request_region(VBE_DISPI_IOPORT_INDEX, 2, "uvesafb"))
+		return;
+
+	if ((uvesafb_dispi_read(VBE_DISPI_INDEX_ID) & VBE_DISPI_ID_MASK) !=
+			VBE_DISPI_ID0) {
+		release_region(VBE_DISPI_IOPORT_INDEX, 2);
+		return;
+	}
+
+	par->dispi = 1;
+	par->features = uvesafb_dispi_read(MARUFB_INDEX_FEATURES);
+}
+
+static void uvesafb_dispi_exit(struct uvesafb_par *par)
+{
+	if (par->dispi)
+		release_region(VBE_DISPI_IOPORT_INDEX, 2);
+	par->dispi = 0;
+}
+
+/* Flush the damage once per frame at most. */
+#define UVESAFB_FRAME_JIFFIES	DIV_ROUND_UP(HZ, 60)
+
+static u32 uvesafb_rect_area(const struct marufb_rect *r)
+{
+	return (u32)r->w * r->h;
+}
+
+static void uvesafb_rect_union(struct marufb_rect *dst,
+		const struct marufb_rect *r)
+{
+	u16 x1 = max(dst->x + dst->w, r->x + r->w);
+	u16 y1 = max(dst->y + dst->h, r->y + r->h);
+
+	dst->x = min(dst->x, r->x);
+	dst->y = min(dst->y, r->y);
+	dst->w = x1 - dst->x;
+	dst->h = y1 - dst->y;
+}
+
+static int uvesafb_rect_touch(const struct marufb_rect *a,
+		const struct marufb_rect *b)
+{
+	return a->x <= b->x + b->w && b->x <= a->x + a->w &&
+	       a->y <= b->y + b->h && b->y <= a->y + a->h;
+}
+
+/*
+ * Record a damaged rectangle. Rectangles that touch an already recorded
+ * one are merged into it. Once the list is full, the new rectangle is
+ * merged into the entry whose area grows the least, so a frame never
+ * carries more than MARUFB_DAMAGE_RECTS rectangles.
+ *
+ * Called from the drawing hooks, possibly in atomic context.
+ */
+static void uvesafb_damage_add(struct fb_info *info, u32 x, u32 y,
+		u32 w, u32 h)
+{
+	struct uvesafb_par *par = info->par;
+	struct marufb_rect r, u;
+	unsigned long flags;
+	u32 cost, best_cost = ~0U;
+	int i, best = 0;
+
+	if (!ACCESS_ONCE(par->damage_on) || ACCESS_ONCE(par->dark))
+		return;
+
+	if (x >= info->var.xres_virtual || y >= info->var.yres_virtual)
+		return;
+	w = min(w, info->var.xres_virtual - x);
+	h = min(h, info->var.yres_virtual - y);
+	if (!w || !h)
+		return;
+
+	r.x = x;
+	r.y = y;
+	r.w = w;
+	r.h = h;
+
+	spin_lock_irqsave(&par->damage_lock, flags);
+	for (i = 0; i < par->dirty_cnt; i++) {
+		if (uvesafb_rect_touch(&par->dirty[i], &r)) {
+			uvesafb_rect_union(&par->dirty[i], &r);
+			goto out;
+		}
+	}
+
+	if (par->dirty_cnt < MARUFB_DAMAGE_RECTS) {
+		par->dirty[par->dirty_cnt++] = r;
+		goto out;
+	}
+
+	for (i = 0; i < par->dirty_cnt; i++) {
+		u = par->dirty[i];
+		uvesafb_rect_union(&u, &r);
+		cost = uvesafb_rect_area(&u) - uvesafb_rect_area(&par->dirty[i]);
+		if (cost < best_cost) {
+			best_cost = cost;
+			best = i;
+		}
+	}
+	uvesafb_rect_union(&par->dirty[best], &r);
+out:
+	spin_unlock_irqrestore(&par->damage_lock, flags);
+
+	schedule_delayed_work(&par->damage_work, UVESAFB_FRAME_JIFFIES);
+}
+
+static void uvesafb_damage_all(struct fb_info *info)
+{
+	uvesafb_damage_add(info, 0, 0, info->var.xres_virtual,
+			info->var.yres_virtual);
+}
+
+/* Hand the rectangles gathered during the last frame to the host. */
+static void uvesafb_damage_work(struct work_struct *work)
+{
+	struct uvesafb_par *par = container_of(to_delayed_work(work),
+					struct uvesafb_par, damage_work);
+	unsigned long flags;
+
+	spin_lock_irqsave(&par->damage_lock, flags);
+	if (par->dirty_cnt) {
+		memcpy(par->damage->rect, par->dirty,
+				par->dirty_cnt * sizeof(par->dirty[0]));
+		par->damage->count = par->dirty_cnt;
+		uvesafb_dispi_write(MARUFB_INDEX_DAMAGE_FLUSH, par->dirty_cnt);
+		par->dirty_cnt = 0;
+	}
+	spin_unlock_irqrestore(&par->damage_lock, flags);
+}
+
+/*
+ * The host may only skip its periodic rescan while every change to the
+ * framebuffer is reported: when nobody but the console draws, or when
+ * the only userspace client has started to report its own damage.
+ * fb_ops do not see the file, so as soon as a second client opens the
+ * device nobody is trusted to report, and damage_user is cleared on
+ * every close until the remaining client reports again.
+ *
+ * Called with info->lock held.
+ */
+static void uvesafb_damage_update(struct fb_info *info)
+{
+	struct uvesafb_par *par = info->par;
+	int users;
+	u8 on;
+
+	if (!par->damage)
+		return;
+
+	users = atomic_read(&par->user_count);
+	on = !users || (users == 1 && par->damage_user);
+	if (on == par->damage_on)
+		return;
+
+	par->damage_on = on;
+	uvesafb_dispi_write(MARUFB_INDEX_DAMAGE_CTRL, on);
+	if (on)
+		uvesafb_damage_all(info);
+}
+
+static void __devinit uvesafb_damage_init(struct fb_info *info)
+{
+	struct uvesafb_par *par = info->par;
+	unsigned long pfn;
+
+	spin_lock_init(&par->damage_lock);
+	INIT_DELAYED_WORK(&par->damage_work, uvesafb_damage_work);
+
+	if (!(par->features & MARUFB_FEATURE_DAMAGE))
+		return;
+
+	par->damage = (struct marufb_damage *)get_zeroed_page(GFP_KERNEL);
+	if (!par->damage)
+		return;
+
+	pfn = virt_to_phys(par->damage) >> PAGE_SHIFT;
+	uvesafb_dispi_write(MARUFB_INDEX_DAMAGE_PFN_LO, pfn & 0xffff);
+	uvesafb_dispi_write(MARUFB_INDEX_DAMAGE_PFN_HI, pfn >> 16);
+
+	uvesafb_damage_update(info);
+	printk(KERN_INFO "uvesafb: reporting damage to the host\n");
+}
+
+static void uvesafb_damage_exit(struct fb_info *info)
+{
+	struct uvesafb_par *par = info->par;
+
+	if (!par->damage)
+		return;
+
+	par->damage_on = 0;
+	cancel_delayed_work_sync(&par->damage_work);
+	uvesafb_dispi_write(MARUFB_INDEX_DAMAGE_CTRL, 0);
+	uvesafb_dispi_write(MARUFB_INDEX_DAMAGE_PFN_LO, 0);
+	uvesafb_dispi_write(MARUFB_INDEX_DAMAGE_PFN_HI, 0);
+	free_page((unsigned long)par->damage);
+	par->damage = NULL;
+}
+
+static irqreturn_t uvesafb_irq(int irq, void *dev_id)
+{
+	struct uvesafb_par *par = dev_id;
+	u16 status;
+
+	status = uvesafb_dispi_read(MARUFB_INDEX_IRQ_STATUS);
+	if (!(status & MARUFB_IRQ_VBLANK))
+		return IRQ_NONE;
+
+	spin_lock(&par->vsync_lock);
+	par->vblank_count++;
+
+	/* Nobody is waiting for the next one, stop the interrupts. */
+	if (!par->vsync_waiters) {
+		par->vblank_on = 0;
+		uvesafb_dispi_write(MARUFB_INDEX_IRQ_ENABLE, 0);
+	}
+	spin_unlock(&par->vsync_lock);
+
+	wake_up_interruptible(&par->vsync_wait);
+	return IRQ_HANDLED;
+}
+
+/*
+ * Sleep until the host starts its next refresh. The vblank interrupt is
+ * only enabled while somebody waits for it.
+ */
+static int uvesafb_wait_for_vsync(struct uvesafb_par *par)
+{
+	unsigned int count;
+	long ret;
+
+	if (!par->irq)
+		return -ENOTTY;
+
+	spin_lock_irq(&par->vsync_lock);
+	count = par->vblank_count;
+	par->vsync_waiters++;
+	if (!par->vblank_on) {
+		par->vblank_on = 1;
+		uvesafb_dispi_write(MARUFB_INDEX_IRQ_ENABLE, MARUFB_IRQ_VBLANK);
+	}
+	spin_unlock_irq(&par->vsync_lock);
+
+	ret = wait_event_interruptible_timeout(par->vsync_wait,
+			count != ACCESS_ONCE(par->vblank_count),
+			msecs_to_jiffies(UVESAFB_VSYNC_TIMEOUT));
+
+	spin_lock_irq(&par->vsync_lock);
+	par->vsync_waiters--;
+	spin_unlock_irq(&par->vsync_lock);
+
+	if (ret < 0)
+		return ret;
+	if (ret == 0)
+		return -ETIMEDOUT;
+	return 0;
+}
+
+static void __devinit uvesafb_vblank_init(struct uvesafb_par *par)
+{
+	int irq;
+
+	spin_lock_init(&par->vsync_lock);
+	init_waitqueue_head(&par->vsync_wait);
+	par->irq = 0;
+
+	if (!(par->features & MARUFB_FEATURE_VBLANK))
+		return;
+
+	irq = uvesafb_dispi_read(MARUFB_INDEX_IRQ);
+	if (!irq)
+		return;
+
+	uvesafb_dispi_write(MARUFB_INDEX_IRQ_ENABLE, 0);
+	uvesafb_dispi_read(MARUFB_INDEX_IRQ_STATUS);
+
+	if (request_irq(irq, uvesafb_irq, 0, "uvesafb", par)) {
+		printk(KERN_WARNING "uvesafb: cannot request irq %d, "
+				"vsync is not available\n", irq);
+		return;
+	}
+
+	par->irq = irq;
+	printk(KERN_INFO "uvesafb: vblank interrupt on irq %d\n", irq);
+}
+
+static void uvesafb_vblank_exit(struct uvesafb_par *par)
+{
+	if (!par->irq)
+		return;
+
+	uvesafb_dispi_write(MARUFB_INDEX_IRQ_ENABLE, 0);
+	free_irq(par->irq, par);
+	par->irq = 0;
+}
+
+/*
+ * Display power. While fb_blank(), the backlight or the LCD says the
+ * panel is dark, the host stops refreshing and no damage is gathered.
+ * Nothing is tracked in between, so turning it back on repaints
+ * everything.
+ */
+static DEFINE_SPINLOCK(uvesafb_power_lock);
+static unsigned int uvesafb_dark;	/* MARU_DISPLAY_* sources that are off */
+static struct fb_info *uvesafb_power_info;
+
+/* Called with uvesafb_power_lock held. */
+static void uvesafb_power_apply(struct fb_info *info)
+{
+	struct uvesafb_par *par = info->par;
+	unsigned long flags;
+	u8 dark = uvesafb_dark != 0;
+
+	if (dark == par->dark)
+		return;
+	par->dark = dark;
+
+	if (par->features & MARUFB_FEATURE_POWER)
+		uvesafb_dispi_write(MARUFB_INDEX_DISPLAY_POWER, !dark);
+
+	if (dark) {
+		spin_lock_irqsave(&par->damage_lock, flags);
+		par->dirty_cnt = 0;
+		spin_unlock_irqrestore(&par->damage_lock, flags);
+		cancel_delayed_work(&par->damage_work);
+	} else {
+		uvesafb_damage_all(info);
+	}
+}
+
+void marufb_set_display_power(unsigned int source, int on)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&uvesafb_power_lock, flags);
+	if (on)
+		uvesafb_dark &= ~source;
+	else
+		uvesafb_dark |= source;
+	if (uvesafb_power_info)
+		uvesafb_power_apply(uvesafb_power_info);
+	spin_unlock_irqrestore(&uvesafb_power_lock, flags);
+}
+EXPORT_SYMBOL(marufb_set_display_power);
+
+static void __devinit uvesafb_power_init(struct fb_info *info)
+{
+	struct uvesafb_par *par = info->par;
+	unsigned long flags;
+
+	if (par->features & MARUFB_FEATURE_POWER)
+		uvesafb_dispi_write(MARUFB_INDEX_DISPLAY_POWER, 1);
+
+	/* the backlight may have gone dark before we got here */
+	spin_lock_irqsave(&uvesafb_power_lock, flags);
+	uvesafb_power_info = info;
+	uvesafb_power_apply(info);
+	spin_unlock_irqrestore(&uvesafb_power_lock, flags);
+}
+
+static void uvesafb_power_exit(struct fb_info *info)
+{
+	struct uvesafb_par *par = info->par;
+	unsigned long flags;
+
+	spin_lock_irqsave(&uvesafb_power_lock, flags);
+	uvesafb_power_info = NULL;
+	spin_unlock_irqrestore(&uvesafb_power_lock, flags);
+
+	/* leave the host refreshing for whoever takes over the display */
+	if (par->features & MARUFB_FEATURE_POWER)
+		uvesafb_dispi_write(MARUFB_INDEX_DISPLAY_POWER, 1);
+	par->dark = 0;
+}
+
 static int my_atoi(const char *name)
 {
     int val = 0;
@@ -330,7 +749,9 @@ static void uvesafb_setup_var(struct fb_var_screeninfo *var,
 
 	/* panel physical width/height(mm) */
 	ps = strstr(saved_command_line, "dpi=");
-	if (ps != NULL) {
+	if (par->dpi >= DPI_MIN_VALUE && par->dpi <= DPI_MAX_VALUE) {
+		dpi = par->dpi;
+	} else if (ps != NULL) {
 		ps += 4;
 		strncpy(dpi_info, ps, 4);
 		dpi = my_atoi(dpi_info);
@@ -745,6 +1166,29 @@ static int __devinit uvesafb_vbe_getedid(struct uvesafb_ktask *task,
 	return err;
 }
 
+/* Add the modes in par->vbe_modes to the modelist. */
+static void __devinit uvesafb_vbe_addmodes(struct fb_info *info)
+{
+	struct uvesafb_par *par = info->par;
+	int i;
+
+	for (i = 0; i < par->vbe_modes_cnt; i++) {
+		struct fb_var_screeninfo var;
+		struct vbe_mode_ib *mode;
+		struct fb_videomode vmode;
+
+		mode = &par->vbe_modes[i];
+		memset(&var, 0, sizeof(var));
+
+		var.xres = mode->x_res;
+		var.yres = mode->y_res;
+
+		fb_get_mode(FB_VSYNCTIMINGS | FB_IGNOREMON, 60, &var, info);
+		fb_var_to_videomode(&vmode, &var);
+		fb_add_videomode(&vmode, &info->modelist);
+	}
+}
+
 static void __devinit uvesafb_vbe_getmonspecs(struct uvesafb_ktask *task,
 		struct fb_info *info)
 {
@@ -793,22 +1237,7 @@ static void __devinit uvesafb_vbe_getmonspecs(struct uvesafb_ktask *task,
 		printk(KERN_INFO "uvesafb: no monitor limits have been set, "
 				 "default refresh rate will be used\n");
 
-	/* Add VBE modes to the modelist. */
-	for (i = 0; i < par->vbe_modes_cnt; i++) {
-		struct fb_var_screeninfo var;
-		struct vbe_mode_ib *mode;
-		struct fb_videomode vmode;
-
-		mode = &par->vbe_modes[i];
-		memset(&var, 0, sizeof(var));
-
-		var.xres = mode->x_res;
-		var.yres = mode->y_res;
-
-		fb_get_mode(FB_VSYNCTIMINGS | FB_IGNOREMON, 60, &var, info);
-		fb_var_to_videomode(&vmode, &var);
-		fb_add_videomode(&vmode, &info->modelist);
-	}
+	uvesafb_vbe_addmodes(info);
 
 	/* Add valid VESA modes to our modelist. */
 	for (i = 0; i < VESA_MODEDB_SIZE; i++) {
@@ -900,6 +1329,125 @@ out:	uvesafb_free(task);
 	return err;
 }
 
+static void __devinit uvesafb_native_fill_mode(struct vbe_mode_ib *mib,
+		u16 xres, u16 yres, u8 bpp, u32 lfb)
+{
+	mib->mode_attr = VBE_MODE_MASK;
+	mib->x_res = xres;
+	mib->y_res = yres;
+	mib->bits_per_pixel = bpp;
+	mib->bytes_per_scan_line = xres * (bpp >> 3);
+	mib->memory_model = 6;		/* direct color */
+	mib->planes = 1;
+	mib->phys_base_ptr = lfb;
+	mib->depth = bpp;
+
+	if (bpp == 32) {
+		mib->red_off   = 16;
+		mib->red_len   = 8;
+		mib->green_off = 8;
+		mib->green_len = 8;
+		mib->blue_off  = 0;
+		mib->blue_len  = 8;
+		mib->rsvd_off  = 24;
+		mib->rsvd_len  = 8;
+	} else {
+		mib->red_off   = 11;
+		mib->red_len   = 5;
+		mib->green_off = 5;
+		mib->green_len = 6;
+		mib->blue_off  = 0;
+		mib->blue_len  = 5;
+	}
+}
+
+/*
+ * Paravirtual replacement for uvesafb_vbe_init(). The mode list, the
+ * panel dpi and the amount of video memory are read from DISPI
+ * registers, so the framebuffer comes up without the v86d helper.
+ */
+static int __devinit uvesafb_native_init(struct fb_info *info)
+{
+	static const u8 depths[] = { 32, 16 };
+	struct uvesafb_par *par = info->par;
+	struct vbe_mode_ib *mib;
+	struct pci_dev *pdev;
+	u32 lfb, vram;
+	u16 xres, yres;
+	int i, j, cnt, n = 0;
+
+	pdev = pci_get_class(PCI_CLASS_DISPLAY_VGA << 8, NULL);
+	if (!pdev)
+		return -ENODEV;
+
+	lfb = pci_resource_start(pdev, 0);
+	vram = pci_resource_len(pdev, 0);
+	pci_dev_put(pdev);
+
+	i = uvesafb_dispi_read(VBE_DISPI_INDEX_VIDEO_MEMORY_64K);
+	if (i)
+		vram = min_t(u32, vram, (u32)i << 16);
+
+	cnt = uvesafb_dispi_read(MARUFB_INDEX_MODE_COUNT);
+	if (!lfb || !cnt)
+		return -ENODEV;
+
+	par->vbe_modes = kzalloc(sizeof(struct vbe_mode_ib) *
+				cnt * ARRAY_SIZE(depths), GFP_KERNEL);
+	if (!par->vbe_modes)
+		return -ENOMEM;
+
+	for (i = 0; i < cnt; i++) {
+		uvesafb_dispi_write(MARUFB_INDEX_MODE_SELECT, i);
+		xres = uvesafb_dispi_read(MARUFB_INDEX_MODE_XRES);
+		yres = uvesafb_dispi_read(MARUFB_INDEX_MODE_YRES);
+
+		for (j = 0; j < ARRAY_SIZE(depths); j++) {
+			mib = &par->vbe_modes[n];
+			uvesafb_native_fill_mode(mib, xres, yres, depths[j],
+					lfb);
+			if (!xres || !yres ||
+			    (u32)mib->bytes_per_scan_line * yres > vram)
+				continue;
+			mib->mode_id = 0x100 + n;
+			n++;
+		}
+	}
+
+	par->vbe_modes_cnt = n;
+	if (!n)
+		return -EINVAL;
+
+	par->vbe_ib.vbe_version = 0x0200;
+	par->vbe_ib.total_memory = vram / 65536;
+	par->dpi = uvesafb_dispi_read(MARUFB_INDEX_DPI);
+	par->nocrtc = 1;
+	par->pmi_setpal = 0;
+	par->ypan = 0;
+	par->native = 1;
+
+	INIT_LIST_HEAD(&info->modelist);
+	uvesafb_vbe_addmodes(info);
+
+	printk(KERN_INFO "uvesafb: paravirtual mode setting, %d modes, "
+			"%uk video memory\n", n, vram / 1024);
+	return 0;
+}
+
+static void uvesafb_native_set_mode(struct vbe_mode_ib *mode)
+{
+	uvesafb_dispi_write(VBE_DISPI_INDEX_ENABLE, VBE_DISPI_DISABLED);
+	uvesafb_dispi_write(VBE_DISPI_INDEX_BPP, mode->bits_per_pixel);
+	uvesafb_dispi_write(VBE_DISPI_INDEX_XRES, mode->x_res);
+	uvesafb_dispi_write(VBE_DISPI_INDEX_YRES, mode->y_res);
+	uvesafb_dispi_write(VBE_DISPI_INDEX_BANK, 0);
+	uvesafb_dispi_write(VBE_DISPI_INDEX_VIRT_WIDTH, mode->x_res);
+	uvesafb_dispi_write(VBE_DISPI_INDEX_X_OFFSET, 0);
+	uvesafb_dispi_write(VBE_DISPI_INDEX_Y_OFFSET, 0);
+	uvesafb_dispi_write(VBE_DISPI_INDEX_ENABLE, VBE_DISPI_ENABLED |
+			VBE_DISPI_LFB_ENABLED | VBE_DISPI_NOCLEARMEM);
+}
+
 static int __devinit uvesafb_vbe_init_mode(struct fb_info *info)
 {
 	struct list_head *pos;
@@ -908,6 +1456,10 @@ static int __devinit uvesafb_vbe_init_mode(struct fb_info *info)
 	struct uvesafb_par *par = info->par;
 	int i, modeid;
 
+	/* Without a mode option, start in the host's preferred mode. */
+	if (par->native && !vbemode && !mode_option)
+		vbemode = par->vbe_modes[0].mode_id;
+
 	/* Has the user requested a specific VESA mode? */
 	if (vbemode) {
 		for (i = 0; i < par->vbe_modes_cnt; i++) {
@@ -1155,10 +1707,22 @@ static int uvesafb_setcmap(struct fb_cmap *cmap, struct fb_info *info)
 static int uvesafb_pan_display(struct fb_var_screeninfo *var,
 		struct fb_info *info)
 {
+	struct uvesafb_par *par = info->par;
 #ifdef CONFIG_X86_32
 	int offset;
-	struct uvesafb_par *par = info->par;
+#endif
 
+	/*
+	 * The DISPI display start takes effect at the next host refresh,
+	 * so flipping between two buffers in smem never tears.
+	 */
+	if (par->dispi) {
+		uvesafb_dispi_write(VBE_DISPI_INDEX_X_OFFSET, var->xoffset);
+		uvesafb_dispi_write(VBE_DISPI_INDEX_Y_OFFSET, var->yoffset);
+		return 0;
+	}
+
+#ifdef CONFIG_X86_32
 	offset = (var->yoffset * info->fix.line_length + var->xoffset) / 4;
 
 	/*
@@ -1185,7 +1749,14 @@ static int uvesafb_blank(int blank, struct fb_info *info)
 	int err = 1;
 #ifdef CONFIG_X86
 	struct uvesafb_par *par = info->par;
+#endif
 
+	if (blank == FB_BLANK_UNBLANK || blank == FB_BLANK_NORMAL ||
+	    blank == FB_BLANK_POWERDOWN)
+		marufb_set_display_power(MARU_DISPLAY_FB,
+				blank == FB_BLANK_UNBLANK);
+
+#ifdef CONFIG_X86
 	if (par->vbe_ib.capabilities & VBE_CAP_VGACOMPAT) {
 		int loop = 10000;
 		u8 seq = 0, crtc17 = 0;
@@ -1222,21 +1793,24 @@ static int uvesafb_blank(int blank, struct fb_info *info)
 			task->t.regs.ebx = 0x0001;
 			break;
 #else
-			return 0;
+			err = 0;
+			goto out;
 #endif
 		case FB_BLANK_NORMAL:
 #if 0 // do nothing in emulator
 			task->t.regs.ebx = 0x0101;	/* standby */
 			break;
 #else
-			return 0;
+			err = 0;
+			goto out;
 #endif
 		case FB_BLANK_POWERDOWN:
 #if 0 // do nothing in emulator
 			task->t.regs.ebx = 0x0401;	/* powerdown */
 			break;
 #else
-			return 0;
+			err = 0;
+			goto out;
 #endif
 		default:
 			goto out;
@@ -1267,6 +1841,10 @@ static int uvesafb_open(struct fb_info *info, int user)
 	}
 
 	atomic_inc(&par->ref_count);
+	if (user) {
+		atomic_inc(&par->user_count);
+		uvesafb_damage_update(info);
+	}
 	return 0;
 }
 
@@ -1279,7 +1857,13 @@ static int uvesafb_release(struct fb_info *info, int user)
 	if (!cnt)
 		return -EINVAL;
 
-	if (cnt != 1)
+	if (user) {
+		atomic_dec(&par->user_count);
+		par->damage_user = 0;
+		uvesafb_damage_update(info);
+	}
+
+	if (cnt != 1 || par->native)
 		goto out;
 
 	task = uvesafb_prep();
@@ -1321,6 +1905,12 @@ static int uvesafb_set_par(struct fb_info *info)
 	else
 		return -EINVAL;
 
+	if (par->native) {
+		uvesafb_native_set_mode(mode);
+		par->mode_idx = i;
+		goto done;
+	}
+
 	task = uvesafb_prep();
 	if (!task)
 		return -ENOMEM;
@@ -1405,9 +1995,11 @@ setmode:
 		}
 	}
 
+done:
 	info->fix.visual = (info->var.bits_per_pixel == 8) ?
 				FB_VISUAL_PSEUDOCOLOR : FB_VISUAL_TRUECOLOR;
 	info->fix.line_length = mode->bytes_per_scan_line;
+	uvesafb_damage_all(info);
 
 out:	if (crtc != NULL)
 		kfree(crtc);
@@ -1502,6 +2094,91 @@ static int uvesafb_check_var(struct fb_var_screeninfo *var,
 	return 0;
 }
 
+static void uvesafb_fillrect(struct fb_info *info,
+		const struct fb_fillrect *rect)
+{
+	cfb_fillrect(info, rect);
+	uvesafb_damage_add(info, rect->dx, rect->dy, rect->width,
+			rect->height);
+}
+
+static void uvesafb_copyarea(struct fb_info *info,
+		const struct fb_copyarea *area)
+{
+	cfb_copyarea(info, area);
+	uvesafb_damage_add(info, area->dx, area->dy, area->width,
+			area->height);
+}
+
+static void uvesafb_imageblit(struct fb_info *info,
+		const struct fb_image *image)
+{
+	cfb_imageblit(info, image);
+	uvesafb_damage_add(info, image->dx, image->dy, image->width,
+			image->height);
+}
+
+static int uvesafb_ioctl_damage(struct fb_info *info, void __user *argp)
+{
+	struct uvesafb_par *par = info->par;
+	struct marufb_damage_req req;
+	struct marufb_rect __user *urect;
+	struct marufb_rect r;
+	int i;
+
+	if (!par->damage)
+		return -ENODEV;
+
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
+
+	if (req.count > MARUFB_DAMAGE_REQ_MAX)
+		return -EINVAL;
+
+	/*
+	 * The first report switches the host over to repainting on
+	 * flush only; everything drawn before it is covered by a full
+	 * frame of damage.
+	 */
+	if (!par->damage_user) {
+		par->damage_user = 1;
+		uvesafb_damage_update(info);
+	}
+
+	if (!req.count) {
+		uvesafb_damage_all(info);
+		return 0;
+	}
+
+	urect = (struct marufb_rect __user *)(unsigned long)req.rects;
+	for (i = 0; i < req.count; i++) {
+		if (copy_from_user(&r, urect + i, sizeof(r)))
+			return -EFAULT;
+		uvesafb_damage_add(info, r.x, r.y, r.w, r.h);
+	}
+
+	return 0;
+}
+
+static int uvesafb_ioctl(struct fb_info *info, unsigned int cmd,
+		unsigned long arg)
+{
+	u32 crtc;
+
+	switch (cmd) {
+	case FBIO_WAITFORVSYNC:
+		if (get_user(crtc, (u32 __user *)arg))
+			return -EFAULT;
+		if (crtc != 0)
+			return -ENODEV;
+		return uvesafb_wait_for_vsync(info->par);
+	case MARUFB_IOCTL_DAMAGE:
+		return uvesafb_ioctl_damage(info, (void __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
 static struct fb_ops uvesafb_ops = {
 	.owner		= THIS_MODULE,
 	.fb_open	= uvesafb_open,
@@ -1510,11 +2187,12 @@ static struct fb_ops uvesafb_ops = {
 	.fb_setcmap	= uvesafb_setcmap,
 	.fb_pan_display	= uvesafb_pan_display,
 	.fb_blank	= uvesafb_blank,
-	.fb_fillrect	= cfb_fillrect,
-	.fb_copyarea	= cfb_copyarea,
-	.fb_imageblit	= cfb_imageblit,
+	.fb_fillrect	= uvesafb_fillrect,
+	.fb_copyarea	= uvesafb_copyarea,
+	.fb_imageblit	= uvesafb_imageblit,
 	.fb_check_var	= uvesafb_check_var,
 	.fb_set_par	= uvesafb_set_par,
+	.fb_ioctl	= uvesafb_ioctl,
 };
 
 static void __devinit uvesafb_init_info(struct fb_info *info,
@@ -1527,6 +2205,11 @@ static void __devinit uvesafb_init_info(struct fb_info *info,
 	int i, h;
 
 	info->pseudo_palette = ((u8 *)info->par + sizeof(struct uvesafb_par));
+
+	/* The DISPI display start registers pan without the PMI. */
+	if (par->dispi && ypan)
+		par->ypan = 1;
+
 	info->fix = uvesafb_fix;
 	info->fix.ypanstep = par->ypan ? 1 : 0;
 	info->fix.ywrapstep = (par->ypan > 1) ? 1 : 0;
@@ -1596,9 +2279,10 @@ static void __devinit uvesafb_init_info(struct fb_info *info,
 
 	if (par->ypan && info->var.yres_virtual > info->var.yres) {
 		printk(KERN_INFO "uvesafb: scrolling: %s "
-			"using protected mode interface, "
-			"yres_virtual=%d\n",
+			"using %s, yres_virtual=%d\n",
 			(par->ypan > 1) ? "ywrap" : "ypan",
+			par->dispi ? "DISPI display start" :
+				"protected mode interface",
 			info->var.yres_virtual);
 	} else {
 		printk(KERN_INFO "uvesafb: scrolling: redraw\n");
@@ -1824,10 +2508,25 @@ static int __devinit uvesafb_probe(struct platform_device *dev)
 
 	par = info->par;
 
-	err = uvesafb_vbe_init(info);
-	if (err) {
-		printk(KERN_ERR "uvesafb: vbe_init() failed with %d\n", err);
-		goto out;
+	uvesafb_dispi_init(par);
+	if (par->features & MARUFB_FEATURE_MODESET) {
+		err = uvesafb_native_init(info);
+		if (err) {
+			printk(KERN_WARNING "uvesafb: paravirtual mode "
+				"setting failed with %d, using VBE\n", err);
+			kfree(par->vbe_modes);
+			par->vbe_modes = NULL;
+			par->vbe_modes_cnt = 0;
+		}
+	}
+
+	if (!par->native) {
+		err = uvesafb_vbe_init(info);
+		if (err) {
+			printk(KERN_ERR "uvesafb: vbe_init() failed with %d\n",
+				err);
+			goto out;
+		}
 	}
 
 	info->fbops = &uvesafb_ops;
@@ -1875,6 +2574,10 @@ static int __devinit uvesafb_probe(struct platform_device *dev)
 
 	platform_set_drvdata(dev, info);
 
+	uvesafb_damage_init(info);
+	uvesafb_vblank_init(par);
+	uvesafb_power_init(info);
+
 	if (register_framebuffer(info) < 0) {
 		printk(KERN_ERR
 			"uvesafb: failed to register framebuffer device\n");
@@ -1897,6 +2600,9 @@ static int __devinit uvesafb_probe(struct platform_device *dev)
 	return 0;
 
 out_unmap:
+	uvesafb_power_exit(info);
+	uvesafb_vblank_exit(par);
+	uvesafb_damage_exit(info);
 	iounmap(info->screen_base);
 out_mem:
 	release_mem_region(info->fix.smem_start, info->fix.smem_len);
@@ -1908,6 +2614,7 @@ out_mode:
 	fb_destroy_modedb(info->monspecs.modedb);
 	fb_dealloc_cmap(&info->cmap);
 out:
+	uvesafb_dispi_exit(par);
 	if (par->vbe_modes)
 		kfree(par->vbe_modes);
 
@@ -1924,6 +2631,10 @@ static int uvesafb_remove(struct platform_device *dev)
 
 		sysfs_remove_group(&dev->dev.kobj, &uvesafb_dev_attgrp);
 		unregister_framebuffer(info);
+		uvesafb_power_exit(info);
+		uvesafb_vblank_exit(par);
+		uvesafb_damage_exit(info);
+		uvesafb_dispi_exit(par);
 		release_region(0x3c0, 32);
 		iounmap(info->screen_base);
 		release_mem_region(info->fix.smem_start, info->fix.smem_len);
@@ -2023,17 +2734,10 @@ static ssize_t store_v86d(struct device_driver *dev, const char *buf,
 
 static DRIVER_ATTR(v86d, S_IRUGO | S_IWUSR, show_v86d, store_v86d);
 
-static int __devinit uvesafb_init(void)
+static int uvesafb_register(void)
 {
 	int err;
 
-#ifndef MODULE
-	char *option = NULL;
-
-	if (fb_get_options("uvesafb", &option))
-		return -ENODEV;
-	uvesafb_setup(option);
-#endif
 	err = cn_add_callback(&uvesafb_cn_id, "uvesafb", uvesafb_cn_callback);
 	if (err)
 		return err;
@@ -2065,9 +2769,7 @@ static int __devinit uvesafb_init(void)
 	return err;
 }
 
-module_init(uvesafb_init);
-
-static void __devexit uvesafb_exit(void)
+static void uvesafb_unregister(void)
 {
 	struct uvesafb_ktask *task;
 
@@ -2086,6 +2788,32 @@ static void __devexit uvesafb_exit(void)
 	platform_driver_unregister(&uvesafb_driver);
 }
 
+static struct maru_async_driver uvesafb_async = {
+	.name = "uvesafb",
+	.reg = uvesafb_register,
+	.unreg = uvesafb_unregister,
+};
+
+static int __devinit uvesafb_init(void)
+{
+#ifndef MODULE
+	char *option = NULL;
+
+	if (fb_get_options("uvesafb", &option))
+		return -ENODEV;
+	uvesafb_setup(option);
+#endif
+	maru_async_register(&uvesafb_async);
+	return 0;
+}
+
+module_init(uvesafb_init);
+
+static void __devexit uvesafb_exit(void)
+{
+	maru_async_unregister(&uvesafb_async);
+}
+
 module_exit(uvesafb_exit);
 
 static int param_set_scroll(const char *val, const struct kernel_param *kp)
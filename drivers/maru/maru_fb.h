@@ -32,6 +32,7 @@
 #define _UVESAFB_H
 
 #include <linux/types.h>
+#include <linux/marufb.h>
 
 struct v86_regs {
 	__u32 ebx;
@@ -89,6 +90,73 @@ struct vbe_ib {
 
 #ifdef __KERNEL__
 
+/* Bochs VBE (DISPI) interface of the emulated VGA */
+#define VBE_DISPI_IOPORT_INDEX		0x01ce
+#define VBE_DISPI_IOPORT_DATA		0x01cf
+
+#define VBE_DISPI_INDEX_ID		0x0
+#define VBE_DISPI_INDEX_XRES		0x1
+#define VBE_DISPI_INDEX_YRES		0x2
+#define VBE_DISPI_INDEX_BPP		0x3
+#define VBE_DISPI_INDEX_ENABLE		0x4
+#define VBE_DISPI_INDEX_BANK		0x5
+#define VBE_DISPI_INDEX_VIRT_WIDTH	0x6
+#define VBE_DISPI_INDEX_VIRT_HEIGHT	0x7
+#define VBE_DISPI_INDEX_X_OFFSET	0x8
+#define VBE_DISPI_INDEX_Y_OFFSET	0x9
+#define VBE_DISPI_INDEX_VIDEO_MEMORY_64K 0xa
+
+#define VBE_DISPI_DISABLED		0x00
+#define VBE_DISPI_ENABLED		0x01
+#define VBE_DISPI_LFB_ENABLED		0x40
+#define VBE_DISPI_NOCLEARMEM		0x80
+
+#define VBE_DISPI_ID_MASK		0xfff0
+#define VBE_DISPI_ID0			0xb0c0
+
+/*
+ * Maru extensions of the DISPI index space. Hosts without them read
+ * back 0 from MARUFB_INDEX_FEATURES.
+ */
+#define MARUFB_INDEX_FEATURES		0x10
+#define MARUFB_INDEX_DAMAGE_CTRL	0x11	/* 1: repaint on flush only */
+#define MARUFB_INDEX_DAMAGE_PFN_LO	0x12
+#define MARUFB_INDEX_DAMAGE_PFN_HI	0x13
+#define MARUFB_INDEX_DAMAGE_FLUSH	0x14	/* write: number of rects */
+#define MARUFB_INDEX_IRQ		0x15	/* read: ISA irq line */
+#define MARUFB_INDEX_IRQ_ENABLE		0x16
+#define MARUFB_INDEX_IRQ_STATUS		0x17	/* read clears */
+#define MARUFB_INDEX_MODE_COUNT		0x18	/* preferred mode first */
+#define MARUFB_INDEX_MODE_SELECT	0x19
+#define MARUFB_INDEX_MODE_XRES		0x1a	/* of the selected mode */
+#define MARUFB_INDEX_MODE_YRES		0x1b
+#define MARUFB_INDEX_DPI		0x1c	/* panel dpi * 10 */
+#define MARUFB_INDEX_DISPLAY_POWER	0x1d	/* 0: stop refreshing */
+
+#define MARUFB_FEATURE_DAMAGE		0x0001
+#define MARUFB_FEATURE_VBLANK		0x0002
+#define MARUFB_FEATURE_MODESET		0x0004
+#define MARUFB_FEATURE_POWER		0x0008
+
+/*
+ * Interrupt sources. The X/Y offset registers are latched at the start
+ * of the next host refresh, which is signalled by MARUFB_IRQ_VBLANK.
+ */
+#define MARUFB_IRQ_VBLANK		0x0001
+
+/* How long FBIO_WAITFORVSYNC waits for the host [ms] */
+#define UVESAFB_VSYNC_TIMEOUT		100
+
+/* Rectangles kept per frame before neighbours get merged */
+#define MARUFB_DAMAGE_RECTS		16
+
+/* Shared with the host, read when MARUFB_INDEX_DAMAGE_FLUSH is written */
+struct marufb_damage {
+	u32 count;
+	u32 reserved;
+	struct marufb_rect rect[MARUFB_DAMAGE_RECTS];
+};
+
 /* VBE CRTC Info Block */
 struct vbe_crtc_ib {
 	u16 horiz_total;
@@ -219,6 +287,30 @@ struct uvesafb_par {
 
 	int mode_idx;
 	struct vbe_crtc_ib crtc;
+
+	u8 dispi;			/* DISPI ports reserved */
+	u8 native;			/* modes set through DISPI, not v86d */
+	u16 features;			/* MARUFB_FEATURE_* offered by host */
+	u16 dpi;			/* panel dpi * 10 reported by host */
+	atomic_t user_count;		/* userspace opens */
+
+	/* damage reporting */
+	struct marufb_damage *damage;	/* page shared with the host */
+	spinlock_t damage_lock;
+	struct marufb_rect dirty[MARUFB_DAMAGE_RECTS];
+	int dirty_cnt;
+	struct delayed_work damage_work;
+	u8 damage_on;			/* host repaints on flush only */
+	u8 damage_user;			/* the only client reports damage */
+	u8 dark;			/* display off, see maru_display.h */
+
+	/* vertical blank */
+	int irq;
+	spinlock_t vsync_lock;
+	wait_queue_head_t vsync_wait;
+	unsigned int vblank_count;
+	int vsync_waiters;
+	u8 vblank_on;			/* MARUFB_IRQ_VBLANK enabled */
 };
 
 #endif /* __KERNEL__ */
@@ -27,7 +27,9 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/device.h>
+#include <linux/mutex.h>
 #include <linux/platform_device.h>
+#include <linux/power_supply.h>
 #include <linux/slab.h>
 
 int charger_online = 0;
@@ -41,6 +43,94 @@ struct my_data {
 	char test[50];
 };
 
+/*
+ * The chargers are also registered with the power_supply class, so a
+ * change reaches the battery (and anyone sleeping on its uevents)
+ * through external_power_changed.
+ */
+static char *maru_supplied_to[] = {
+	"battery",
+};
+
+static enum power_supply_property maru_online_props[] = {
+	POWER_SUPPLY_PROP_ONLINE,
+};
+
+static int maru_ac_get_property(struct power_supply *psy,
+		enum power_supply_property psp, union power_supply_propval *val)
+{
+	if (psp != POWER_SUPPLY_PROP_ONLINE)
+		return -EINVAL;
+	val->intval = charger_online;
+	return 0;
+}
+
+static int maru_usb_get_property(struct power_supply *psy,
+		enum power_supply_property psp, union power_supply_propval *val)
+{
+	if (psp != POWER_SUPPLY_PROP_ONLINE)
+		return -EINVAL;
+	val->intval = usb_online;
+	return 0;
+}
+
+static struct power_supply maru_ac = {
+	.name = "ac",
+	.type = POWER_SUPPLY_TYPE_MAINS,
+	.supplied_to = maru_supplied_to,
+	.num_supplicants = ARRAY_SIZE(maru_supplied_to),
+	.properties = maru_online_props,
+	.num_properties = ARRAY_SIZE(maru_online_props),
+	.get_property = maru_ac_get_property,
+};
+
+static struct power_supply maru_usb = {
+	.name = "usb",
+	.type = POWER_SUPPLY_TYPE_USB,
+	.supplied_to = maru_supplied_to,
+	.num_supplicants = ARRAY_SIZE(maru_supplied_to),
+	.properties = maru_online_props,
+	.num_properties = ARRAY_SIZE(maru_online_props),
+	.get_property = maru_usb_get_property,
+};
+
+/* protects the jack state ints and the uevent announcing them */
+static DEFINE_MUTEX(jack_lock);
+
+/*
+ * Parse a new jack state and, if it changed, wake up whoever waits on
+ * the attribute with poll() and send a switch style uevent
+ * (SWITCH_NAME/SWITCH_STATE), so nobody has to poll these files.
+ * psy, if any, is the power supply that follows this state.
+ */
+static ssize_t jack_update(struct device *dev, struct device_attribute *attr,
+		const char *buf, int *state, struct power_supply *psy)
+{
+	char name_env[32], state_env[24];
+	char *envp[] = { name_env, state_env, NULL };
+	int changed = 0;
+	int val;
+
+	if (sscanf(buf, "%d", &val) != 1)
+		return -EINVAL;
+
+	mutex_lock(&jack_lock);
+	if (val != *state) {
+		*state = val;
+		changed = 1;
+		sysfs_notify(&dev->kobj, NULL, attr->attr.name);
+		snprintf(name_env, sizeof(name_env), "SWITCH_NAME=%s", attr->attr.name);
+		snprintf(state_env, sizeof(state_env), "SWITCH_STATE=%d", val);
+		kobject_uevent_env(&dev->kobj, KOBJ_CHANGE, envp);
+	}
+	mutex_unlock(&jack_lock);
+
+	if (changed && psy)
+		power_supply_changed(psy);
+
+	return strnlen(buf, PAGE_SIZE);
+}
+
 static ssize_t show_charger_online(struct device *dev, 
 		struct device_attribute *attr, char *buf) 
 {
@@ -52,8 +142,7 @@ static ssize_t store_charger_online(struct device *dev,
 		struct device_attribute *attr, const char *buf, size_t count) 
 {
 	printk("[%s] \n", __FUNCTION__);
-	sscanf(buf, "%d", &charger_online);
-	return strnlen(buf, PAGE_SIZE);
+	return jack_update(dev, attr, buf, &charger_online, &maru_ac);
 }
 
 static ssize_t show_earjack_online(struct device *dev, 
@@ -67,8 +156,7 @@ static ssize_t store_earjack_online(struct device *dev,
 		struct device_attribute *attr, const char *buf, size_t count) 
 {
 	printk("[%s] \n", __FUNCTION__);
-	sscanf(buf, "%d", &earjack_online);
-	return strnlen(buf, PAGE_SIZE);
+	return jack_update(dev, attr, buf, &earjack_online, NULL);
 }
 
 static ssize_t show_earkey_online(struct device *dev, 
@@ -82,8 +170,7 @@ static ssize_t store_earkey_online(struct device *dev,
 		struct device_attribute *attr, const char *buf, size_t count) 
 {
 	printk("[%s] \n", __FUNCTION__);
-	sscanf(buf, "%d", &earkey_online);
-	return strnlen(buf, PAGE_SIZE);
+	return jack_update(dev, attr, buf, &earkey_online, NULL);
 }
 
 static ssize_t show_hdmi_online(struct device *dev, 
@@ -97,8 +184,7 @@ static ssize_t store_hdmi_online(struct device *dev,
 		struct device_attribute *attr, const char *buf, size_t count) 
 {
 	printk("[%s] \n", __FUNCTION__);
-	sscanf(buf, "%d", &hdmi_online);
-	return strnlen(buf, PAGE_SIZE);
+	return jack_update(dev, attr, buf, &hdmi_online, NULL);
 }
 
 static ssize_t show_usb_online(struct device *dev, 
@@ -112,8 +198,7 @@ static ssize_t store_usb_online(struct device *dev,
 		struct device_attribute *attr, const char *buf, size_t count) 
 {
 	printk("[%s] \n", __FUNCTION__);
-	sscanf(buf, "%d", &usb_online);
-	return strnlen(buf, PAGE_SIZE);
+	return jack_update(dev, attr, buf, &usb_online, &maru_usb);
 }
 static DEVICE_ATTR(charger_online, S_IRUGO | S_IWUSR, show_charger_online, store_charger_online);
 static DEVICE_ATTR(earjack_online, S_IRUGO | S_IWUSR, show_earjack_online, store_earjack_online);
@@ -209,8 +294,24 @@ static int __init sysfs_test_init(void)
 		goto sysfs_err;
 	}
 
+	err = power_supply_register(&the_pdev.dev, &maru_ac);
+	if (err) {
+		printk("power_supply_register error\n");
+		goto ac_err;
+	}
+
+	err = power_supply_register(&the_pdev.dev, &maru_usb);
+	if (err) {
+		printk("power_supply_register error\n");
+		goto usb_err;
+	}
+
 	return 0;
 
+usb_err:
+	power_supply_unregister(&maru_ac);
+ac_err:
+	sysfs_test_remove_file(&the_pdev.dev);
 sysfs_err:
 	kfree(data);
 
@@ -225,6 +326,8 @@ static void __exit sysfs_test_exit(void)
 
 	printk("[%s] \n", __FUNCTION__);
 
+	power_supply_unregister(&maru_usb);
+	power_supply_unregister(&maru_ac);
 	kfree(data);
 	sysfs_test_remove_file(&the_pdev.dev);
 	platform_device_unregister(&the_pdev);
@@ -33,9 +33,12 @@
 #include <linux/notifier.h>
 #include <linux/ctype.h>
 #include <linux/err.h>
+#include <linux/fb.h>
 
 #include <asm/uaccess.h>
 
+#include "maru_display.h"
+
 static struct class *emul_lcd_class;
 static struct device *emul_lcd_dev;
 static int lcd_power = 0;
@@ -47,7 +50,23 @@ static ssize_t lcd_power_show(struct device *dev,
 	return sprintf(buf, "%d\n", lcd_power);
 }
 
-static DEVICE_ATTR(lcd_power, 0664, lcd_power_show, NULL);
+/* FB_BLANK_* like the lcd class, anything but FB_BLANK_UNBLANK is off */
+static ssize_t lcd_power_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	int power;
+
+	if (sscanf(buf, "%d", &power) != 1)
+		return -EINVAL;
+
+	pr_debug("lcd_power = %d\n", power);
+	lcd_power = power;
+	marufb_set_display_power(MARU_DISPLAY_LCD, power == FB_BLANK_UNBLANK);
+
+	return count;
+}
+
+static DEVICE_ATTR(lcd_power, 0664, lcd_power_show, lcd_power_store);
 static struct device_attribute *emul_lcd_device_attrib[] = {
 	&dev_attr_lcd_power,
 };
@@ -29,8 +29,16 @@
 #include <linux/init.h>
 #include <linux/pci.h>
 #include <linux/module.h>
+#include <linux/interrupt.h>
+#include <linux/wait.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
 #include <media/v4l2-common.h>
 #include <media/v4l2-ioctl.h>
+#include <media/videobuf2-core.h>
+#include <media/videobuf2-memops.h>
+
+#include "maru_async.h"
 
 #define SVO_DRIVER_MAJORVERSION	0
 #define SVO_DRIVER_MINORVERSION	2
@@ -39,6 +47,45 @@ enum {
 	OVERLAY_POWER    = 0x00,
 	OVERLAY_POSITION = 0x04,	/* left & top */
 	OVERLAY_SIZE     = 0x08,	/* width & height */
+	OVERLAY_OFFSET   = 0x0C,	/* front buffer in the window memory */
+	OVERLAY_COMMIT   = 0x10,	/* w: sequence to latch, r: latched */
+	OVERLAY_ISR      = 0x14,	/* read clears */
+	OVERLAY_FEATURES = 0x18,	/* r: offered, w: acknowledged */
+};
+
+/*
+ * With OVERLAY_FEATURE_COMMIT acknowledged, POWER, POSITION, SIZE and
+ * OFFSET are shadow registers. Writing a sequence number to
+ * OVERLAY_COMMIT latches all of them at the next host refresh, after
+ * which the host raises OVERLAY_ISR_COMMIT.
+ */
+#define OVERLAY_FEATURE_COMMIT	0x1
+#define OVERLAY_ISR_COMMIT	0x1
+
+/* How long SVO_IOC_COMMIT waits for the host [ms] */
+#define SVO_COMMIT_TIMEOUT	100
+
+struct svo_commit {
+	__u32 offset;	/* front buffer, from the start of the window memory */
+	__u32 flags;
+};
+
+#define SVO_COMMIT_WAIT		0x1	/* return once the host latched it */
+
+#define SVO_IOC_COMMIT	_IOW('V', BASE_VIDIOC_PRIVATE, struct svo_commit)
+
+/*
+ * Output streaming: buffers are slots of the window memory. A buffer
+ * is committed as the front buffer in queue order and given back once
+ * the host has latched the next one, i.e. no longer reads it.
+ */
+#define SVO_MIN_BUFFERS		2
+#define SVO_DFL_BUFFERS		3
+#define SVO_MAX_BUFFERS		BITS_PER_LONG
+
+struct svo_buffer {
+	struct vb2_buffer	vb;
+	struct list_head	list;
 };
 
 DEFINE_PCI_DEVICE_TABLE(svo_pci_tbl) = {
@@ -70,6 +117,34 @@ struct svo {
 
 	/* overlaid rect */
 	struct v4l2_rect	w0, w1;
+
+	/* OVERLAY_FEATURE_* in use */
+	unsigned int		features;
+
+	/*
+	 * Protects the window registers, w0/w1 and the commit sequence
+	 * numbers. A commit latches whatever the shadow registers hold, so
+	 * they must not be half written when any CPU issues one.
+	 */
+	spinlock_t		lock;
+
+	struct svo_plane {
+		int			num;
+		unsigned int		commit_seq;	/* last issued */
+		unsigned int		done_seq;	/* last latched */
+		wait_queue_head_t	commit_wq;
+
+		/* output streaming, protected by svo.lock */
+		struct mutex		vb_lock;	/* serializes ioctls */
+		struct vb2_queue	vb_q;
+		struct v4l2_pix_format	pix;
+		unsigned long		slots;		/* used by buffers */
+		int			streaming;
+		struct list_head	queued;		/* not committed yet */
+		struct svo_buffer	*pending;	/* committed */
+		unsigned int		pending_seq;
+		struct svo_buffer	*active;	/* latched, on screen */
+	} plane[2];
 };
 
 /*
@@ -80,15 +155,277 @@ static struct svo svo;
 /*
  * virtual register access helper
  */
+
+/*
+ * Latch the shadow registers of a window at the next host refresh.
+ * Returns the sequence number to wait for. Without the commit feature
+ * the registers are live and there is nothing to wait for.
+ */
+static unsigned int __overlay_commit(int num)
+{
+	unsigned int seq = ++svo.plane[num].commit_seq;
+
+	writel(seq, svo.svo_mmreg + num * svo.reg_size / 2 + OVERLAY_COMMIT);
+	return seq;
+}
+
+static unsigned int overlay_commit(int num)
+{
+	unsigned long flags;
+	unsigned int seq;
+
+	if (!(svo.features & OVERLAY_FEATURE_COMMIT))
+		return svo.plane[num].done_seq;
+
+	spin_lock_irqsave(&svo.lock, flags);
+	seq = __overlay_commit(num);
+	spin_unlock_irqrestore(&svo.lock, flags);
+
+	return seq;
+}
+
+static int overlay_wait_commit(int num, unsigned int seq)
+{
+	struct svo_plane *plane = &svo.plane[num];
+	long ret;
+
+	ret = wait_event_interruptible_timeout(plane->commit_wq,
+			(int)(ACCESS_ONCE(plane->done_seq) - seq) >= 0,
+			msecs_to_jiffies(SVO_COMMIT_TIMEOUT));
+	if (ret < 0)
+		return ret;
+	if (ret == 0)
+		return -ETIMEDOUT;
+	return 0;
+}
+
 static void overlay_power(int num, int onoff)
 {
+	unsigned long flags;
 	unsigned int ret;
 
+	spin_lock_irqsave(&svo.lock, flags);
 	ret = readl(svo.svo_mmreg + num * svo.reg_size / 2 + OVERLAY_POWER);
 	if (ret != onoff) {
 		writel(onoff, svo.svo_mmreg
 			+ num * svo.reg_size / 2 + OVERLAY_POWER);
+		if (svo.features & OVERLAY_FEATURE_COMMIT)
+			__overlay_commit(num);
 	}
+	spin_unlock_irqrestore(&svo.lock, flags);
+}
+
+static void overlay_get_window(int num, struct v4l2_rect *r)
+{
+	struct v4l2_rect *w = num ? &svo.w1 : &svo.w0;
+	unsigned long flags;
+	unsigned int ret;
+
+	spin_lock_irqsave(&svo.lock, flags);
+	ret = readl(svo.svo_mmreg + num * svo.reg_size / 2 + OVERLAY_POSITION);
+	w->left = ret & 0xFFFF;
+	w->top = (ret >> 16) & 0xFFFF;
+	ret = readl(svo.svo_mmreg + num * svo.reg_size / 2 + OVERLAY_SIZE);
+	w->width = ret & 0xFFFF;
+	w->height = (ret >> 16) & 0xFFFF;
+	*r = *w;
+	spin_unlock_irqrestore(&svo.lock, flags);
+}
+
+/* Position and size go out in the same commit. */
+static void overlay_set_window(int num, const struct v4l2_rect *r)
+{
+	struct v4l2_rect *w = num ? &svo.w1 : &svo.w0;
+	unsigned long flags;
+
+	spin_lock_irqsave(&svo.lock, flags);
+	*w = *r;
+	writel(w->left | (w->top << 16),
+		svo.svo_mmreg + num * svo.reg_size / 2 + OVERLAY_POSITION);
+	writel(w->width | (w->height << 16),
+		svo.svo_mmreg + num * svo.reg_size / 2 + OVERLAY_SIZE);
+	if (svo.features & OVERLAY_FEATURE_COMMIT)
+		__overlay_commit(num);
+	spin_unlock_irqrestore(&svo.lock, flags);
+}
+
+/*
+ * The code below is a videobuf2 allocator whose buffers are slots
+ * of the window memory, see OVERLAY_OFFSET.
+ */
+
+struct svo_mem {
+	struct svo_plane		*plane;
+	unsigned int			slot;
+	unsigned long			size;
+	atomic_t			refcount;
+	struct vb2_vmarea_handler	handler;
+};
+
+static void svo_mem_put(void *buf_priv)
+{
+	struct svo_mem *mem = buf_priv;
+
+	if (atomic_dec_and_test(&mem->refcount)) {
+		clear_bit(mem->slot, &mem->plane->slots);
+		kfree(mem);
+	}
+}
+
+static void *svo_mem_alloc(void *alloc_ctx, unsigned long size)
+{
+	struct svo_plane *plane = alloc_ctx;
+	struct svo_mem *mem;
+	unsigned int slot;
+
+	size = PAGE_ALIGN(size);
+
+	mem = kzalloc(sizeof(struct svo_mem), GFP_KERNEL);
+	if (!mem)
+		return NULL;
+
+	do {
+		slot = find_first_zero_bit(&plane->slots, SVO_MAX_BUFFERS);
+		if ((slot + 1) * size > svo.mem_size / 2) {
+			printk(KERN_ERR "svo: no slot left in the window "
+					"memory\n");
+			kfree(mem);
+			return NULL;
+		}
+	} while (test_and_set_bit(slot, &plane->slots));
+
+	mem->plane = plane;
+	mem->slot = slot;
+	mem->size = size;
+	mem->handler.refcount = &mem->refcount;
+	mem->handler.put = svo_mem_put;
+	mem->handler.arg = mem;
+	atomic_set(&mem->refcount, 1);
+
+	return mem;
+}
+
+static void *svo_mem_vaddr(void *buf_priv)
+{
+	/* the slots are only mapped to userspace */
+	return NULL;
+}
+
+static void *svo_mem_cookie(void *buf_priv)
+{
+	return buf_priv;
+}
+
+static unsigned int svo_mem_num_users(void *buf_priv)
+{
+	struct svo_mem *mem = buf_priv;
+
+	return atomic_read(&mem->refcount);
+}
+
+static int svo_mem_mmap(void *buf_priv, struct vm_area_struct *vma)
+{
+	struct svo_mem *mem = buf_priv;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	resource_size_t start;
+	int ret;
+
+	if (size > mem->size)
+		return -EINVAL;
+
+	start = svo.mem_start + mem->plane->num * (svo.mem_size / 2)
+		+ mem->slot * mem->size;
+	ret = remap_pfn_range(vma, vma->vm_start, start >> PAGE_SHIFT,
+			size, vma->vm_page_prot);
+	if (ret < 0)
+		return ret;
+
+	vma->vm_flags		|= VM_DONTEXPAND | VM_RESERVED;
+	vma->vm_private_data	= &mem->handler;
+	vma->vm_ops		= &vb2_common_vm_ops;
+
+	vma->vm_ops->open(vma);
+
+	return 0;
+}
+
+static const struct vb2_mem_ops svo_memops = {
+	.alloc		= svo_mem_alloc,
+	.put		= svo_mem_put,
+	.vaddr		= svo_mem_vaddr,
+	.cookie		= svo_mem_cookie,
+	.num_users	= svo_mem_num_users,
+	.mmap		= svo_mem_mmap,
+};
+
+static unsigned int svo_buffer_offset(struct svo_buffer *buf)
+{
+	struct svo_mem *mem = vb2_plane_cookie(&buf->vb, 0);
+
+	return mem->slot * mem->size;
+}
+
+/*
+ * Commit the next queued buffer unless one is already waiting for the
+ * host. Called with svo.lock held.
+ */
+static void svo_present_next(struct svo_plane *plane)
+{
+	struct svo_buffer *buf;
+
+	if (!plane->streaming || plane->pending || list_empty(&plane->queued))
+		return;
+
+	buf = list_first_entry(&plane->queued, struct svo_buffer, list);
+	list_del(&buf->list);
+
+	writel(svo_buffer_offset(buf), svo.svo_mmreg
+		+ plane->num * svo.reg_size / 2 + OVERLAY_OFFSET);
+	plane->pending = buf;
+	plane->pending_seq = __overlay_commit(plane->num);
+}
+
+/*
+ * The host latched a commit. Once the pending buffer is on screen the
+ * previous one is no longer read and goes back to the application.
+ * Called with svo.lock held.
+ */
+static void svo_plane_latched(struct svo_plane *plane)
+{
+	if (!plane->pending ||
+	    (int)(plane->done_seq - plane->pending_seq) < 0)
+		return;
+
+	if (plane->active)
+		vb2_buffer_done(&plane->active->vb, VB2_BUF_STATE_DONE);
+	plane->active = plane->pending;
+	plane->pending = NULL;
+
+	svo_present_next(plane);
+}
+
+static irqreturn_t svo_irq_handler(int irq, void *dev_id)
+{
+	unsigned int isr;
+	int num, handled = 0;
+
+	for (num = 0; num < 2; num++) {
+		isr = readl(svo.svo_mmreg + num * svo.reg_size / 2 + OVERLAY_ISR);
+		if (!isr)
+			continue;
+		handled = 1;
+
+		if (isr & OVERLAY_ISR_COMMIT) {
+			spin_lock(&svo.lock);
+			svo.plane[num].done_seq = readl(svo.svo_mmreg
+				+ num * svo.reg_size / 2 + OVERLAY_COMMIT);
+			svo_plane_latched(&svo.plane[num]);
+			spin_unlock(&svo.lock);
+			wake_up_interruptible(&svo.plane[num].commit_wq);
+		}
+	}
+
+	return handled ? IRQ_HANDLED : IRQ_NONE;
 }
 
 /*
@@ -105,29 +442,129 @@ static int svo_querycap(struct file *file, void *fh,
 		       SVO_DRIVER_MINORVERSION;
 
 	cap->capabilities = V4L2_CAP_VIDEO_OVERLAY;
+	if (svo.features & OVERLAY_FEATURE_COMMIT)
+		cap->capabilities |= V4L2_CAP_VIDEO_OUTPUT | V4L2_CAP_STREAMING;
+
+	return 0;
+}
+
+/*
+ * output streaming ioctls, shared by both windows
+ */
+
+static void svo_fill_pix(struct v4l2_pix_format *pix)
+{
+	pix->pixelformat = V4L2_PIX_FMT_RGB32;
+	pix->field = V4L2_FIELD_NONE;
+	pix->colorspace = V4L2_COLORSPACE_SRGB;
+	pix->bytesperline = pix->width * 4;
+	pix->sizeimage = pix->bytesperline * pix->height;
+}
+
+static int svo_enum_fmt_vid_out(struct file *file, void *priv,
+					struct v4l2_fmtdesc *f)
+{
+	if (f->index)
+		return -EINVAL;
+
+	strlcpy(f->description, "RGB32", sizeof(f->description));
+	f->pixelformat = V4L2_PIX_FMT_RGB32;
+
+	return 0;
+}
+
+static int svo_g_fmt_vid_out(struct file *file, void *priv,
+					struct v4l2_format *f)
+{
+	struct svo_plane *plane = video_drvdata(file);
+
+	f->fmt.pix = plane->pix;
+
+	return 0;
+}
+
+static int svo_try_fmt_vid_out(struct file *file, void *priv,
+					struct v4l2_format *f)
+{
+	struct v4l2_pix_format *pix = &f->fmt.pix;
+
+	pix->width = clamp_t(u32, pix->width, 1, 0xFFFF);
+	pix->height = clamp_t(u32, pix->height, 1, 0xFFFF);
+	svo_fill_pix(pix);
+
+	/* leave room for at least SVO_MIN_BUFFERS in the window memory */
+	if ((resource_size_t)PAGE_ALIGN(pix->sizeimage) * SVO_MIN_BUFFERS
+			> svo.mem_size / 2)
+		return -EINVAL;
+
+	return 0;
+}
+
+/* The window takes the frame size; it is latched with the next frame. */
+static int svo_s_fmt_vid_out(struct file *file, void *priv,
+					struct v4l2_format *f)
+{
+	struct svo_plane *plane = video_drvdata(file);
+	struct v4l2_rect *w = plane->num ? &svo.w1 : &svo.w0;
+	unsigned long flags;
+	int ret;
+
+	if (!(svo.features & OVERLAY_FEATURE_COMMIT))
+		return -EINVAL;
+
+	ret = svo_try_fmt_vid_out(file, priv, f);
+	if (ret)
+		return ret;
+
+	if (vb2_is_busy(&plane->vb_q))
+		return -EBUSY;
+
+	plane->pix = f->fmt.pix;
+	spin_lock_irqsave(&svo.lock, flags);
+	w->width = plane->pix.width;
+	w->height = plane->pix.height;
+	writel(w->width | (w->height << 16), svo.svo_mmreg
+		+ plane->num * svo.reg_size / 2 + OVERLAY_SIZE);
+	spin_unlock_irqrestore(&svo.lock, flags);
 
 	return 0;
 }
 
+static int svo_qbuf(struct file *file, void *priv, struct v4l2_buffer *p)
+{
+	struct svo_plane *plane = video_drvdata(file);
+
+	return vb2_qbuf(&plane->vb_q, p);
+}
+
+static int svo_dqbuf(struct file *file, void *priv, struct v4l2_buffer *p)
+{
+	struct svo_plane *plane = video_drvdata(file);
+
+	return vb2_dqbuf(&plane->vb_q, p, file->f_flags & O_NONBLOCK);
+}
+
+static int svo_streamon(struct file *file, void *priv, enum v4l2_buf_type i)
+{
+	struct svo_plane *plane = video_drvdata(file);
+
+	return vb2_streamon(&plane->vb_q, i);
+}
+
+static int svo_streamoff(struct file *file, void *priv, enum v4l2_buf_type i)
+{
+	struct svo_plane *plane = video_drvdata(file);
+
+	return vb2_streamoff(&plane->vb_q, i);
+}
+
 static int svo0_g_fmt_vid_overlay(struct file *file, void *priv,
 						struct v4l2_format *f)
 {
-	unsigned int ret = 0;
-
 	if (f->type != V4L2_BUF_TYPE_VIDEO_OVERLAY)
 		return -EINVAL;
 
-	ret = readl(svo.svo_mmreg + OVERLAY_POSITION);
-	svo.w0.left = ret & 0xFFFF;
-	svo.w0.top = (ret >> 16) & 0xFFFF;
-	ret = readl(svo.svo_mmreg + OVERLAY_SIZE);
-	svo.w0.width = ret & 0xFFFF;
-	svo.w0.height = (ret >> 16) & 0xFFFF;
-
-	f->fmt.win.w.left = svo.w0.left;
-	f->fmt.win.w.top = svo.w0.top;
-	f->fmt.win.w.width = svo.w0.width;
-	f->fmt.win.w.height = svo.w0.height;
+	overlay_get_window(0, &f->fmt.win.w);
 
 	return 0;
 }
@@ -135,22 +572,10 @@ static int svo0_g_fmt_vid_overlay(struct file *file, void *priv,
 static int svo1_g_fmt_vid_overlay(struct file *file, void *priv,
 						struct v4l2_format *f)
 {
-	unsigned int ret = 0;
-
 	if (f->type != V4L2_BUF_TYPE_VIDEO_OVERLAY)
 		return -EINVAL;
 
-	ret = readl(svo.svo_mmreg + svo.reg_size / 2 + OVERLAY_POSITION);
-	svo.w1.left = ret & 0xFFFF;
-	svo.w1.top = (ret >> 16) & 0xFFFF;
-	ret = readl(svo.svo_mmreg + svo.reg_size / 2 + OVERLAY_SIZE);
-	svo.w1.width = ret & 0xFFFF;
-	svo.w1.height = (ret >> 16) & 0xFFFF;
-
-	f->fmt.win.w.left = svo.w1.left;
-	f->fmt.win.w.top = svo.w1.top;
-	f->fmt.win.w.width = svo.w1.width;
-	f->fmt.win.w.height = svo.w1.height;
+	overlay_get_window(1, &f->fmt.win.w);
 
 	return 0;
 }
@@ -158,8 +583,6 @@ static int svo1_g_fmt_vid_overlay(struct file *file, void *priv,
 static int svo0_s_fmt_vid_overlay(struct file *file, void *priv,
 						struct v4l2_format *f)
 {
-	unsigned int arg;
-
 	if (f->type != V4L2_BUF_TYPE_VIDEO_OVERLAY)
 		return -EINVAL;
 
@@ -173,15 +596,7 @@ static int svo0_s_fmt_vid_overlay(struct file *file, void *priv,
 	if (f->fmt.win.w.height < 0)
 		return -EINVAL;
 
-	svo.w0.left = f->fmt.win.w.left;
-	svo.w0.top = f->fmt.win.w.top;
-	svo.w0.width = f->fmt.win.w.width;
-	svo.w0.height = f->fmt.win.w.height;
-
-	arg = svo.w0.left | (svo.w0.top << 16);
-	writel(arg, svo.svo_mmreg + OVERLAY_POSITION);
-	arg = svo.w0.width | (svo.w0.height << 16);
-	writel(arg, svo.svo_mmreg + OVERLAY_SIZE);
+	overlay_set_window(0, &f->fmt.win.w);
 
 	return 0;
 }
@@ -189,8 +604,6 @@ static int svo0_s_fmt_vid_overlay(struct file *file, void *priv,
 static int svo1_s_fmt_vid_overlay(struct file *file, void *priv,
 						struct v4l2_format *f)
 {
-	unsigned int arg;
-
 	if (f->type != V4L2_BUF_TYPE_VIDEO_OVERLAY)
 		return -EINVAL;
 
@@ -204,15 +617,7 @@ static int svo1_s_fmt_vid_overlay(struct file *file, void *priv,
 	if (f->fmt.win.w.height < 0)
 		return -EINVAL;
 
-	svo.w1.left = f->fmt.win.w.left;
-	svo.w1.top = f->fmt.win.w.top;
-	svo.w1.width = f->fmt.win.w.width;
-	svo.w1.height = f->fmt.win.w.height;
-
-	arg = svo.w1.left | (svo.w1.top << 16);
-	writel(arg, svo.svo_mmreg + svo.reg_size / 2 + OVERLAY_POSITION);
-	arg = svo.w1.width | (svo.w1.height << 16);
-	writel(arg, svo.svo_mmreg + svo.reg_size / 2 + OVERLAY_SIZE);
+	overlay_set_window(1, &f->fmt.win.w);
 
 	return 0;
 }
@@ -220,6 +625,14 @@ static int svo1_s_fmt_vid_overlay(struct file *file, void *priv,
 static int svo_reqbufs(struct file *file, void *priv,
 				  struct v4l2_requestbuffers *p)
 {
+	struct svo_plane *plane = video_drvdata(file);
+
+	if (p->type == V4L2_BUF_TYPE_VIDEO_OUTPUT) {
+		if (!(svo.features & OVERLAY_FEATURE_COMMIT))
+			return -EINVAL;
+		return vb2_reqbufs(&plane->vb_q, p);
+	}
+
 	if (p->type != V4L2_BUF_TYPE_VIDEO_OVERLAY)
 		return -EINVAL;
 
@@ -234,6 +647,9 @@ static int svo_reqbufs(struct file *file, void *priv,
 
 static int svo0_querybuf(struct file *file, void *priv, struct v4l2_buffer *p)
 {
+	if (p->type == V4L2_BUF_TYPE_VIDEO_OUTPUT)
+		return vb2_querybuf(&svo.plane[0].vb_q, p);
+
 	if (p->type != V4L2_BUF_TYPE_VIDEO_OVERLAY)
 		return -EINVAL;
 
@@ -248,6 +664,9 @@ static int svo0_querybuf(struct file *file, void *priv, struct v4l2_buffer *p)
 
 static int svo1_querybuf(struct file *file, void *priv, struct v4l2_buffer *p)
 {
+	if (p->type == V4L2_BUF_TYPE_VIDEO_OUTPUT)
+		return vb2_querybuf(&svo.plane[1].vb_q, p);
+
 	if (p->type != V4L2_BUF_TYPE_VIDEO_OVERLAY)
 		return -EINVAL;
 
@@ -274,24 +693,238 @@ static int svo1_overlay(struct file *file, void *fh, unsigned int i)
 	return 0;
 }
 
+/*
+ * Show the frame at 'offset' of the window memory, together with any
+ * position or size change made since the last commit.
+ */
+static long svo_commit(int num, struct svo_commit *c)
+{
+	unsigned long flags;
+	unsigned int seq;
+
+	if (!(svo.features & OVERLAY_FEATURE_COMMIT))
+		return -ENODEV;
+
+	if (c->offset >= svo.mem_size / 2)
+		return -EINVAL;
+
+	/* the front buffer belongs to the output queue while streaming */
+	spin_lock_irqsave(&svo.lock, flags);
+	if (svo.plane[num].streaming) {
+		spin_unlock_irqrestore(&svo.lock, flags);
+		return -EBUSY;
+	}
+
+	writel(c->offset, svo.svo_mmreg + num * svo.reg_size / 2
+		+ OVERLAY_OFFSET);
+	seq = __overlay_commit(num);
+	spin_unlock_irqrestore(&svo.lock, flags);
+
+	if (c->flags & SVO_COMMIT_WAIT)
+		return overlay_wait_commit(num, seq);
+
+	return 0;
+}
+
+static long svo0_default(struct file *file, void *fh, bool valid_prio,
+						int cmd, void *arg)
+{
+	switch (cmd) {
+	case SVO_IOC_COMMIT:
+		return svo_commit(0, arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+static long svo1_default(struct file *file, void *fh, bool valid_prio,
+						int cmd, void *arg)
+{
+	switch (cmd) {
+	case SVO_IOC_COMMIT:
+		return svo_commit(1, arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+/*
+ * Videobuf operations
+ */
+
+static int svo_queue_setup(struct vb2_queue *vq, const struct v4l2_format *fmt,
+			unsigned int *nbuffers, unsigned int *nplanes,
+			unsigned int sizes[], void *alloc_ctxs[])
+{
+	struct svo_plane *plane = vb2_get_drv_priv(vq);
+	unsigned int size = plane->pix.sizeimage;
+	unsigned int max;
+
+	/* every buffer is a slot of the window memory */
+	max = (svo.mem_size / 2) / PAGE_ALIGN(size);
+	if (max > SVO_MAX_BUFFERS)
+		max = SVO_MAX_BUFFERS;
+	if (max > VIDEO_MAX_FRAME)
+		max = VIDEO_MAX_FRAME;
+	if (max < SVO_MIN_BUFFERS)
+		return -ENOMEM;
+
+	if (0 == *nbuffers)
+		*nbuffers = SVO_DFL_BUFFERS;
+	if (*nbuffers < SVO_MIN_BUFFERS)
+		*nbuffers = SVO_MIN_BUFFERS;
+	if (*nbuffers > max)
+		*nbuffers = max;
+
+	*nplanes = 1;
+	sizes[0] = size;
+	alloc_ctxs[0] = plane;
+
+	return 0;
+}
+
+static int svo_buffer_prepare(struct vb2_buffer *vb)
+{
+	struct svo_plane *plane = vb2_get_drv_priv(vb->vb2_queue);
+	unsigned long size = plane->pix.sizeimage;
+
+	if (vb2_plane_size(vb, 0) < size)
+		return -EINVAL;
+
+	vb2_set_plane_payload(vb, 0, size);
+
+	return 0;
+}
+
+static void svo_buffer_queue(struct vb2_buffer *vb)
+{
+	struct svo_plane *plane = vb2_get_drv_priv(vb->vb2_queue);
+	struct svo_buffer *buf = container_of(vb, struct svo_buffer, vb);
+	unsigned long flags;
+
+	spin_lock_irqsave(&svo.lock, flags);
+	list_add_tail(&buf->list, &plane->queued);
+	svo_present_next(plane);
+	spin_unlock_irqrestore(&svo.lock, flags);
+}
+
+/* The window is switched on together with the first frame. */
+static int svo_start_streaming(struct vb2_queue *vq, unsigned int count)
+{
+	struct svo_plane *plane = vb2_get_drv_priv(vq);
+	unsigned long flags;
+
+	spin_lock_irqsave(&svo.lock, flags);
+	writel(1, svo.svo_mmreg + plane->num * svo.reg_size / 2
+		+ OVERLAY_POWER);
+	plane->streaming = 1;
+	svo_present_next(plane);
+	spin_unlock_irqrestore(&svo.lock, flags);
+
+	return 0;
+}
+
+static int svo_stop_streaming(struct vb2_queue *vq)
+{
+	struct svo_plane *plane = vb2_get_drv_priv(vq);
+	struct svo_buffer *buf, *tmp;
+	unsigned long flags;
+
+	spin_lock_irqsave(&svo.lock, flags);
+	plane->streaming = 0;
+	writel(0, svo.svo_mmreg + plane->num * svo.reg_size / 2
+		+ OVERLAY_POWER);
+	__overlay_commit(plane->num);
+
+	list_for_each_entry_safe(buf, tmp, &plane->queued, list) {
+		list_del(&buf->list);
+		vb2_buffer_done(&buf->vb, VB2_BUF_STATE_ERROR);
+	}
+	if (plane->pending)
+		vb2_buffer_done(&plane->pending->vb, VB2_BUF_STATE_ERROR);
+	if (plane->active)
+		vb2_buffer_done(&plane->active->vb, VB2_BUF_STATE_ERROR);
+	plane->pending = NULL;
+	plane->active = NULL;
+	spin_unlock_irqrestore(&svo.lock, flags);
+
+	return 0;
+}
+
+static void svo_wait_prepare(struct vb2_queue *vq)
+{
+	struct svo_plane *plane = vb2_get_drv_priv(vq);
+
+	mutex_unlock(&plane->vb_lock);
+}
+
+static void svo_wait_finish(struct vb2_queue *vq)
+{
+	struct svo_plane *plane = vb2_get_drv_priv(vq);
+
+	mutex_lock(&plane->vb_lock);
+}
+
+static struct vb2_ops svo_video_qops = {
+	.queue_setup		= svo_queue_setup,
+	.buf_prepare		= svo_buffer_prepare,
+	.buf_queue		= svo_buffer_queue,
+	.start_streaming	= svo_start_streaming,
+	.stop_streaming		= svo_stop_streaming,
+	.wait_prepare		= svo_wait_prepare,
+	.wait_finish		= svo_wait_finish,
+};
+
 /*
  * File operations
  */
 
+static int svo_queue_init(struct svo_plane *plane)
+{
+	struct v4l2_rect *w = plane->num ? &svo.w1 : &svo.w0;
+
+	plane->pix.width = w->width ? w->width : 1;
+	plane->pix.height = w->height ? w->height : 1;
+	svo_fill_pix(&plane->pix);
+	INIT_LIST_HEAD(&plane->queued);
+
+	memset(&plane->vb_q, 0, sizeof(plane->vb_q));
+	plane->vb_q.type		= V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	plane->vb_q.io_modes		= VB2_MMAP;
+	plane->vb_q.drv_priv		= plane;
+	plane->vb_q.buf_struct_size	= sizeof(struct svo_buffer);
+	plane->vb_q.ops			= &svo_video_qops;
+	plane->vb_q.mem_ops		= &svo_memops;
+
+	return vb2_queue_init(&plane->vb_q);
+}
+
 static int svo0_open(struct file *file)
 {
-	if (test_and_set_bit(0, &svo.in_use0))
+	int ret;
+
+	if (test_and_set_bit_lock(0, &svo.in_use0))
 		return -EBUSY;
 
-	return 0;
+	ret = svo_queue_init(&svo.plane[0]);
+	if (ret)
+		clear_bit_unlock(0, &svo.in_use0);
+
+	return ret;
 }
 
 static int svo1_open(struct file *file)
 {
-	if (test_and_set_bit(0, &svo.in_use1))
+	int ret;
+
+	if (test_and_set_bit_lock(0, &svo.in_use1))
 		return -EBUSY;
 
-	return 0;
+	ret = svo_queue_init(&svo.plane[1]);
+	if (ret)
+		clear_bit_unlock(0, &svo.in_use1);
+
+	return ret;
 }
 
 static void svo_vm_open(struct vm_area_struct *vma)
@@ -309,8 +942,13 @@ static const struct vm_operations_struct svo_vm_ops = {
 
 static int svo_mmap(struct file *file, struct vm_area_struct *vma)
 {
+	struct svo_plane *plane = video_drvdata(file);
 	unsigned long size = vma->vm_end - vma->vm_start;
 
+	/* buffers of the output queue, see VIDIOC_QUERYBUF */
+	if (plane->vb_q.num_buffers)
+		return vb2_mmap(&plane->vb_q, vma);
+
 	if (size > svo.mem_size)
 		return -EINVAL;
 
@@ -325,18 +963,31 @@ static int svo_mmap(struct file *file, struct vm_area_struct *vma)
 	return 0;
 }
 
+static unsigned int svo_poll(struct file *file, struct poll_table_struct *wait)
+{
+	struct svo_plane *plane = video_drvdata(file);
+
+	return vb2_poll(&plane->vb_q, file, wait);
+}
+
 static int svo0_release(struct file *file)
 {
-	clear_bit(0, &svo.in_use0);
+	/* v4l2_release() holds vb_lock, the video_device lock */
+	vb2_queue_release(&svo.plane[0].vb_q);
 	overlay_power(0, 0);
+	/* only now may the next open touch the plane */
+	clear_bit_unlock(0, &svo.in_use0);
 
 	return 0;
 }
 
 static int svo1_release(struct file *file)
 {
-	clear_bit(0, &svo.in_use1);
+	/* v4l2_release() holds vb_lock, the video_device lock */
+	vb2_queue_release(&svo.plane[1].vb_q);
 	overlay_power(1, 0);
+	/* only now may the next open touch the plane */
+	clear_bit_unlock(0, &svo.in_use1);
 
 	return 0;
 }
@@ -348,6 +999,15 @@ static const struct v4l2_ioctl_ops svo0_ioctl_ops = {
 	.vidioc_reqbufs			= svo_reqbufs,
 	.vidioc_querybuf		= svo0_querybuf,
 	.vidioc_overlay			= svo0_overlay,
+	.vidioc_enum_fmt_vid_out	= svo_enum_fmt_vid_out,
+	.vidioc_g_fmt_vid_out		= svo_g_fmt_vid_out,
+	.vidioc_try_fmt_vid_out		= svo_try_fmt_vid_out,
+	.vidioc_s_fmt_vid_out		= svo_s_fmt_vid_out,
+	.vidioc_qbuf			= svo_qbuf,
+	.vidioc_dqbuf			= svo_dqbuf,
+	.vidioc_streamon		= svo_streamon,
+	.vidioc_streamoff		= svo_streamoff,
+	.vidioc_default			= svo0_default,
 };
 
 static const struct v4l2_ioctl_ops svo1_ioctl_ops = {
@@ -357,6 +1017,15 @@ static const struct v4l2_ioctl_ops svo1_ioctl_ops = {
 	.vidioc_reqbufs			= svo_reqbufs,
 	.vidioc_querybuf		= svo1_querybuf,
 	.vidioc_overlay			= svo1_overlay,
+	.vidioc_enum_fmt_vid_out	= svo_enum_fmt_vid_out,
+	.vidioc_g_fmt_vid_out		= svo_g_fmt_vid_out,
+	.vidioc_try_fmt_vid_out		= svo_try_fmt_vid_out,
+	.vidioc_s_fmt_vid_out		= svo_s_fmt_vid_out,
+	.vidioc_qbuf			= svo_qbuf,
+	.vidioc_dqbuf			= svo_dqbuf,
+	.vidioc_streamon		= svo_streamon,
+	.vidioc_streamoff		= svo_streamoff,
+	.vidioc_default			= svo1_default,
 };
 
 static const struct v4l2_file_operations svo0_fops = {
@@ -364,7 +1033,8 @@ static const struct v4l2_file_operations svo0_fops = {
 	.open		= svo0_open,
 	.release	= svo0_release,
 	.mmap		= svo_mmap,
-	.ioctl		= video_ioctl2,
+	.poll		= svo_poll,
+	.unlocked_ioctl	= video_ioctl2,
 };
 
 static const struct v4l2_file_operations svo1_fops = {
@@ -372,7 +1042,8 @@ static const struct v4l2_file_operations svo1_fops = {
 	.open		= svo1_open,
 	.release	= svo1_release,
 	.mmap		= svo_mmap,
-	.ioctl		= video_ioctl2,
+	.poll		= svo_poll,
+	.unlocked_ioctl	= video_ioctl2,
 };
 
 static struct video_device svo0_template = {
@@ -415,10 +1086,19 @@ static int __devinit svo_initdev(struct pci_dev *pci_dev,
 		goto outnotdev;
 	}
 
+	svo.plane[0].num = 0;
+	mutex_init(&svo.plane[0].vb_lock);
+	svo.plane[1].num = 1;
+	mutex_init(&svo.plane[1].vb_lock);
+
 	memcpy(svo.video_dev0, &svo0_template, sizeof(svo0_template));
 	svo.video_dev0->parent = &svo.pci_dev->dev;
+	svo.video_dev0->lock = &svo.plane[0].vb_lock;
+	video_set_drvdata(svo.video_dev0, &svo.plane[0]);
 	memcpy(svo.video_dev1, &svo1_template, sizeof(svo1_template));
 	svo.video_dev1->parent = &svo.pci_dev->dev;
+	svo.video_dev1->lock = &svo.plane[1].vb_lock;
+	video_set_drvdata(svo.video_dev1, &svo.plane[1]);
 
 	ret = -EIO;
 
@@ -465,6 +1145,21 @@ static int __devinit svo_initdev(struct pci_dev *pci_dev,
 
 	pci_set_master(svo.pci_dev);
 
+	spin_lock_init(&svo.lock);
+	init_waitqueue_head(&svo.plane[0].commit_wq);
+	init_waitqueue_head(&svo.plane[1].commit_wq);
+
+	svo.features = readl(svo.svo_mmreg + OVERLAY_FEATURES)
+			& OVERLAY_FEATURE_COMMIT;
+	if (svo.features) {
+		if (request_irq(svo.pci_dev->irq, svo_irq_handler,
+				IRQF_SHARED, "svo", &svo)) {
+			printk(KERN_ERR "svo: request_irq failed\n");
+			svo.features = 0;
+		}
+	}
+	writel(svo.features, svo.svo_mmreg + OVERLAY_FEATURES);
+
 	/* register number is set to force
 	 * because of the camera device (/dev/video0)
 	 */
@@ -485,6 +1180,10 @@ static int __devinit svo_initdev(struct pci_dev *pci_dev,
 	return 0;
 
 outreqirq:
+	if (svo.features) {
+		writel(0, svo.svo_mmreg + OVERLAY_FEATURES);
+		free_irq(svo.pci_dev->irq, &svo);
+	}
 	iounmap(svo.svo_mmreg);
 outremap:
 	release_mem_region(pci_resource_start(svo.pci_dev, 0),
@@ -510,17 +1209,34 @@ static struct pci_driver svo_pci_driver = {
 #endif
 };
 
+static int svo_register(void)
+{
+	return pci_register_driver(&svo_pci_driver);
+}
+
+static void svo_unregister(void)
+{
+	pci_unregister_driver(&svo_pci_driver);
+}
+
+static struct maru_async_driver svo_async = {
+	.name = "svo",
+	.reg = svo_register,
+	.unreg = svo_unregister,
+};
+
 static int __init svo_init(void)
 {
 	printk(KERN_INFO "svo: Maru overlay driver version %d.%d loaded\n",
 		SVO_DRIVER_MAJORVERSION, SVO_DRIVER_MINORVERSION);
 
-	return pci_register_driver(&svo_pci_driver);
+	maru_async_register(&svo_async);
+	return 0;
 }
 
 static void __exit svo_fini(void)
 {
-	pci_unregister_driver(&svo_pci_driver);
+	maru_async_unregister(&svo_async);
 }
 
 module_init(svo_init);
@@ -27,87 +27,156 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/device.h>
+#include <linux/mutex.h>
 #include <linux/platform_device.h>
-
-static struct class *mtd_class;
-static struct device* mtd_device;
+#include <linux/power_supply.h>
 
 static int capacity = 50;
 static int charge_full = 0;
 static int charge_now = 0;
 
-//#define DEBUG_MARU_POWER_SUPPLY
-
-static ssize_t show_capacity(struct device *dev, struct device_attribute *attr, char *buf) 
-{
-#ifdef DEBUG_MARU_POWER_SUPPLY
-	printk("[%s] \n", __FUNCTION__);
-#endif
-	return snprintf(buf, PAGE_SIZE, "%d", capacity);
-}
+/* protects the battery property fields and their sysfs_notify() */
+static DEFINE_MUTEX(battery_lock);
 
-static ssize_t store_capacity(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) 
-{
-#ifdef DEBUG_MARU_POWER_SUPPLY
-	printk("[%s] \n", __FUNCTION__);
-#endif
-	sscanf(buf, "%d", &capacity);
-	return strnlen(buf, PAGE_SIZE);
-}
+//#define DEBUG_MARU_POWER_SUPPLY
+
+/*
+ * The event injector writes capacity, charge_full and charge_now under
+ * /sys/class/power_supply/battery. Every change is announced with
+ * power_supply_changed() (a uevent) and sysfs_notify() on the written
+ * attribute, so daemons can sleep in poll() instead of reading these
+ * files on a timer.
+ */
+static enum power_supply_property battery_props[] = {
+	POWER_SUPPLY_PROP_STATUS,
+	POWER_SUPPLY_PROP_PRESENT,
+	POWER_SUPPLY_PROP_CAPACITY,
+	POWER_SUPPLY_PROP_CHARGE_FULL,
+	POWER_SUPPLY_PROP_CHARGE_NOW,
+};
 
-static ssize_t show_charge_full(struct device *dev, struct device_attribute *attr, char *buf) 
+static int battery_get_property(struct power_supply *psy,
+		enum power_supply_property psp, union power_supply_propval *val)
 {
-#ifdef DEBUG_MARU_POWER_SUPPLY
-	printk("[%s] \n", __FUNCTION__);
-#endif
-	return snprintf(buf, PAGE_SIZE, "%d", charge_full);
+#ifdef DEBUG_MARU_POWER_SUPPLY
+	printk("[%s] %d\n", __FUNCTION__, psp);
+#endif
+	switch (psp) {
+	case POWER_SUPPLY_PROP_STATUS:
+		if (charge_full)
+			val->intval = POWER_SUPPLY_STATUS_FULL;
+		else if (charge_now)
+			val->intval = POWER_SUPPLY_STATUS_CHARGING;
+		else
+			val->intval = POWER_SUPPLY_STATUS_DISCHARGING;
+		break;
+	case POWER_SUPPLY_PROP_PRESENT:
+		val->intval = 1;
+		break;
+	case POWER_SUPPLY_PROP_CAPACITY:
+		val->intval = capacity;
+		break;
+	case POWER_SUPPLY_PROP_CHARGE_FULL:
+		val->intval = charge_full;
+		break;
+	case POWER_SUPPLY_PROP_CHARGE_NOW:
+		val->intval = charge_now;
+		break;
+	default:
+		return -EINVAL;
+	}
+	return 0;
 }
 
-static ssize_t store_charge_full(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) 
+static int battery_set_property(struct power_supply *psy,
+		enum power_supply_property psp, const union power_supply_propval *val)
 {
-#ifdef DEBUG_MARU_POWER_SUPPLY
-	printk("[%s] \n", __FUNCTION__);
-#endif
-	sscanf(buf, "%d", &charge_full);
-	return strnlen(buf, PAGE_SIZE);
+	const char *attr;
+	int *prop;
+
+#ifdef DEBUG_MARU_POWER_SUPPLY
+	printk("[%s] %d\n", __FUNCTION__, psp);
+#endif
+	switch (psp) {
+	case POWER_SUPPLY_PROP_CAPACITY:
+		prop = &capacity;
+		attr = "capacity";
+		break;
+	case POWER_SUPPLY_PROP_CHARGE_FULL:
+		prop = &charge_full;
+		attr = "charge_full";
+		break;
+	case POWER_SUPPLY_PROP_CHARGE_NOW:
+		prop = &charge_now;
+		attr = "charge_now";
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	mutex_lock(&battery_lock);
+	if (*prop == val->intval) {
+		mutex_unlock(&battery_lock);
+		return 0;
+	}
+	*prop = val->intval;
+
+	sysfs_notify(&psy->dev->kobj, NULL, attr);
+	if (psp != POWER_SUPPLY_PROP_CAPACITY)
+		sysfs_notify(&psy->dev->kobj, NULL, "status");
+	mutex_unlock(&battery_lock);
+
+	power_supply_changed(psy);
+	return 0;
 }
 
-static ssize_t show_charge_now(struct device *dev, struct device_attribute *attr, char *buf) 
+static int battery_property_is_writeable(struct power_supply *psy,
+		enum power_supply_property psp)
 {
-#ifdef DEBUG_MARU_POWER_SUPPLY
-	printk("[%s] \n", __FUNCTION__);
-#endif
-	return snprintf(buf, PAGE_SIZE, "%d", charge_now);
+	switch (psp) {
+	case POWER_SUPPLY_PROP_CAPACITY:
+	case POWER_SUPPLY_PROP_CHARGE_FULL:
+	case POWER_SUPPLY_PROP_CHARGE_NOW:
+		return 1;
+	default:
+		return 0;
+	}
 }
 
-static ssize_t store_charge_now(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) 
+/* "ac" and "usb" in maru_jack.c report to us when their state changes */
+static void battery_external_power_changed(struct power_supply *psy)
 {
-#ifdef DEBUG_MARU_POWER_SUPPLY
-	printk("[%s] \n", __FUNCTION__);
-#endif
-	sscanf(buf, "%d", &charge_now);
-	return strnlen(buf, PAGE_SIZE);
+	power_supply_changed(psy);
 }
 
-static struct device_attribute ps_device_attributes[] = {
-	__ATTR(capacity, 0644, show_capacity, store_capacity),
-	__ATTR(charge_full, 0644, show_charge_full, store_charge_full),
-	__ATTR(charge_now, 0644, show_charge_now, store_charge_now),
+static struct power_supply maru_battery = {
+	.name = "battery",
+	.type = POWER_SUPPLY_TYPE_BATTERY,
+	.properties = battery_props,
+	.num_properties = ARRAY_SIZE(battery_props),
+	.get_property = battery_get_property,
+	.set_property = battery_set_property,
+	.property_is_writeable = battery_property_is_writeable,
+	.external_power_changed = battery_external_power_changed,
 };
 
-struct device new_device_dev;
+static struct platform_device *maru_battery_pdev;
 
 static int __init sysfs_test_init(void) 
 {
 	int err;
 	printk("[%s] \n", __FUNCTION__);
 
-	mtd_class = class_create(THIS_MODULE, "power_supply");
-	mtd_device = device_create(mtd_class, NULL, (dev_t)NULL, NULL, "battery");
-	
-	err = device_create_file(mtd_device, &ps_device_attributes[0]);
-	err = device_create_file(mtd_device, &ps_device_attributes[1]);
-	err = device_create_file(mtd_device, &ps_device_attributes[2]);
+	maru_battery_pdev = platform_device_register_simple("maru-battery", -1, NULL, 0);
+	if (IS_ERR(maru_battery_pdev))
+		return PTR_ERR(maru_battery_pdev);
+
+	err = power_supply_register(&maru_battery_pdev->dev, &maru_battery);
+	if (err) {
+		printk("power_supply_register error\n");
+		platform_device_unregister(maru_battery_pdev);
+		return err;
+	}
 
 	return 0;
 }
@@ -115,7 +184,8 @@ static int __init sysfs_test_init(void)
 static void __exit sysfs_test_exit(void) 
 {
 	printk("[%s] \n", __FUNCTION__);
-	class_destroy(mtd_class);
+	power_supply_unregister(&maru_battery);
+	platform_device_unregister(maru_battery_pdev);
 }
 
 module_init(sysfs_test_init);
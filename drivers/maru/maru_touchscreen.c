@@ -33,6 +33,7 @@
 #include <linux/module.h>
 #include <linux/init.h>
 #include <linux/usb/input.h>
+#include <linux/input/mt.h>
 #include <linux/slab.h>
 
 MODULE_LICENSE("GPL");
@@ -48,6 +49,7 @@ MODULE_DESCRIPTION("Emulator Touchscreen driver for x86");
 
 struct emul_touchscreen {
     dma_addr_t data_dma;
+    unsigned int frame:1;
     struct input_dev *emuldev;
     struct usb_device *usbdev;
     struct usb_interface *intf;
@@ -64,6 +66,43 @@ typedef struct USBEmulTouchscreenPacket {
     uint8_t state;
 } USBEmulTouchscreenPacket;
 
+/*
+ * Frame mode: one transfer carries every contact that changed since the
+ * previous frame. The host offers it by advertising an interrupt
+ * endpoint large enough for a whole frame.
+ */
+typedef struct USBEmulTouchscreenContact {
+    uint16_t x, y;
+    uint8_t id;
+    uint8_t state;
+} __attribute__((packed)) USBEmulTouchscreenContact;
+
+typedef struct USBEmulTouchscreenFrame {
+    uint8_t count;
+    uint8_t reserved;
+    USBEmulTouchscreenContact contact[MAX_TRKID];
+} __attribute__((packed)) USBEmulTouchscreenFrame;
+
+#define EMUL_TOUCHSCREEN_FRAME_HDR_LEN offsetof(USBEmulTouchscreenFrame, contact)
+#define EMUL_TOUCHSCREEN_BUF_LEN sizeof(USBEmulTouchscreenFrame)
+
+/* report one contact into its slot, the caller syncs */
+static void emul_touchscreen_report(struct input_dev *input_dev,
+        unsigned int id, int pressed, unsigned int x, unsigned int y)
+{
+    if (id > MAX_TRKID) {
+        return;
+    }
+
+    input_mt_slot(input_dev, id);
+    input_mt_report_slot_state(input_dev, MT_TOOL_FINGER, pressed);
+    if (pressed) {
+        input_report_abs(input_dev, ABS_MT_TOUCH_MAJOR, 5);
+        input_report_abs(input_dev, ABS_MT_POSITION_X, x);
+        input_report_abs(input_dev, ABS_MT_POSITION_Y, y);
+    }
+}
+
 
 static void emul_touchscreen_sys_irq(struct urb *urb)
 {
@@ -87,27 +126,30 @@ static void emul_touchscreen_sys_irq(struct urb *urb)
             goto exit;
     }
 
-    if (packet->state != 0) { //pressed
-        input_report_abs(input_dev, ABS_MT_TRACKING_ID, packet->z);
-        input_report_abs(input_dev, ABS_MT_TOUCH_MAJOR, 5);
-        input_report_abs(input_dev, ABS_MT_POSITION_X, packet->x);
-        input_report_abs(input_dev, ABS_MT_POSITION_Y, packet->y);
-        //printk(KERN_INFO "!!pressed x=%d, y=%d, z=%d", packet->x, packet->y, packet->z);
-        input_mt_sync(input_dev);
-    } else { //release
-#if 0
-        if (packet->z == 1) {
-            input_report_abs(input_dev, ABS_MT_TRACKING_ID, 1);
-            input_report_abs(input_dev, ABS_MT_TOUCH_MAJOR, 0);
-            input_mt_sync(input_dev);
+    if (usb_ts->frame) {
+        USBEmulTouchscreenFrame *frame = (USBEmulTouchscreenFrame *)usb_ts->data;
+        int i, count = frame->count;
+
+        if (urb->actual_length < EMUL_TOUCHSCREEN_FRAME_HDR_LEN) {
+            goto exit;
+        }
+        count = min_t(int, count, MAX_TRKID);
+        count = min_t(int, count, (urb->actual_length - EMUL_TOUCHSCREEN_FRAME_HDR_LEN)
+                / sizeof(USBEmulTouchscreenContact));
+
+        for (i = 0; i < count; i++) {
+            USBEmulTouchscreenContact *c = &frame->contact[i];
+
+            emul_touchscreen_report(input_dev, c->id, c->state != 0,
+                    le16_to_cpu(c->x), le16_to_cpu(c->y));
         }
-#endif
-        input_report_abs(input_dev, ABS_MT_TRACKING_ID, packet->z);
-        input_report_abs(input_dev, ABS_MT_TOUCH_MAJOR, 0);
-        //printk(KERN_INFO "!!released x=%d, y=%d, z=%d", packet->x, packet->y, packet->z);
-        input_mt_sync(input_dev);
+    } else {
+        emul_touchscreen_report(input_dev, packet->z, packet->state != 0,
+                packet->x, packet->y);
     }
 
+    /* one sync per transfer, the whole frame is seen at once */
+    input_mt_report_pointer_emulation(input_dev, true);
     input_sync(input_dev);
 
  exit:
@@ -172,7 +214,8 @@ static int emul_touchscreen_probe(struct usb_interface *intf, const struct usb_d
     }
 
     usb_ts->usbdev = interface_to_usbdev(intf);
-    usb_ts->data = usb_alloc_coherent(usb_ts->usbdev, 10, GFP_KERNEL, &usb_ts->data_dma);
+    usb_ts->data = usb_alloc_coherent(usb_ts->usbdev, EMUL_TOUCHSCREEN_BUF_LEN,
+            GFP_KERNEL, &usb_ts->data_dma);
     if (!usb_ts->data) {
         goto fail1;
     }
@@ -212,15 +255,24 @@ static int emul_touchscreen_probe(struct usb_interface *intf, const struct usb_d
     input_set_abs_params(usb_ts->emuldev, ABS_X, 0, TOUCHSCREEN_RESOLUTION_X, 4, 0);
     input_set_abs_params(usb_ts->emuldev, ABS_Y, 0, TOUCHSCREEN_RESOLUTION_Y, 4, 0);
 
-    /* for multitouch */
-    input_set_abs_params(usb_ts->emuldev, ABS_MT_TRACKING_ID, 0, MAX_TRKID, 0, 0);
+    /* for multitouch, contact ids 0..MAX_TRKID map to type-B slots */
+    error = input_mt_init_slots(usb_ts->emuldev, MAX_TRKID + 1);
+    if (error) {
+        goto fail3;
+    }
     input_set_abs_params(usb_ts->emuldev, ABS_MT_TOUCH_MAJOR, 0, ABS_PRESSURE_MAX, 0, 0);
     input_set_abs_params(usb_ts->emuldev, ABS_MT_POSITION_X, 0, TOUCHSCREEN_RESOLUTION_X, 0, 0);
     input_set_abs_params(usb_ts->emuldev, ABS_MT_POSITION_Y, 0, TOUCHSCREEN_RESOLUTION_Y, 0, 0);
 
+    usb_ts->frame = le16_to_cpu(endpoint->wMaxPacketSize) >= EMUL_TOUCHSCREEN_BUF_LEN;
+    if (usb_ts->frame) {
+        printk(KERN_INFO "usb touchscreen reports whole frames\n");
+    }
+
     usb_fill_int_urb(usb_ts->irq, usb_ts->usbdev,
              usb_rcvintpipe(usb_ts->usbdev, endpoint->bEndpointAddress),
-             usb_ts->data, EMUL_TOUCHSCREEN_PACKET_LEN,
+             usb_ts->data,
+             usb_ts->frame ? EMUL_TOUCHSCREEN_BUF_LEN : EMUL_TOUCHSCREEN_PACKET_LEN,
              emul_touchscreen_sys_irq, usb_ts, endpoint->bInterval);
     usb_ts->irq->transfer_dma = usb_ts->data_dma;
     usb_ts->irq->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
@@ -234,7 +286,7 @@ static int emul_touchscreen_probe(struct usb_interface *intf, const struct usb_d
     return 0;
 
  fail3:    usb_free_urb(usb_ts->irq);
- fail2:    usb_free_coherent(usb_ts->usbdev, 10, usb_ts->data, usb_ts->data_dma);
+ fail2:    usb_free_coherent(usb_ts->usbdev, EMUL_TOUCHSCREEN_BUF_LEN, usb_ts->data, usb_ts->data_dma);
  fail1:    input_free_device(usb_ts->emuldev);
     kfree(usb_ts);
     return error;
@@ -251,7 +303,8 @@ static void emul_touchscreen_disconnect(struct usb_interface *intf)
         usb_kill_urb(usb_ts->irq);
         input_unregister_device(usb_ts->emuldev);
         usb_free_urb(usb_ts->irq);
-        usb_free_coherent(interface_to_usbdev(intf), 10, usb_ts->data, usb_ts->data_dma);
+        usb_free_coherent(interface_to_usbdev(intf), EMUL_TOUCHSCREEN_BUF_LEN,
+                usb_ts->data, usb_ts->data_dma);
         kfree(usb_ts);
     }
 }
@@ -0,0 +1,289 @@
+/*
+ * Maru Virtio Touchscreen Device Driver
+ *
+ * Copyright (c) 2012 Samsung Electronics Co., Ltd. All rights reserved.
+ *
+ * Contact:
+ * GiWoong Kim <giwoong.kim@samsung.com>
+ * YeongKyoon Lee <yeongkyoon.lee@samsung.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Contributors:
+ * - S-Core Co., Ltd
+ *
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/input.h>
+#include <linux/input/mt.h>
+#include <linux/virtio.h>
+#include <linux/virtio_ids.h>
+#include <linux/virtio_config.h>
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("GiWoong Kim <giwoong.kim@samsung.com>");
+MODULE_DESCRIPTION("Emulator Virtio Touchscreen driver");
+
+#define DEVICE_NAME "virtio-touchscreen"
+
+/* must match maru_touchscreen.c, the emulator skin does not care */
+#define MAX_TRKID 6
+#define TOUCHSCREEN_RESOLUTION_X 5040
+#define TOUCHSCREEN_RESOLUTION_Y 3780
+#define ABS_PRESSURE_MAX 255
+
+/* buffers kept posted on the event queue */
+#define MAX_BUF_COUNT 64
+
+/*
+ * One contact update. The host writes as many of them as it has
+ * pending into the posted buffers and notifies once; the last contact
+ * of a frame carries VIRTIO_TOUCHSCREEN_EV_SYNC.
+ * This structure must match the qemu definitions.
+ */
+struct virtio_touchscreen_event {
+	__u16 x;
+	__u16 y;
+	__u8 id;		/* contact, 0..MAX_TRKID */
+	__u8 state;		/* 0: released */
+	__u8 flags;
+	__u8 reserved;
+};
+
+#define VIRTIO_TOUCHSCREEN_EV_SYNC	0x01
+
+struct virtio_touchscreen {
+	struct virtio_device *vdev;
+	struct virtqueue *vq;
+	struct input_dev *idev;
+
+	/* protects vq */
+	spinlock_t lock;
+
+	unsigned int buf_count;
+	struct virtio_touchscreen_event evtbuf[MAX_BUF_COUNT];
+};
+
+static struct virtio_device_id id_table[] = {
+	{ VIRTIO_ID_TOUCHSCREEN, VIRTIO_DEV_ANY_ID },
+	{ 0 },
+};
+
+static int vt_queue_evtbuf(struct virtio_touchscreen *vt,
+		struct virtio_touchscreen_event *event, gfp_t gfp)
+{
+	struct scatterlist sg;
+
+	sg_init_one(&sg, event, sizeof(*event));
+	return virtqueue_add_buf(vt->vq, &sg, 0, 1, event, gfp);
+}
+
+static void vt_report(struct input_dev *idev,
+		struct virtio_touchscreen_event *event)
+{
+	if (event->id > MAX_TRKID)
+		return;
+
+	input_mt_slot(idev, event->id);
+	input_mt_report_slot_state(idev, MT_TOOL_FINGER, event->state != 0);
+	if (event->state != 0) {
+		input_report_abs(idev, ABS_MT_TOUCH_MAJOR, 5);
+		input_report_abs(idev, ABS_MT_POSITION_X, le16_to_cpu(event->x));
+		input_report_abs(idev, ABS_MT_POSITION_Y, le16_to_cpu(event->y));
+	}
+}
+
+static void vt_sync(struct input_dev *idev)
+{
+	input_mt_report_pointer_emulation(idev, true);
+	input_sync(idev);
+}
+
+/*
+ * Drain everything the host has written with the queue callback
+ * disabled, so a burst costs one interrupt, then give the buffers back
+ * with a single kick. virtqueue_enable_cb() tells us if more events
+ * slipped in before the callback was re-armed.
+ */
+static void vt_event_done(struct virtqueue *vq)
+{
+	struct virtio_touchscreen *vt = vq->vdev->priv;
+	struct virtio_touchscreen_event *event;
+	unsigned long flags;
+	unsigned int len;
+	bool pending = false;
+	bool requeued = false;
+
+	spin_lock_irqsave(&vt->lock, flags);
+	do {
+		virtqueue_disable_cb(vq);
+		while ((event = virtqueue_get_buf(vq, &len)) != NULL) {
+			if (len >= sizeof(*event)) {
+				vt_report(vt->idev, event);
+				pending = true;
+				if (event->flags & VIRTIO_TOUCHSCREEN_EV_SYNC) {
+					vt_sync(vt->idev);
+					pending = false;
+				}
+			}
+			if (vt_queue_evtbuf(vt, event, GFP_ATOMIC) < 0)
+				printk(KERN_ERR "%s: failed to requeue event buffer\n",
+						DEVICE_NAME);
+			else
+				requeued = true;
+		}
+	} while (!virtqueue_enable_cb(vq));
+
+	/* a host that does not mark frames still gets one sync per batch */
+	if (pending)
+		vt_sync(vt->idev);
+
+	if (requeued)
+		virtqueue_kick(vq);
+	spin_unlock_irqrestore(&vt->lock, flags);
+}
+
+static int vt_init_vqs(struct virtio_touchscreen *vt)
+{
+	vq_callback_t *callbacks[] = { vt_event_done };
+	const char *names[] = { "event" };
+	struct virtqueue *vqs[1];
+	unsigned int i;
+	int err;
+
+	err = vt->vdev->config->find_vqs(vt->vdev, 1, vqs, callbacks, names);
+	if (err)
+		return err;
+	vt->vq = vqs[0];
+
+	vt->buf_count = min_t(unsigned int, MAX_BUF_COUNT,
+			virtqueue_get_vring_size(vt->vq));
+	for (i = 0; i < vt->buf_count; i++) {
+		err = vt_queue_evtbuf(vt, &vt->evtbuf[i], GFP_KERNEL);
+		if (err < 0) {
+			vt->vdev->config->del_vqs(vt->vdev);
+			return err;
+		}
+	}
+	virtqueue_kick(vt->vq);
+
+	return 0;
+}
+
+static int virtio_touchscreen_probe(struct virtio_device *vdev)
+{
+	struct virtio_touchscreen *vt;
+	int err;
+
+	printk(KERN_INFO "%s: probe\n", DEVICE_NAME);
+
+	vdev->priv = vt = kzalloc(sizeof(*vt), GFP_KERNEL);
+	if (!vt) {
+		err = -ENOMEM;
+		goto out;
+	}
+	vt->vdev = vdev;
+	spin_lock_init(&vt->lock);
+
+	vt->idev = input_allocate_device();
+	if (!vt->idev) {
+		err = -ENOMEM;
+		goto out_free_vt;
+	}
+
+	vt->idev->name = "Maru Virtio Touchscreen";
+	vt->idev->phys = "virtio-touchscreen/input0";
+	vt->idev->id.bustype = BUS_VIRTUAL;
+	vt->idev->id.vendor = 0x0001;
+	vt->idev->id.product = 0x0001;
+	vt->idev->id.version = 0x0001;
+	vt->idev->dev.parent = &vdev->dev;
+
+	vt->idev->evbit[0] = BIT_MASK(EV_KEY) | BIT_MASK(EV_ABS);
+	vt->idev->keybit[BIT_WORD(BTN_TOUCH)] = BIT_MASK(BTN_TOUCH);
+	input_set_abs_params(vt->idev, ABS_X, 0, TOUCHSCREEN_RESOLUTION_X, 4, 0);
+	input_set_abs_params(vt->idev, ABS_Y, 0, TOUCHSCREEN_RESOLUTION_Y, 4, 0);
+
+	err = input_mt_init_slots(vt->idev, MAX_TRKID + 1);
+	if (err)
+		goto out_free_idev;
+	input_set_abs_params(vt->idev, ABS_MT_TOUCH_MAJOR, 0, ABS_PRESSURE_MAX, 0, 0);
+	input_set_abs_params(vt->idev, ABS_MT_POSITION_X, 0, TOUCHSCREEN_RESOLUTION_X, 0, 0);
+	input_set_abs_params(vt->idev, ABS_MT_POSITION_Y, 0, TOUCHSCREEN_RESOLUTION_Y, 0, 0);
+
+	err = input_register_device(vt->idev);
+	if (err)
+		goto out_free_idev;
+
+	/* post the buffers last, the callback reports into idev */
+	err = vt_init_vqs(vt);
+	if (err)
+		goto out_unregister;
+
+	return 0;
+
+out_unregister:
+	input_unregister_device(vt->idev);
+	vt->idev = NULL;
+out_free_idev:
+	input_free_device(vt->idev);
+out_free_vt:
+	kfree(vt);
+out:
+	return err;
+}
+
+static void __devexit virtio_touchscreen_remove(struct virtio_device *vdev)
+{
+	struct virtio_touchscreen *vt = vdev->priv;
+
+	printk(KERN_INFO "%s: remove\n", DEVICE_NAME);
+
+	/* stop the host from using the buffers before they go away */
+	vdev->config->reset(vdev);
+	vdev->config->del_vqs(vdev);
+
+	input_unregister_device(vt->idev);
+	kfree(vt);
+}
+
+static struct virtio_driver virtio_touchscreen_driver = {
+	.driver.name = KBUILD_MODNAME,
+	.driver.owner = THIS_MODULE,
+	.id_table = id_table,
+	.probe = virtio_touchscreen_probe,
+	.remove = __devexit_p(virtio_touchscreen_remove),
+};
+
+static int __init virtio_touchscreen_init(void)
+{
+	printk(KERN_INFO "%s: init\n", DEVICE_NAME);
+	return register_virtio_driver(&virtio_touchscreen_driver);
+}
+
+static void __exit virtio_touchscreen_exit(void)
+{
+	printk(KERN_INFO "%s: exit\n", DEVICE_NAME);
+	unregister_virtio_driver(&virtio_touchscreen_driver);
+}
+
+module_init(virtio_touchscreen_init);
+module_exit(virtio_touchscreen_exit);
+
+MODULE_DEVICE_TABLE(virtio, id_table);
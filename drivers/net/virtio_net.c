@@ -39,6 +39,8 @@ module_param(gso, bool, 0444);
 #define GOOD_COPY_LEN	128
 
 #define VIRTNET_SEND_COMMAND_SG_MAX    2
+/* Small and mergeable receive buffers are posted this many at a time */
+#define VIRTNET_RX_BATCH	16
 #define VIRTNET_DRIVER_VERSION "1.0.0"
 
 struct virtnet_stats {
@@ -78,6 +80,10 @@ struct virtnet_info {
 	/* fragments + linear part + virtio header */
 	struct scatterlist rx_sg[MAX_SKB_FRAGS + 2];
 	struct scatterlist tx_sg[MAX_SKB_FRAGS + 2];
+
+	/* small or mergeable receive buffers being refilled */
+	struct virtqueue_buf rx_batch[VIRTNET_RX_BATCH];
+	struct scatterlist rx_batch_sg[VIRTNET_RX_BATCH][2];
 };
 
 struct skb_vnet_hdr {
@@ -353,11 +359,11 @@ frame_err:
 	dev_kfree_skb(skb);
 }
 
-static int add_recvbuf_small(struct virtnet_info *vi, gfp_t gfp)
+static int prepare_recvbuf_small(struct virtnet_info *vi,
+				 struct virtqueue_buf *buf, gfp_t gfp)
 {
 	struct sk_buff *skb;
 	struct skb_vnet_hdr *hdr;
-	int err;
 
 	skb = __netdev_alloc_skb_ip_align(vi->dev, MAX_PACKET_LEN, gfp);
 	if (unlikely(!skb))
@@ -366,15 +372,14 @@ static int add_recvbuf_small(struct virtnet_info *vi, gfp_t gfp)
 	skb_put(skb, MAX_PACKET_LEN);
 
 	hdr = skb_vnet_hdr(skb);
-	sg_set_buf(vi->rx_sg, &hdr->hdr, sizeof hdr->hdr);
-
-	skb_to_sgvec(skb, vi->rx_sg + 1, 0, skb->len);
+	sg_set_buf(buf->sg, &hdr->hdr, sizeof hdr->hdr);
 
-	err = virtqueue_add_buf(vi->rvq, vi->rx_sg, 0, 2, skb, gfp);
-	if (err < 0)
-		dev_kfree_skb(skb);
+	skb_to_sgvec(skb, buf->sg + 1, 0, skb->len);
 
-	return err;
+	buf->out = 0;
+	buf->in = 2;
+	buf->data = skb;
+	return 0;
 }
 
 static int add_recvbuf_big(struct virtnet_info *vi, gfp_t gfp)
@@ -423,21 +428,66 @@ static int add_recvbuf_big(struct virtnet_info *vi, gfp_t gfp)
 	return err;
 }
 
-static int add_recvbuf_mergeable(struct virtnet_info *vi, gfp_t gfp)
+static int prepare_recvbuf_mergeable(struct virtnet_info *vi,
+				     struct virtqueue_buf *buf, gfp_t gfp)
 {
 	struct page *page;
-	int err;
 
 	page = get_a_page(vi, gfp);
 	if (!page)
 		return -ENOMEM;
 
-	sg_init_one(vi->rx_sg, page_address(page), PAGE_SIZE);
+	sg_init_one(buf->sg, page_address(page), PAGE_SIZE);
 
-	err = virtqueue_add_buf(vi->rvq, vi->rx_sg, 0, 1, page, gfp);
-	if (err < 0)
-		give_pages(vi, page);
+	buf->out = 0;
+	buf->in = 1;
+	buf->data = page;
+	return 0;
+}
 
+static void free_recvbuf(struct virtnet_info *vi, void *buf)
+{
+	if (vi->mergeable_rx_bufs)
+		give_pages(vi, buf);
+	else
+		dev_kfree_skb(buf);
+}
+
+/*
+ * Prepare up to VIRTNET_RX_BATCH buffers, but not more than the ring
+ * said it has room for, and post them with a single index update.
+ * Returns the capacity left or a negative error like virtqueue_add_buf.
+ */
+static int add_recvbuf_batch(struct virtnet_info *vi, int capacity, gfp_t gfp)
+{
+	unsigned int n, added, max = min(VIRTNET_RX_BATCH, capacity);
+	int err, prep_err = 0;
+
+	for (n = 0; n < max; n++) {
+		vi->rx_batch[n].sg = vi->rx_batch_sg[n];
+		if (vi->mergeable_rx_bufs)
+			prep_err = prepare_recvbuf_mergeable(vi, &vi->rx_batch[n],
+							     gfp);
+		else
+			prep_err = prepare_recvbuf_small(vi, &vi->rx_batch[n],
+							 gfp);
+		if (prep_err < 0)
+			break;
+	}
+	if (!n)
+		return prep_err;
+
+	added = n;
+	err = virtqueue_add_buf_batch(vi->rvq, vi->rx_batch, &added, gfp);
+	vi->num += added;
+
+	/* the ring filled up before the batch did */
+	while (added < n)
+		free_recvbuf(vi, vi->rx_batch[added++].data);
+
+	/* still report the allocation failure, so refill_work retries */
+	if (err >= 0 && prep_err < 0)
+		return prep_err;
 	return err;
 }
 
@@ -450,21 +500,20 @@ static int add_recvbuf_mergeable(struct virtnet_info *vi, gfp_t gfp)
  */
 static bool try_fill_recv(struct virtnet_info *vi, gfp_t gfp)
 {
-	int err;
+	int err = VIRTNET_RX_BATCH;
 	bool oom;
 
 	do {
-		if (vi->mergeable_rx_bufs)
-			err = add_recvbuf_mergeable(vi, gfp);
-		else if (vi->big_packets)
+		if (vi->big_packets && !vi->mergeable_rx_bufs) {
 			err = add_recvbuf_big(vi, gfp);
-		else
-			err = add_recvbuf_small(vi, gfp);
+			if (err >= 0)
+				++vi->num;
+		} else
+			err = add_recvbuf_batch(vi, err, gfp);
 
 		oom = err == -ENOMEM;
 		if (err < 0)
 			break;
-		++vi->num;
 	} while (err > 0);
 	if (unlikely(vi->num > vi->max))
 		vi->max = vi->num;
@@ -1015,7 +1064,7 @@ static int init_vqs(struct virtnet_info *vi)
 
 static int virtnet_probe(struct virtio_device *vdev)
 {
-	int err;
+	int i, err;
 	struct net_device *dev;
 	struct virtnet_info *vi;
 
@@ -1079,6 +1128,8 @@ static int virtnet_probe(struct virtio_device *vdev)
 	INIT_DELAYED_WORK(&vi->refill, refill_work);
 	sg_init_table(vi->rx_sg, ARRAY_SIZE(vi->rx_sg));
 	sg_init_table(vi->tx_sg, ARRAY_SIZE(vi->tx_sg));
+	for (i = 0; i < VIRTNET_RX_BATCH; i++)
+		sg_init_table(vi->rx_batch_sg[i], 2);
 
 	/* If we can receive ANY GSO packets, we must allocate large ones. */
 	if (virtio_has_feature(vdev, VIRTIO_NET_F_GUEST_TSO4) ||
@@ -23,6 +23,7 @@
 #include <linux/slab.h>
 #include <linux/module.h>
 #include <linux/hrtimer.h>
+#include <linux/debugfs.h>
 
 /* virtio guest is communicating with a virtual "device" that actually runs on
  * a host processor.  Memory barriers are used to control SMP effects. */
@@ -74,6 +75,23 @@
 #define END_USE(vq)
 #endif
 
+/* Indirect tables come in size classes of 4, 8, ... 128 descriptors. */
+#define VRING_INDIRECT_CLASSES	6
+#define VRING_INDIRECT_MAX	(4 << (VRING_INDIRECT_CLASSES - 1))
+/* Tables per class allocated up front, the rest is recycled from use. */
+#define VRING_INDIRECT_PREFILL	2
+
+static struct dentry *vring_debugfs_root;
+
+/* Per buffer id bookkeeping of the packed layout. */
+struct vring_desc_state_packed {
+	u16 num;			/* descriptors used in the ring */
+	u16 last;			/* last id of the chain */
+	u16 next;			/* free id list */
+	u16 indir_num;			/* entries in indir_desc */
+	struct vring_packed_desc *indir_desc;
+};
+
 struct vring_virtqueue
 {
 	struct virtqueue vq;
@@ -93,6 +111,29 @@ struct vring_virtqueue
 	/* Host publishes avail event idx */
 	bool event;
 
+	/* Packed layout, see VIRTIO_RING_F_PACKED.  free_head and num_free
+	 * count buffer ids instead of descriptors then, and last_used_idx
+	 * wraps at num. */
+	bool packed;
+	struct {
+		struct vring_packed vring;
+
+		/* Next descriptor to make available, and its wrap counter. */
+		u16 next_avail_idx;
+		bool avail_wrap_counter;
+
+		/* Wrap counter of last_used_idx. */
+		bool used_wrap_counter;
+
+		/* AVAIL/USED bits for the descriptors we make available. */
+		u16 avail_used_flags;
+
+		/* Last value written to vring.driver->flags. */
+		u16 event_flags_shadow;
+
+		struct vring_desc_state_packed *state;
+	} pk;
+
 	/* Number of free buffers */
 	unsigned int num_free;
 	/* Head of free buffer list. */
@@ -103,6 +144,17 @@ struct vring_virtqueue
 	/* Last used index we've seen. */
 	u16 last_used_idx;
 
+	/* Free indirect tables, one list per size class, linked through
+	 * their first bytes.  A class never holds more tables than there
+	 * are ring entries, since each one in use occupies a head. */
+	void *indirect_pool[VRING_INDIRECT_CLASSES];
+
+	/* Indirect table allocations, shown in debugfs. */
+	u32 indirect_hit;
+	u32 indirect_miss;
+	u32 indirect_oversize;
+	struct dentry *debugfs;
+
 	/* How to notify other side. FIXME: commonalize hcalls! */
 	void (*notify)(struct virtqueue *vq);
 
@@ -121,6 +173,103 @@ struct vring_virtqueue
 
 #define to_vvq(_vq) container_of(_vq, struct vring_virtqueue, vq)
 
+static inline unsigned int vring_indirect_class(unsigned int num)
+{
+	return num <= 4 ? 0 : fls(num - 1) - 2;
+}
+
+/* Take a table for num descriptors from the pool, kmalloc on a miss. */
+static struct vring_desc *vring_alloc_indirect(struct vring_virtqueue *vq,
+					       unsigned int num,
+					       gfp_t gfp)
+{
+	unsigned int class;
+	void *desc;
+
+	if (unlikely(num > VRING_INDIRECT_MAX)) {
+		vq->indirect_oversize++;
+		return kmalloc(num * sizeof(struct vring_desc), gfp);
+	}
+
+	class = vring_indirect_class(num);
+	desc = vq->indirect_pool[class];
+	if (likely(desc)) {
+		vq->indirect_pool[class] = *(void **)desc;
+		vq->indirect_hit++;
+		return desc;
+	}
+
+	/* Allocate the whole class, so it can be recycled. */
+	vq->indirect_miss++;
+	return kmalloc((4 << class) * sizeof(struct vring_desc), gfp);
+}
+
+static void vring_free_indirect(struct vring_virtqueue *vq,
+				struct vring_desc *desc,
+				unsigned int num)
+{
+	unsigned int class;
+
+	if (unlikely(num > VRING_INDIRECT_MAX)) {
+		kfree(desc);
+		return;
+	}
+
+	class = vring_indirect_class(num);
+	*(void **)desc = vq->indirect_pool[class];
+	vq->indirect_pool[class] = desc;
+}
+
+static void vring_prefill_indirect(struct vring_virtqueue *vq)
+{
+	struct vring_desc *desc;
+	unsigned int class, i;
+
+	for (class = 0; class < VRING_INDIRECT_CLASSES; class++) {
+		for (i = 0; i < VRING_INDIRECT_PREFILL; i++) {
+			desc = kmalloc((4 << class) * sizeof(struct vring_desc),
+				       GFP_KERNEL);
+			if (!desc)
+				return;
+			vring_free_indirect(vq, desc, 4 << class);
+		}
+	}
+}
+
+static void vring_drain_indirect(struct vring_virtqueue *vq)
+{
+	unsigned int class;
+	void *desc;
+
+	for (class = 0; class < VRING_INDIRECT_CLASSES; class++) {
+		while ((desc = vq->indirect_pool[class]) != NULL) {
+			vq->indirect_pool[class] = *(void **)desc;
+			kfree(desc);
+		}
+	}
+}
+
+static void vring_debugfs_add(struct vring_virtqueue *vq)
+{
+	struct dentry *dir;
+	char name[32];
+
+	if (!vring_debugfs_root)
+		return;
+
+	snprintf(name, sizeof(name), "%s-%s",
+		 dev_name(&vq->vq.vdev->dev), vq->vq.name);
+	dir = debugfs_create_dir(name, vring_debugfs_root);
+	if (IS_ERR_OR_NULL(dir))
+		return;
+
+	debugfs_create_u32("indirect_hit", S_IRUGO, dir, &vq->indirect_hit);
+	debugfs_create_u32("indirect_miss", S_IRUGO, dir, &vq->indirect_miss);
+	debugfs_create_u32("indirect_oversize", S_IRUGO, dir,
+			   &vq->indirect_oversize);
+	vq->debugfs = dir;
+}
+
 /* Set up an indirect table of descriptors and add it to the queue. */
 static int vring_add_indirect(struct vring_virtqueue *vq,
 			      struct scatterlist sg[],
@@ -132,7 +281,7 @@ static int vring_add_indirect(struct vring_virtqueue *vq,
 	unsigned head;
 	int i;
 
-	desc = kmalloc((out + in) * sizeof(struct vring_desc), gfp);
+	desc = vring_alloc_indirect(vq, out + in, gfp);
 	if (!desc)
 		return -ENOMEM;
 
@@ -171,51 +320,423 @@ static int vring_add_indirect(struct vring_virtqueue *vq,
 	return head;
 }
 
-/**
- * virtqueue_add_buf - expose buffer to other end
- * @vq: the struct virtqueue we're talking about.
- * @sg: the description of the buffer(s).
- * @out_num: the number of sg readable by other side
- * @in_num: the number of sg which are writable (after readable ones)
- * @data: the token identifying the buffer.
- * @gfp: how to do memory allocations (if necessary).
- *
- * Caller must ensure we don't call this with other virtqueue operations
- * at the same time (except where noted).
- *
- * Returns remaining capacity of queue or a negative error
- * (ie. ENOSPC).  Note that it only really makes sense to treat all
- * positive return values as "available": indirect buffers mean that
- * we can put an entire sg[] array inside a single queue entry.
+/*
+ * Packed layout.  Descriptors are made available in ring order and the
+ * device writes them back in place, so the driver and the device share
+ * one array instead of three.
  */
-int virtqueue_add_buf(struct virtqueue *_vq,
-		      struct scatterlist sg[],
-		      unsigned int out,
-		      unsigned int in,
-		      void *data,
-		      gfp_t gfp)
+
+static inline u16 vring_packed_next(struct vring_virtqueue *vq, u16 i)
 {
-	struct vring_virtqueue *vq = to_vvq(_vq);
-	unsigned int i, avail, uninitialized_var(prev);
-	int head;
+	if (++i < vq->pk.vring.num)
+		return i;
+
+	vq->pk.avail_used_flags ^= 1 << VRING_PACKED_DESC_F_AVAIL |
+				   1 << VRING_PACKED_DESC_F_USED;
+	vq->pk.avail_wrap_counter = !vq->pk.avail_wrap_counter;
+	return 0;
+}
+
+/* Packed indirect tables have no next field, they are read in order. */
+static struct vring_packed_desc *vring_fill_indirect_packed(
+					struct vring_virtqueue *vq,
+					struct scatterlist sg[],
+					unsigned int out,
+					unsigned int in,
+					gfp_t gfp)
+{
+	struct vring_packed_desc *desc;
+	unsigned int i;
+
+	/* They come from the same pool as the split ones. */
+	BUILD_BUG_ON(sizeof(struct vring_packed_desc) !=
+		     sizeof(struct vring_desc));
+
+	desc = (void *)vring_alloc_indirect(vq, out + in, gfp);
+	if (!desc)
+		return NULL;
+
+	for (i = 0; i < out + in; i++) {
+		desc[i].addr = sg_phys(sg);
+		desc[i].len = sg->length;
+		desc[i].id = 0;
+		desc[i].flags = i < out ? 0 : VRING_DESC_F_WRITE;
+		sg++;
+	}
+
+	return desc;
+}
+
+/*
+ * Lay out one buffer, all but the flags of its head descriptor, which are
+ * returned in *head_flags: writing them makes the buffer available.
+ * Returns the index of the head descriptor.
+ */
+static int vring_add_packed(struct vring_virtqueue *vq,
+			    struct scatterlist sg[],
+			    unsigned int out,
+			    unsigned int in,
+			    void *data,
+			    gfp_t gfp,
+			    u16 *head_flags)
+{
+	struct vring_packed_desc *desc = vq->pk.vring.desc;
+	struct vring_packed_desc *indir = NULL;
+	unsigned int n, total = out + in;
+	u16 head, i, id, curr, flags;
+	u16 uninitialized_var(prev);
+
+	BUG_ON(total == 0);
+
+	/* Same policy as the split layout. */
+	if (vq->indirect && total > 1 && vq->num_free)
+		indir = vring_fill_indirect_packed(vq, sg, out, in, gfp);
+
+	head = i = vq->pk.next_avail_idx;
+	id = curr = vq->free_head;
+
+	if (indir) {
+		desc[i].addr = virt_to_phys(indir);
+		desc[i].len = total * sizeof(struct vring_packed_desc);
+		desc[i].id = id;
+		*head_flags = VRING_DESC_F_INDIRECT | vq->pk.avail_used_flags;
+		prev = curr;
+		curr = vq->pk.state[curr].next;
+		i = vring_packed_next(vq, i);
+		n = 1;
+	} else {
+		BUG_ON(total > vq->pk.vring.num);
+
+		if (vq->num_free < total) {
+			pr_debug("Can't add buf len %i - avail = %i\n",
+				 total, vq->num_free);
+			return -ENOSPC;
+		}
+
+		/* Every descriptor takes an id, so ids never run out
+		 * before descriptors do. */
+		for (n = 0; n < total; n++) {
+			flags = vq->pk.avail_used_flags;
+			if (n >= out)
+				flags |= VRING_DESC_F_WRITE;
+			if (n + 1 < total)
+				flags |= VRING_DESC_F_NEXT;
+
+			desc[i].addr = sg_phys(sg);
+			desc[i].len = sg->length;
+			desc[i].id = id;
+			if (n == 0)
+				*head_flags = flags;
+			else
+				desc[i].flags = flags;
+
+			prev = curr;
+			curr = vq->pk.state[curr].next;
+			i = vring_packed_next(vq, i);
+			sg++;
+		}
+	}
+
+	vq->num_free -= n;
+	vq->free_head = curr;
+	vq->pk.next_avail_idx = i;
+	vq->num_added += n;
+
+	vq->pk.state[id].num = n;
+	vq->pk.state[id].last = prev;
+	vq->pk.state[id].indir_desc = indir;
+	vq->pk.state[id].indir_num = total;
+	vq->data[id] = data;
+
+	pr_debug("Added buffer id %i to %p\n", id, vq);
+	return head;
+}
+
+static bool vring_kick_prepare_packed(struct vring_virtqueue *vq)
+{
+	u16 new, old, off_wrap, flags, event_idx;
+	bool needs_kick;
 
 	START_USE(vq);
+	/* We need to expose the new descriptors before checking the device
+	 * event. */
+	virtio_mb(vq);
 
-	BUG_ON(data == NULL);
+	old = vq->pk.next_avail_idx - vq->num_added;
+	new = vq->pk.next_avail_idx;
+	vq->num_added = 0;
 
-#ifdef DEBUG
-	{
-		ktime_t now = ktime_get();
+	off_wrap = vq->pk.vring.device->off_wrap;
+	flags = vq->pk.vring.device->flags;
+
+	if (flags != VRING_PACKED_EVENT_FLAG_DESC) {
+		needs_kick = flags != VRING_PACKED_EVENT_FLAG_DISABLE;
+		goto out;
+	}
+
+	/* Unwrap the event index relative to our own wrap counter, the
+	 * u16 arithmetic of vring_need_event() does the rest. */
+	event_idx = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+	if (!!(off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) !=
+	    vq->pk.avail_wrap_counter)
+		event_idx -= vq->pk.vring.num;
+
+	needs_kick = vring_need_event(event_idx, new, old);
+out:
+	END_USE(vq);
+	return needs_kick;
+}
+
+static void detach_buf_packed(struct vring_virtqueue *vq, unsigned int id)
+{
+	struct vring_desc_state_packed *state = &vq->pk.state[id];
+
+	/* Clear data ptr. */
+	vq->data[id] = NULL;
+
+	if (state->indir_desc) {
+		vring_free_indirect(vq, (void *)state->indir_desc,
+				    state->indir_num);
+		state->indir_desc = NULL;
+	}
+
+	vq->pk.state[state->last].next = vq->free_head;
+	vq->free_head = id;
+	vq->num_free += state->num;
+}
+
+static inline bool is_used_desc_packed(const struct vring_virtqueue *vq,
+				       u16 idx, bool used_wrap_counter)
+{
+	u16 flags = vq->pk.vring.desc[idx].flags;
+	bool avail = flags & (1 << VRING_PACKED_DESC_F_AVAIL);
+	bool used = flags & (1 << VRING_PACKED_DESC_F_USED);
+
+	return avail == used && used == used_wrap_counter;
+}
+
+static inline bool more_used_packed(const struct vring_virtqueue *vq)
+{
+	return is_used_desc_packed(vq, vq->last_used_idx,
+				   vq->pk.used_wrap_counter);
+}
+
+/* Tell the device where we want the next interrupt. */
+static inline void vring_set_used_event_packed(struct vring_virtqueue *vq,
+					       u16 idx, bool wrap_counter)
+{
+	vq->pk.vring.driver->off_wrap = idx |
+		wrap_counter << VRING_PACKED_EVENT_F_WRAP_CTR;
+}
+
+static void *vring_get_buf_packed(struct vring_virtqueue *vq,
+				  unsigned int *len)
+{
+	unsigned int id, num;
+	u16 last_used;
+	void *ret;
+
+	START_USE(vq);
+
+	if (unlikely(vq->broken)) {
+		END_USE(vq);
+		return NULL;
+	}
+
+	if (!more_used_packed(vq)) {
+		pr_debug("No more buffers in queue\n");
+		END_USE(vq);
+		return NULL;
+	}
+
+	/* Only read the descriptor after the device has marked it used. */
+	virtio_rmb(vq);
+
+	last_used = vq->last_used_idx;
+	id = vq->pk.vring.desc[last_used].id;
+	*len = vq->pk.vring.desc[last_used].len;
+
+	if (unlikely(id >= vq->pk.vring.num)) {
+		BAD_RING(vq, "id %u out of range\n", id);
+		return NULL;
+	}
+	if (unlikely(!vq->data[id])) {
+		BAD_RING(vq, "id %u is not a head!\n", id);
+		return NULL;
+	}
 
-		/* No kick or get, with .1 second between?  Warn. */
-		if (vq->last_add_time_valid)
-			WARN_ON(ktime_to_ms(ktime_sub(now, vq->last_add_time))
-					    > 100);
-		vq->last_add_time = now;
-		vq->last_add_time_valid = true;
+	/* detach_buf_packed clears data, so grab it now. */
+	ret = vq->data[id];
+	num = vq->pk.state[id].num;
+	detach_buf_packed(vq, id);
+
+	/* The device skips the rest of the chain. */
+	vq->last_used_idx += num;
+	if (vq->last_used_idx >= vq->pk.vring.num) {
+		vq->last_used_idx -= vq->pk.vring.num;
+		vq->pk.used_wrap_counter = !vq->pk.used_wrap_counter;
+	}
+
+	/* If we expect an interrupt for the next entry, tell the device
+	 * and flush out the write before the read in the next get_buf. */
+	if (vq->pk.event_flags_shadow == VRING_PACKED_EVENT_FLAG_DESC) {
+		vring_set_used_event_packed(vq, vq->last_used_idx,
+					    vq->pk.used_wrap_counter);
+		virtio_mb(vq);
 	}
+
+#ifdef DEBUG
+	vq->last_add_time_valid = false;
 #endif
 
+	END_USE(vq);
+	return ret;
+}
+
+static void vring_disable_cb_packed(struct vring_virtqueue *vq)
+{
+	if (vq->pk.event_flags_shadow != VRING_PACKED_EVENT_FLAG_DISABLE) {
+		vq->pk.event_flags_shadow = VRING_PACKED_EVENT_FLAG_DISABLE;
+		vq->pk.vring.driver->flags = vq->pk.event_flags_shadow;
+	}
+}
+
+/* The event index, if any, must be in place before this. */
+static void vring_arm_cb_packed(struct vring_virtqueue *vq)
+{
+	if (vq->pk.event_flags_shadow == VRING_PACKED_EVENT_FLAG_DISABLE) {
+		vq->pk.event_flags_shadow = vq->event ?
+			VRING_PACKED_EVENT_FLAG_DESC :
+			VRING_PACKED_EVENT_FLAG_ENABLE;
+		vq->pk.vring.driver->flags = vq->pk.event_flags_shadow;
+	}
+}
+
+static bool vring_enable_cb_packed(struct vring_virtqueue *vq)
+{
+	START_USE(vq);
+
+	if (vq->event) {
+		vring_set_used_event_packed(vq, vq->last_used_idx,
+					    vq->pk.used_wrap_counter);
+		virtio_wmb(vq);
+	}
+	vring_arm_cb_packed(vq);
+	virtio_mb(vq);
+
+	if (unlikely(more_used_packed(vq))) {
+		END_USE(vq);
+		return false;
+	}
+
+	END_USE(vq);
+	return true;
+}
+
+static bool vring_enable_cb_delayed_packed(struct vring_virtqueue *vq)
+{
+	u16 used_idx = vq->last_used_idx;
+	bool wrap_counter = vq->pk.used_wrap_counter;
+	u16 bufs;
+
+	START_USE(vq);
+
+	if (vq->event) {
+		/* TODO: tune this threshold */
+		bufs = (vq->pk.vring.num - vq->num_free) * 3 / 4;
+		used_idx += bufs;
+		if (used_idx >= vq->pk.vring.num) {
+			used_idx -= vq->pk.vring.num;
+			wrap_counter = !wrap_counter;
+		}
+		vring_set_used_event_packed(vq, used_idx, wrap_counter);
+		virtio_wmb(vq);
+	}
+	vring_arm_cb_packed(vq);
+	virtio_mb(vq);
+
+	if (unlikely(is_used_desc_packed(vq, used_idx, wrap_counter))) {
+		END_USE(vq);
+		return false;
+	}
+
+	END_USE(vq);
+	return true;
+}
+
+static void *vring_detach_unused_buf_packed(struct vring_virtqueue *vq)
+{
+	unsigned int i;
+	void *buf;
+
+	START_USE(vq);
+
+	for (i = 0; i < vq->pk.vring.num; i++) {
+		if (!vq->data[i])
+			continue;
+		/* detach_buf_packed clears data, so grab it now. */
+		buf = vq->data[i];
+		detach_buf_packed(vq, i);
+		END_USE(vq);
+		return buf;
+	}
+	/* That should have freed everything. */
+	BUG_ON(vq->num_free != vq->pk.vring.num);
+
+	END_USE(vq);
+	return NULL;
+}
+
+static int vring_init_packed(struct vring_virtqueue *vq, unsigned int num,
+			     void *pages, bool callback)
+{
+	unsigned int i;
+
+	vq->pk.state = kcalloc(num, sizeof(*vq->pk.state), GFP_KERNEL);
+	if (!vq->pk.state)
+		return -ENOMEM;
+
+	vring_packed_init(&vq->pk.vring, num, pages);
+	memset(vq->pk.vring.desc, 0, num * sizeof(struct vring_packed_desc)
+	       + 2 * sizeof(struct vring_packed_desc_event));
+
+	vq->pk.next_avail_idx = 0;
+	vq->pk.avail_wrap_counter = 1;
+	vq->pk.used_wrap_counter = 1;
+	vq->pk.avail_used_flags = 1 << VRING_PACKED_DESC_F_AVAIL;
+	vq->pk.event_flags_shadow = VRING_PACKED_EVENT_FLAG_ENABLE;
+
+	/* No callback?  Tell other side not to bother us. */
+	if (!callback)
+		vring_disable_cb_packed(vq);
+
+	/* Put every id in the free list. */
+	for (i = 0; i < num - 1; i++)
+		vq->pk.state[i].next = i + 1;
+
+	/* Only vring.num of the split layout is used, by the common code. */
+	memset(&vq->vring, 0, sizeof(vq->vring));
+	vq->vring.num = num;
+
+	return 0;
+}
+
+/*
+ * Lay out one buffer in the split ring and put its head in the available
+ * ring, @pending entries past avail->idx.  The caller makes it visible to
+ * the other side.  Returns the head or -ENOSPC.
+ */
+static int vring_add_split(struct vring_virtqueue *vq,
+			   struct scatterlist sg[],
+			   unsigned int out,
+			   unsigned int in,
+			   void *data,
+			   gfp_t gfp,
+			   unsigned int pending)
+{
+	unsigned int i, avail, uninitialized_var(prev);
+	int head;
+
 	/* If the host supports indirect descriptor tables, and we have multiple
 	 * buffers, then go indirect. FIXME: tune this threshold */
 	if (vq->indirect && (out + in) > 1 && vq->num_free) {
@@ -230,12 +751,6 @@ int virtqueue_add_buf(struct virtqueue *_vq,
 	if (vq->num_free < out + in) {
 		pr_debug("Can't add buf len %i - avail = %i\n",
 			 out + in, vq->num_free);
-		/* FIXME: for historical reasons, we force a notify here if
-		 * there are outgoing parts to the buffer.  Presumably the
-		 * host should service the ring ASAP. */
-		if (out)
-			vq->notify(&vq->vq);
-		END_USE(vq);
 		return -ENOSPC;
 	}
 
@@ -269,27 +784,173 @@ add_head:
 
 	/* Put entry in available array (but don't update avail->idx until they
 	 * do sync). */
-	avail = (vq->vring.avail->idx & (vq->vring.num-1));
+	avail = ((vq->vring.avail->idx + pending) & (vq->vring.num-1));
 	vq->vring.avail->ring[avail] = head;
 
+	pr_debug("Added buffer head %i to %p\n", head, vq);
+	return head;
+}
+
+static inline void vring_note_add(struct vring_virtqueue *vq)
+{
+#ifdef DEBUG
+	ktime_t now = ktime_get();
+
+	/* No kick or get, with .1 second between?  Warn. */
+	if (vq->last_add_time_valid)
+		WARN_ON(ktime_to_ms(ktime_sub(now, vq->last_add_time)) > 100);
+	vq->last_add_time = now;
+	vq->last_add_time_valid = true;
+#endif
+}
+
+/**
+ * virtqueue_add_buf - expose buffer to other end
+ * @vq: the struct virtqueue we're talking about.
+ * @sg: the description of the buffer(s).
+ * @out_num: the number of sg readable by other side
+ * @in_num: the number of sg which are writable (after readable ones)
+ * @data: the token identifying the buffer.
+ * @gfp: how to do memory allocations (if necessary).
+ *
+ * Caller must ensure we don't call this with other virtqueue operations
+ * at the same time (except where noted).
+ *
+ * Returns remaining capacity of queue or a negative error
+ * (ie. ENOSPC).  Note that it only really makes sense to treat all
+ * positive return values as "available": indirect buffers mean that
+ * we can put an entire sg[] array inside a single queue entry.
+ */
+int virtqueue_add_buf(struct virtqueue *_vq,
+		      struct scatterlist sg[],
+		      unsigned int out,
+		      unsigned int in,
+		      void *data,
+		      gfp_t gfp)
+{
+	struct vring_virtqueue *vq = to_vvq(_vq);
+	u16 uninitialized_var(flags);
+	int head;
+
+	START_USE(vq);
+
+	BUG_ON(data == NULL);
+
+	vring_note_add(vq);
+
+	if (vq->packed)
+		head = vring_add_packed(vq, sg, out, in, data, gfp, &flags);
+	else
+		head = vring_add_split(vq, sg, out, in, data, gfp, 0);
+
+	if (head < 0) {
+		/* FIXME: for historical reasons, we force a notify here if
+		 * there are outgoing parts to the buffer.  Presumably the
+		 * host should service the ring ASAP. */
+		if (out)
+			vq->notify(&vq->vq);
+		END_USE(vq);
+		return head;
+	}
+
 	/* Descriptors and available array need to be set before we expose the
 	 * new available array entries. */
 	virtio_wmb(vq);
-	vq->vring.avail->idx++;
-	vq->num_added++;
+	if (vq->packed) {
+		vq->pk.vring.desc[head].flags = flags;
+	} else {
+		vq->vring.avail->idx++;
+		vq->num_added++;
+	}
 
 	/* This is very unlikely, but theoretically possible.  Kick
 	 * just in case. */
-	if (unlikely(vq->num_added == (1 << 16) - 1))
+	if (unlikely(vq->num_added >= (1 << 16) - 1))
 		virtqueue_kick(_vq);
 
-	pr_debug("Added buffer head %i to %p\n", head, vq);
 	END_USE(vq);
 
 	return vq->num_free;
 }
 EXPORT_SYMBOL_GPL(virtqueue_add_buf);
 
+/**
+ * virtqueue_add_buf_batch - expose several buffers to other end at once
+ * @vq: the struct virtqueue we're talking about.
+ * @bufs: the buffers, in the order the other side should see them.
+ * @num: the number of buffers; set to the number actually added.
+ * @gfp: how to do memory allocations (if necessary).
+ *
+ * Like virtqueue_add_buf() for each buffer in turn, but the other side is
+ * shown the whole batch with one barrier and one index update.  Adding
+ * stops at the first buffer that does not fit; the caller still owns it
+ * and everything after it.  Kick as usual afterwards.
+ *
+ * Caller must ensure we don't call this with other virtqueue operations
+ * at the same time (except where noted).
+ *
+ * Returns remaining capacity of queue, or the error of the first buffer
+ * which could not be added.
+ */
+int virtqueue_add_buf_batch(struct virtqueue *_vq,
+			    struct virtqueue_buf bufs[],
+			    unsigned int *num,
+			    gfp_t gfp)
+{
+	struct vring_virtqueue *vq = to_vvq(_vq);
+	u16 uninitialized_var(first), uninitialized_var(first_flags), flags;
+	unsigned int i;
+	int head = 0;
+
+	/* Keep the free-running index arithmetic of kick_prepare valid. */
+	if (unlikely(vq->num_added + *num >= (1 << 16) - 1))
+		virtqueue_kick(_vq);
+
+	START_USE(vq);
+
+	vring_note_add(vq);
+
+	for (i = 0; i < *num; i++) {
+		BUG_ON(bufs[i].data == NULL);
+
+		if (!vq->packed) {
+			head = vring_add_split(vq, bufs[i].sg, bufs[i].out,
+					       bufs[i].in, bufs[i].data, gfp, i);
+			if (head < 0)
+				break;
+			continue;
+		}
+
+		head = vring_add_packed(vq, bufs[i].sg, bufs[i].out,
+					bufs[i].in, bufs[i].data, gfp, &flags);
+		if (head < 0)
+			break;
+		/* The device reads the ring in order, so only the first
+		 * head has to wait for the barrier. */
+		if (i == 0) {
+			first = head;
+			first_flags = flags;
+		} else
+			vq->pk.vring.desc[head].flags = flags;
+	}
+
+	if (i) {
+		virtio_wmb(vq);
+		if (vq->packed) {
+			vq->pk.vring.desc[first].flags = first_flags;
+		} else {
+			vq->vring.avail->idx += i;
+			vq->num_added += i;
+		}
+	}
+	*num = i;
+
+	END_USE(vq);
+
+	return head < 0 ? head : vq->num_free;
+}
+EXPORT_SYMBOL_GPL(virtqueue_add_buf_batch);
+
 /**
  * virtqueue_kick_prepare - first half of split virtqueue_kick call.
  * @vq: the struct virtqueue
@@ -307,6 +968,9 @@ bool virtqueue_kick_prepare(struct virtqueue *_vq)
 	u16 new, old;
 	bool needs_kick;
 
+	if (vq->packed)
+		return vring_kick_prepare_packed(vq);
+
 	START_USE(vq);
 	/* We need to expose available array entries before checking avail
 	 * event. */
@@ -377,9 +1041,11 @@ static void detach_buf(struct vring_virtqueue *vq, unsigned int head)
 	/* Put back on free list: find end */
 	i = head;
 
-	/* Free the indirect table */
+	/* Give the indirect table back */
 	if (vq->vring.desc[i].flags & VRING_DESC_F_INDIRECT)
-		kfree(phys_to_virt(vq->vring.desc[i].addr));
+		vring_free_indirect(vq, phys_to_virt(vq->vring.desc[i].addr),
+				    vq->vring.desc[i].len /
+				    sizeof(struct vring_desc));
 
 	while (vq->vring.desc[i].flags & VRING_DESC_F_NEXT) {
 		i = vq->vring.desc[i].next;
@@ -394,6 +1060,8 @@ static void detach_buf(struct vring_virtqueue *vq, unsigned int head)
 
 static inline bool more_used(const struct vring_virtqueue *vq)
 {
+	if (vq->packed)
+		return more_used_packed(vq);
 	return vq->last_used_idx != vq->vring.used->idx;
 }
 
@@ -420,6 +1088,9 @@ void *virtqueue_get_buf(struct virtqueue *_vq, unsigned int *len)
 	unsigned int i;
 	u16 last_used;
 
+	if (vq->packed)
+		return vring_get_buf_packed(vq, len);
+
 	START_USE(vq);
 
 	if (unlikely(vq->broken)) {
@@ -483,6 +1154,11 @@ void virtqueue_disable_cb(struct virtqueue *_vq)
 {
 	struct vring_virtqueue *vq = to_vvq(_vq);
 
+	if (vq->packed) {
+		vring_disable_cb_packed(vq);
+		return;
+	}
+
 	vq->vring.avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
 }
 EXPORT_SYMBOL_GPL(virtqueue_disable_cb);
@@ -502,6 +1178,9 @@ bool virtqueue_enable_cb(struct virtqueue *_vq)
 {
 	struct vring_virtqueue *vq = to_vvq(_vq);
 
+	if (vq->packed)
+		return vring_enable_cb_packed(vq);
+
 	START_USE(vq);
 
 	/* We optimistically turn back on interrupts, then check if there was
@@ -540,6 +1219,9 @@ bool virtqueue_enable_cb_delayed(struct virtqueue *_vq)
 	struct vring_virtqueue *vq = to_vvq(_vq);
 	u16 bufs;
 
+	if (vq->packed)
+		return vring_enable_cb_delayed_packed(vq);
+
 	START_USE(vq);
 
 	/* We optimistically turn back on interrupts, then check if there was
@@ -576,6 +1258,9 @@ void *virtqueue_detach_unused_buf(struct virtqueue *_vq)
 	unsigned int i;
 	void *buf;
 
+	if (vq->packed)
+		return vring_detach_unused_buf_packed(vq);
+
 	START_USE(vq);
 
 	for (i = 0; i < vq->vring.num; i++) {
@@ -638,7 +1323,14 @@ struct virtqueue *vring_new_virtqueue(unsigned int num,
 	if (!vq)
 		return NULL;
 
-	vring_init(&vq->vring, num, pages, vring_align);
+	vq->packed = virtio_has_feature(vdev, VIRTIO_RING_F_PACKED);
+	if (vq->packed) {
+		if (vring_init_packed(vq, num, pages, callback != NULL)) {
+			kfree(vq);
+			return NULL;
+		}
+	} else
+		vring_init(&vq->vring, num, pages, vring_align);
 	vq->vq.callback = callback;
 	vq->vq.vdev = vdev;
 	vq->vq.name = name;
@@ -656,15 +1348,26 @@ struct virtqueue *vring_new_virtqueue(unsigned int num,
 	vq->indirect = virtio_has_feature(vdev, VIRTIO_RING_F_INDIRECT_DESC);
 	vq->event = virtio_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX);
 
+	memset(vq->indirect_pool, 0, sizeof(vq->indirect_pool));
+	vq->indirect_hit = 0;
+	vq->indirect_miss = 0;
+	vq->indirect_oversize = 0;
+	vq->debugfs = NULL;
+	if (vq->indirect) {
+		vring_prefill_indirect(vq);
+		vring_debugfs_add(vq);
+	}
+
 	/* No callback?  Tell other side not to bother us. */
-	if (!callback)
+	if (!callback && !vq->packed)
 		vq->vring.avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
 
 	/* Put everything in free lists. */
 	vq->num_free = num;
 	vq->free_head = 0;
 	for (i = 0; i < num-1; i++) {
-		vq->vring.desc[i].next = i+1;
+		if (!vq->packed)
+			vq->vring.desc[i].next = i+1;
 		vq->data[i] = NULL;
 	}
 	vq->data[i] = NULL;
@@ -675,6 +1378,10 @@ EXPORT_SYMBOL_GPL(vring_new_virtqueue);
 
 void vring_del_virtqueue(struct virtqueue *vq)
 {
+	debugfs_remove_recursive(to_vvq(vq)->debugfs);
+	vring_drain_indirect(to_vvq(vq));
+	if (to_vvq(vq)->packed)
+		kfree(to_vvq(vq)->pk.state);
 	list_del(&vq->list);
 	kfree(to_vvq(vq));
 }
@@ -691,6 +1398,8 @@ void vring_transport_features(struct virtio_device *vdev)
 			break;
 		case VIRTIO_RING_F_EVENT_IDX:
 			break;
+		case VIRTIO_RING_F_PACKED:
+			break;
 		default:
 			/* We don't understand this bit. */
 			clear_bit(i, vdev->features);
@@ -715,4 +1424,19 @@ unsigned int virtqueue_get_vring_size(struct virtqueue *_vq)
 }
 EXPORT_SYMBOL_GPL(virtqueue_get_vring_size);
 
+static int __init vring_init(void)
+{
+	vring_debugfs_root = debugfs_create_dir("virtio_ring", NULL);
+	if (IS_ERR(vring_debugfs_root))
+		vring_debugfs_root = NULL;
+	return 0;
+}
+
+static void __exit vring_exit(void)
+{
+	debugfs_remove_recursive(vring_debugfs_root);
+}
+core_initcall(vring_init);
+module_exit(vring_exit);
+
 MODULE_LICENSE("GPL");
@@ -0,0 +1,30 @@
+#ifndef __LINUX_MARUFB_H__
+#define __LINUX_MARUFB_H__
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+ * Damage reporting of the maru framebuffer. A client that draws through
+ * mmap() tells the driver which parts of the framebuffer it has changed.
+ * The rectangles are in framebuffer coordinates (including the panning
+ * offset). count == 0 marks the whole framebuffer as damaged.
+ */
+struct marufb_rect {
+	__u16 x;
+	__u16 y;
+	__u16 w;
+	__u16 h;
+};
+
+struct marufb_damage_req {
+	__u32 count;
+	__u32 reserved;
+	__u64 rects;		/* struct marufb_rect __user * */
+};
+
+#define MARUFB_DAMAGE_REQ_MAX	256
+
+#define MARUFB_IOCTL_DAMAGE	_IOW('F', 0x80, struct marufb_damage_req)
+
+#endif /* __LINUX_MARUFB_H__ */
@@ -32,6 +32,25 @@ int virtqueue_add_buf(struct virtqueue *vq,
 		      void *data,
 		      gfp_t gfp);
 
+/**
+ * virtqueue_buf - one buffer for virtqueue_add_buf_batch()
+ * @sg: the description of the buffer(s).
+ * @out: the number of sg readable by other side
+ * @in: the number of sg which are writable (after readable ones)
+ * @data: the token identifying the buffer.
+ */
+struct virtqueue_buf {
+	struct scatterlist *sg;
+	unsigned int out;
+	unsigned int in;
+	void *data;
+};
+
+int virtqueue_add_buf_batch(struct virtqueue *vq,
+			    struct virtqueue_buf bufs[],
+			    unsigned int *num,
+			    gfp_t gfp);
+
 void virtqueue_kick(struct virtqueue *vq);
 
 bool virtqueue_kick_prepare(struct virtqueue *vq);
@@ -39,6 +39,8 @@
 #define VIRTIO_BLK_F_SCSI	7	/* Supports scsi command passthru */
 #define VIRTIO_BLK_F_FLUSH	9	/* Cache flush command support */
 #define VIRTIO_BLK_F_TOPOLOGY	10	/* Topology information is available */
+#define VIRTIO_BLK_F_DISCARD	13	/* DISCARD is supported */
+#define VIRTIO_BLK_F_WRITE_ZEROES	14	/* WRITE ZEROES is supported */
 
 #define VIRTIO_BLK_ID_BYTES	20	/* ID string length */
 
@@ -69,6 +71,25 @@ struct virtio_blk_config {
 	/* optimal sustained I/O size in logical blocks. */
 	__u32 opt_io_size;
 
+	/* writeback mode and number of queues, not used here */
+	__u8 unused0[4];
+
+	/* the next 3 entries are guarded by VIRTIO_BLK_F_DISCARD */
+	/* maximum discard sectors for one segment. */
+	__u32 max_discard_sectors;
+	/* maximum number of discard segments in a request. */
+	__u32 max_discard_seg;
+	/* discard granularity in 512-byte sectors. */
+	__u32 discard_sector_alignment;
+
+	/* the next 3 entries are guarded by VIRTIO_BLK_F_WRITE_ZEROES */
+	/* maximum write zeroes sectors for one segment. */
+	__u32 max_write_zeroes_sectors;
+	/* maximum number of write zeroes segments in a request. */
+	__u32 max_write_zeroes_seg;
+	/* set if the device may unmap a write zeroes range. */
+	__u8 write_zeroes_may_unmap;
+	__u8 unused1[3];
 } __attribute__((packed));
 
 /*
@@ -95,6 +116,12 @@ struct virtio_blk_config {
 /* Get device ID command */
 #define VIRTIO_BLK_T_GET_ID    8
 
+/* Discard command */
+#define VIRTIO_BLK_T_DISCARD	11
+
+/* Write zeroes command */
+#define VIRTIO_BLK_T_WRITE_ZEROES	13
+
 /* Barrier before this op. */
 #define VIRTIO_BLK_T_BARRIER	0x80000000
 
@@ -108,6 +135,22 @@ struct virtio_blk_outhdr {
 	__u64 sector;
 };
 
+/*
+ * Data of VIRTIO_BLK_T_DISCARD and VIRTIO_BLK_T_WRITE_ZEROES, one per
+ * range, following the outhdr.
+ */
+struct virtio_blk_discard_write_zeroes {
+	/* Sector (ie. 512 byte offset) */
+	__u64 sector;
+	/* Number of 512 byte sectors */
+	__u32 num_sectors;
+	/* VIRTIO_BLK_WRITE_ZEROES_FLAG_* */
+	__u32 flags;
+};
+
+/* The device may deallocate the range instead of writing zeroes. */
+#define VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP	0x1
+
 struct virtio_scsi_inhdr {
 	__u32 errors;
 	__u32 data_len;
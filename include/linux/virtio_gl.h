@@ -0,0 +1,64 @@
+#ifndef _LINUX_VIRTIO_GL_H
+#define _LINUX_VIRTIO_GL_H
+/* This header is BSD licensed so anyone can use the definitions to implement
+ * compatible drivers/servers. */
+#include <linux/types.h>
+#include <linux/ioctl.h>
+#include <linux/virtio_ids.h>
+#include <linux/virtio_config.h>
+
+/*
+ * Every request on the virtqueue is laid out as
+ *	struct virtio_gl_hdr			(driver -> host)
+ *	buffers without VIRTIO_GL_BUF_IN	(driver -> host)
+ *	buffers with VIRTIO_GL_BUF_IN		(host -> driver)
+ *	struct virtio_gl_status			(host -> driver)
+ * The buffers are the submitter's own pages, in the order given.
+ */
+struct virtio_gl_hdr {
+	__u32 pid;		/* owner of the GL context */
+	__u32 nr_bufs;
+	__u64 id;		/* submitter's cookie */
+	__u32 out_len;		/* bytes for the host */
+	__u32 in_len;		/* bytes the host may write */
+};
+
+struct virtio_gl_status {
+	__s32 status;		/* 0 or a negative errno */
+	__u32 len;		/* bytes written into the in buffers */
+};
+
+/* /dev/glmem interface */
+struct virtio_gl_buf {
+	__u64 addr;
+	__u32 len;
+	__u32 flags;
+};
+
+#define VIRTIO_GL_BUF_IN	0x1	/* written by the host */
+
+struct virtio_gl_submit {
+	__u64 bufs;		/* struct virtio_gl_buf[nr_bufs] */
+	__u32 nr_bufs;
+	__u32 reserved;
+	__u64 id;		/* echoed in struct virtio_gl_completion */
+};
+
+/* read() returns an array of these, poll() reports POLLIN when one is ready */
+struct virtio_gl_completion {
+	__u64 id;
+	__s32 status;
+	__u32 len;
+};
+
+#define VIRTIO_GL_MAX_BUFS	16
+#define VIRTIO_GL_MAX_INFLIGHT	32	/* submitted but not read, per open */
+
+/*
+ * Returns 0 once the request is queued, -EAGAIN with O_NONBLOCK when
+ * VIRTIO_GL_MAX_INFLIGHT completions are outstanding, -E2BIG when the
+ * buffers span more pages than the virtqueue can carry.
+ */
+#define VIRTIO_GL_IOC_SUBMIT	_IOW('G', 0x00, struct virtio_gl_submit)
+
+#endif /* _LINUX_VIRTIO_GL_H */
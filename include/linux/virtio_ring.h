@@ -58,6 +58,25 @@
  * at the end of the used ring. Guest should ignore the used->flags field. */
 #define VIRTIO_RING_F_EVENT_IDX		29
 
+/* Descriptors and used entries share a single ring, see struct
+ * vring_packed.  The specification puts this at bit 34, which the 32 bit
+ * feature word of these transports cannot carry. */
+#define VIRTIO_RING_F_PACKED		31
+
+/* Packed ring: the driver flips AVAIL, the device flips USED.  A
+ * descriptor is available when AVAIL matches the driver's wrap counter
+ * and USED does not, used when both match the device's wrap counter. */
+#define VRING_PACKED_DESC_F_AVAIL	7
+#define VRING_PACKED_DESC_F_USED	15
+
+/* Packed ring event suppression flags. */
+#define VRING_PACKED_EVENT_FLAG_ENABLE	0x0
+#define VRING_PACKED_EVENT_FLAG_DISABLE	0x1
+/* Only notify for the descriptor at off_wrap (needs EVENT_IDX). */
+#define VRING_PACKED_EVENT_FLAG_DESC	0x2
+/* The wrap counter of the off_wrap descriptor is in the top bit. */
+#define VRING_PACKED_EVENT_F_WRAP_CTR	15
+
 /* Virtio ring descriptors: 16 bytes.  These can chain together via "next". */
 struct vring_desc {
 	/* Address (guest-physical). */
@@ -100,6 +119,37 @@ struct vring {
 	struct vring_used *used;
 };
 
+/* Packed ring descriptors: 16 bytes, used in place by the device. */
+struct vring_packed_desc {
+	/* Address (guest-physical). */
+	__u64 addr;
+	/* Length, or bytes written when used. */
+	__u32 len;
+	/* Buffer id, returned by the device in the last used descriptor. */
+	__u16 id;
+	/* VRING_DESC_F_* and the AVAIL/USED bits. */
+	__u16 flags;
+};
+
+struct vring_packed_desc_event {
+	/* Descriptor index and wrap counter to notify at. */
+	__u16 off_wrap;
+	/* VRING_PACKED_EVENT_FLAG_* */
+	__u16 flags;
+};
+
+struct vring_packed {
+	unsigned int num;
+
+	struct vring_packed_desc *desc;
+
+	/* Written by the driver: when the device should interrupt. */
+	struct vring_packed_desc_event *driver;
+
+	/* Written by the device: when the driver should kick. */
+	struct vring_packed_desc_event *device;
+};
+
 /* The standard layout for the ring is a continuous chunk of memory which looks
  * like this.  We assume num is a power of 2.
  *
@@ -146,6 +196,25 @@ static inline unsigned vring_size(unsigned int num, unsigned long align)
 		+ sizeof(__u16) * 3 + sizeof(struct vring_used_elem) * num;
 }
 
+/* The packed layout uses the same memory as the standard one, and fits in
+ * vring_size():
+ *
+ * struct vring_packed
+ * {
+ *	struct vring_packed_desc desc[num];
+ *	struct vring_packed_desc_event driver;
+ *	struct vring_packed_desc_event device;
+ * };
+ */
+static inline void vring_packed_init(struct vring_packed *vr, unsigned int num,
+				     void *p)
+{
+	vr->num = num;
+	vr->desc = p;
+	vr->driver = (void *)&vr->desc[num];
+	vr->device = vr->driver + 1;
+}
+
 /* The following is used with USED_EVENT_IDX and AVAIL_EVENT_IDX */
 /* Assuming a given event_idx value from the other size, if
  * we have just incremented index from old to new_idx,
@@ -257,6 +257,7 @@ p9_virtio_request(struct p9_client *client, struct p9_req_t *req)
 	int err;
 	int in, out;
 	unsigned long flags;
+	bool kick;
 	struct virtio_chan *chan = client->trans;
 
 	p9_debug(P9_DEBUG_TRANS, "9p debug: virtio request\n");
@@ -292,9 +293,16 @@ req_retry:
 			return -EIO;
 		}
 	}
-	virtqueue_kick(chan->vq);
+	kick = virtqueue_kick_prepare(chan->vq);
 	spin_unlock_irqrestore(&chan->lock, flags);
 
+	/*
+	 * The notification exits to the host; with the lock dropped,
+	 * requests added by other threads meanwhile share it.
+	 */
+	if (kick)
+		virtqueue_notify(chan->vq);
+
 	p9_debug(P9_DEBUG_TRANS, "virtio request kicked\n");
 	return 0;
 }
@@ -352,6 +360,7 @@ p9_virtio_zc_request(struct p9_client *client, struct p9_req_t *req,
 {
 	int in, out, err;
 	unsigned long flags;
+	bool kick;
 	int in_nr_pages = 0, out_nr_pages = 0;
 	struct page **in_pages = NULL, **out_pages = NULL;
 	struct virtio_chan *chan = client->trans;
@@ -436,8 +445,10 @@ req_retry_pinned:
 			goto err_out;
 		}
 	}
-	virtqueue_kick(chan->vq);
+	kick = virtqueue_kick_prepare(chan->vq);
 	spin_unlock_irqrestore(&chan->lock, flags);
+	if (kick)
+		virtqueue_notify(chan->vq);
 	p9_debug(P9_DEBUG_TRANS, "virtio request kicked\n");
 	err = wait_event_interruptible(*req->wq,
 				       req->status >= REQ_STATUS_RCVD);